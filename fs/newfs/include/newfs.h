@@ -11,6 +11,8 @@
 #include <stddef.h>
 #include "ddriver.h"
 #include "errno.h"
+#include <pthread.h>
+#include <sched.h>
 #include "types.h"
 #include "stdint.h"
 
@@ -22,28 +24,184 @@
 *******************************************************************************/
 #define NFS_DBG(fmt, ...) do { printf("NFS_DBG: " fmt, ##__VA_ARGS__); } while(0) 
 
+#ifndef NDEBUG
+extern __thread long nfs_load_cnt;
+extern long nfs_head_pos;
+extern long nfs_head_travel;
+#endif
+
 /******************************************************************************
 * SECTION: newfs_utils.c
 *******************************************************************************/
 char* 			   nfs_get_fname(const char* path);
+struct nfs_dentry* new_dentry(char * fname, NFS_FILE_TYPE ftype);
+void               nfs_discard_dentry(struct nfs_dentry * dentry);
 int 			   nfs_calc_lvl(const char * path);
-int 			   nfs_driver_read(int offset, uint8_t *out_content, int size);
-int 			   nfs_driver_write(int offset, uint8_t *in_content, int size);
+const char*        nfs_next_fname(const char ** cursor, int * len);
+const char*        nfs_peek_fname(const char * cursor);
+int 			   nfs_driver_read(off_t offset, uint8_t *out_content, int size);
+int 			   nfs_driver_write(off_t offset, uint8_t *in_content, int size);
 
 int 			   nfs_mount(struct custom_options options);
 int 			   nfs_umount();
 
 int 			   nfs_alloc_dentry(struct nfs_inode * inode, struct nfs_dentry * dentry);
 int 			   nfs_drop_dentry(struct nfs_inode * inode, struct nfs_dentry * dentry);
+int                nfs_move_dentry(struct nfs_inode * from, struct nfs_inode * to, struct nfs_dentry * dentry,
+                                   const struct nfs_name * name, uint32_t hash, struct nfs_dentry * target);
 struct nfs_inode*  nfs_alloc_inode(struct nfs_dentry * dentry);
 int                nfs_alloc_data();
+int                nfs_alloc_data_range(int goal, int cnt);
+int                nfs_data_goal(struct nfs_inode * inode);
+int                nfs_free_data(int dno);
+int                nfs_write_inode(struct nfs_inode * inode);
 int 			   nfs_sync_inode(struct nfs_inode * inode);
+int                nfs_fsync_data(struct nfs_inode * inode, boolean datasync);
 int 			   nfs_drop_inode(struct nfs_inode * inode);
+int                nfs_evict_inode(struct nfs_inode * inode);
+void               nfs_free_dentry(struct nfs_dentry * dentry);
 struct nfs_inode*  nfs_read_inode(struct nfs_dentry * dentry, int ino);
+struct nfs_inode*  nfs_get_inode(struct nfs_dentry * dentry);
+void               nfs_inode_get(struct nfs_inode * inode);
+void               nfs_inode_put(struct nfs_inode * inode);
 struct nfs_dentry* nfs_get_dentry(struct nfs_inode * inode, int dir);
+int                nfs_load_data_blks(struct nfs_inode * inode, int start, int cnt);
+int                nfs_flush_data_blks(struct nfs_inode * inode, int start, int cnt);
+void               nfs_rsv_release(struct nfs_inode * inode);
+void               nfs_rsv_release_all(void);
+int                nfs_delalloc_reserve(struct nfs_inode * inode, int cnt);
+int                nfs_delalloc_assign(struct nfs_inode * inode);
+int                nfs_put_tail_blk(struct nfs_inode * inode);
+uint8_t*           nfs_get_data_blk(struct nfs_inode * inode, int blk, boolean alloc);
+int                nfs_inline_prepare(struct nfs_inode * inode, off_t end);
+int                nfs_truncate_data(struct nfs_inode * inode, off_t size);
+int                nfs_fallocate_data(struct nfs_inode * inode, int mode, off_t offset, off_t len);
 
 struct nfs_dentry* nfs_lookup(const char * path, boolean * is_find, boolean* is_root);
 
+/******************************************************************************
+* SECTION: newfs_bitmap.c
+*******************************************************************************/
+int                nfs_bitmap_init(struct nfs_bitmap * bm, uint8_t * map, int nbits);
+void               nfs_bitmap_destroy(struct nfs_bitmap * bm);
+int                nfs_bitmap_alloc(struct nfs_bitmap * bm);
+int                nfs_bitmap_alloc_near(struct nfs_bitmap * bm, int goal);
+int                nfs_bitmap_count_free(struct nfs_bitmap * bm, int start, int len);
+void               nfs_bitmap_set(struct nfs_bitmap * bm, int idx);
+void               nfs_bitmap_free(struct nfs_bitmap * bm, int idx);
+boolean            nfs_bitmap_test(struct nfs_bitmap * bm, int idx);
+int                nfs_bitmap_pop_dirty(struct nfs_bitmap * bm);
+
+/******************************************************************************
+* SECTION: newfs_rbtree.c
+*******************************************************************************/
+void               nfs_rb_link(struct nfs_rb_node * node, struct nfs_rb_node * parent, 
+                               struct nfs_rb_node ** link);
+void               nfs_rb_insert_fixup(struct nfs_rb_root * root, struct nfs_rb_node * node);
+void               nfs_rb_erase(struct nfs_rb_root * root, struct nfs_rb_node * node);
+struct nfs_rb_node* nfs_rb_first(struct nfs_rb_root * root);
+struct nfs_rb_node* nfs_rb_next(struct nfs_rb_node * node);
+struct nfs_rb_node* nfs_rb_prev(struct nfs_rb_node * node);
+
+/******************************************************************************
+* SECTION: newfs_extent.c
+*******************************************************************************/
+void               nfs_extent_init(struct nfs_extent_tree * tree, int boundary);
+int                nfs_extent_build(struct nfs_extent_tree * tree, struct nfs_bitmap * bm, int base);
+void               nfs_extent_destroy(struct nfs_extent_tree * tree);
+int                nfs_extent_alloc_range(struct nfs_extent_tree * tree, int start, int len);
+int                nfs_extent_free_range(struct nfs_extent_tree * tree, int start, int len);
+int                nfs_extent_best_fit(struct nfs_extent_tree * tree, int len);
+int                nfs_extent_exact(struct nfs_extent_tree * tree, int len);
+int                nfs_extent_near(struct nfs_extent_tree * tree, int goal, int len);
+
+/******************************************************************************
+* SECTION: newfs_dcache.c
+*******************************************************************************/
+int                nfs_dindex_reserve(struct nfs_inode * inode, int cnt);
+int                nfs_dindex_insert(struct nfs_inode * inode, struct nfs_dentry * dentry);
+void               nfs_dindex_remove(struct nfs_inode * inode, struct nfs_dentry * dentry);
+struct nfs_dentry* nfs_dindex_find(struct nfs_inode * inode, const char * name, int len);
+void               nfs_dindex_free(struct nfs_inode * inode);
+struct nfs_dentry* nfs_pcache_find(const char * path, int len);
+void               nfs_pcache_insert(const char * path, int len, struct nfs_dentry * dentry, uint32_t seq);
+void               nfs_pcache_invalidate_tree(struct nfs_dentry * dentry);
+void               nfs_dcache_unhash(struct nfs_dentry * dentry);
+void               nfs_pcache_clear();
+struct nfs_dentry* nfs_ncache_find(const char * path, int len);
+void               nfs_ncache_insert(const char * path, int len, struct nfs_dentry * parent, uint32_t gen);
+void               nfs_ncache_clear();
+struct nfs_inode*  nfs_icache_find(int ino);
+void               nfs_icache_insert(struct nfs_inode * inode);
+void               nfs_icache_remove(struct nfs_inode * inode);
+void               nfs_icache_clear();
+
+/******************************************************************************
+* SECTION: newfs_epoch.c
+*******************************************************************************/
+int                nfs_epoch_init(void);
+void               nfs_epoch_destroy(void);
+void               nfs_epoch_enter(void);
+void               nfs_epoch_exit(void);
+void               nfs_epoch_retire(struct nfs_rcu_head * head, void (*func)(struct nfs_rcu_head *));
+
+/******************************************************************************
+* SECTION: newfs_slab.c
+*******************************************************************************/
+void               nfs_slab_init(void);
+void               nfs_slab_destroy(void);
+void*              nfs_slab_alloc(NFS_SLAB_TYPE type);
+void               nfs_slab_free(NFS_SLAB_TYPE type, void * obj);
+
+/******************************************************************************
+* SECTION: newfs_name.c
+*******************************************************************************/
+void               nfs_name_init(void);
+void               nfs_name_destroy(void);
+const struct nfs_name* nfs_name_get(const char * str, int len, uint32_t hash);
+void               nfs_name_put(const struct nfs_name * name);
+
+/******************************************************************************
+* SECTION: newfs_itable.c
+*******************************************************************************/
+int                nfs_itable_init(void);
+void               nfs_itable_destroy(void);
+int                nfs_itable_read(int ino, uint8_t * out);
+int                nfs_itable_write(int ino, const struct nfs_inode_d * inode_d, const uint8_t * inline_data);
+
+/******************************************************************************
+* SECTION: newfs_journal.c
+*******************************************************************************/
+int                nfs_journal_init(boolean is_init);
+void               nfs_journal_destroy(void);
+void               nfs_journal_start(void);
+void               nfs_journal_stop(void);
+int                nfs_journal_commit(void);
+void               nfs_journal_dirty(struct nfs_inode * inode);
+boolean            nfs_journal_forget(struct nfs_inode * inode);
+boolean            nfs_journal_pending(struct nfs_inode * inode);
+int                nfs_journal_write(int blk, const uint8_t * data);
+int                nfs_journal_revoke(int blk);
+int                nfs_journal_read(off_t offset, uint8_t * out, int size);
+
+/******************************************************************************
+* SECTION: newfs_lru.c
+*******************************************************************************/
+void               nfs_lru_init(int limit);
+void               nfs_lru_destroy(void);
+void               nfs_lru_add(struct nfs_inode * inode);
+void               nfs_lru_del(struct nfs_inode * inode);
+void               nfs_mem_reclaim(void);
+
+/******************************************************************************
+* SECTION: newfs_file.c
+*******************************************************************************/
+struct nfs_file*   nfs_file_open(struct nfs_inode * inode, int flags);
+void               nfs_file_get(struct nfs_file * file);
+void               nfs_file_put(struct nfs_file * file);
+int                nfs_file_read(struct nfs_file * file, char * buf, int size, off_t offset);
+int                nfs_file_write(struct nfs_file * file, const char * buf, int size, off_t offset);
+
 /******************************************************************************
 * SECTION: newfs.c
 *******************************************************************************/
@@ -64,13 +222,22 @@ int   			   newfs_rmdir(const char *);
 int   			   newfs_rename(const char *, const char *);
 int   			   newfs_utimens(const char *, const struct timespec tv[2]);
 int   			   newfs_truncate(const char *, off_t);
+int   			   newfs_ftruncate(const char *, off_t, struct fuse_file_info *);
+int   			   newfs_fgetattr(const char *, struct stat *, struct fuse_file_info *);
+int   			   newfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
+int   			   newfs_flush(const char *, struct fuse_file_info *);
+int   			   newfs_fsync(const char *, int, struct fuse_file_info *);
+int   			   newfs_fsyncdir(const char *, int, struct fuse_file_info *);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+int   			   newfs_releasedir(const char *, struct fuse_file_info *);
 
 /******************************************************************************
 * SECTION: newfs_debug.c
 *******************************************************************************/
 void 			   nfs_dump_map();
+void 			   nfs_dump_io_stat();
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
@@ -35,6 +35,12 @@ typedef enum nfs_file_type {
 #define NFS_ERROR_UNSUPPORTED   ENXIO
 #define NFS_ERROR_IO            EIO     /* Error Input/Output */
 #define NFS_ERROR_INVAL         EINVAL  /* Invalid Args */
+#define NFS_ERROR_NOTDIR        ENOTDIR
+#define NFS_ERROR_NOTEMPTY      ENOTEMPTY
+#define NFS_ERROR_BUSY          EBUSY
+#define NFS_ERROR_FBIG          EFBIG
+#define NFS_ERROR_NOTSUPP       EOPNOTSUPP
+#define NFS_ERROR_NAMETOOLONG   ENAMETOOLONG
 
 #define NFS_MAX_FILE_NAME       128
 #define NFS_INODE_PER_FILE      1
@@ -46,47 +52,290 @@ typedef enum nfs_file_type {
 
 #define NFS_FLAG_BUF_DIRTY      0x1
 #define NFS_FLAG_BUF_OCCUPY     0x2
-
-// 磁盘布局设计,一个逻辑块能放8个inode
+#define NFS_FLAG_INO_UNLINKED   0x4     // 文件已被unlink，但还有打开的句柄
+#define NFS_FLAG_INO_LAYOUT     0x8     // 文件大小或块映射变了，还没写回inode，fdatasync也要写元数据
+
+// 打开文件句柄的预读窗口上限(块数)
+#define NFS_RA_MAX_BLKS         NFS_DATA_PER_FILE
+
+// 顺序追加写时的预留窗口(块数)，初始为NFS_RSV_MIN_BLKS，每次补充翻倍
+#define NFS_RSV_MIN_BLKS        4
+#define NFS_RSV_MAX_BLKS        NFS_DATA_PER_FILE
+
+// 延迟分配的数据块在block_pointer中的取值，写回时才换成真正的块号
+#define NFS_DNO_DELAYED         -1
+// 内联数据: 只有一个块且内容不超过NFS_INLINE_SZ()时，内容直接存放在inode结构之后，
+// 不占数据块，block_pointer[0]记为该值。128B的槽位(每块NFS_INODE_PER_BLK个)里只剩72B，
+// 更大的小文件要多一次数据块IO
+#define NFS_DNO_INLINE          -2
+
+// fallocate的mode，与<linux/falloc.h>中的FALLOC_FL_KEEP_SIZE取值相同
+#define NFS_FALLOC_KEEP_SIZE    0x01
+
+// 目录哈希索引(开放定址，线性探测)
+#define NFS_DINDEX_MIN_SLOTS    16                          // 最小槽位数，必须是2的幂
+#define NFS_DINDEX_TOMB         ((struct nfs_dentry *)1)    // 删除后留下的墓碑标记
+#define NFS_FNV_OFFSET          2166136261u
+#define NFS_FNV_PRIME           16777619u
+
+// 全路径dentry缓存(组相联)
+#define NFS_PCACHE_SETS         1024                        // 组数，必须是2的幂
+#define NFS_PCACHE_WAYS         4                           // 每组路数
+
+// 负向dentry缓存(组相联)，记录"某目录下不存在某名字"
+#define NFS_NCACHE_SETS         256                         // 组数，必须是2的幂
+#define NFS_NCACHE_WAYS         4                           // 每组路数
+#define NFS_NCACHE_NAME_LEN     32                          // 超过该长度的名字不做负向缓存
+#define NFS_DEFAULT_NEG_TIMEOUT 1                           // FUSE negative_timeout默认值(秒)
+
+// 按inode号索引的inode缓存(链式哈希)
+#define NFS_ICACHE_BUCKETS      1024                        // 桶数，必须是2的幂
+
+// 内存上限: 超过后按LRU换出干净、无人引用的inode，直到降到上限的7/8
+#define NFS_DEFAULT_MEM_LIMIT   65536                       // 默认上限(KB)，0表示不限
+#define NFS_MEM_LOW(limit)      ((limit) / 8 * 7)
+
+// 对象池: dentry、inode和数据块缓冲按类型从各自的slab分配，对象按缓存行对齐，
+// 每个线程为每种对象保留一个弹匣，弹匣空了或满了才访问共享的空闲链表
+#define NFS_CACHELINE_SZ        64
+#define NFS_ARENA_CHUNK_SZ      (256 * 1024)                // arena每次向系统申请的大小
+#define NFS_MAG_SZ              32                          // 每个弹匣最多缓存的对象数
+
+// 文件名驻留表: 同名的dentry共用一份名字，名字按长度分档从slab分配，档位大小依次为32、64、128、256字节
+#define NFS_NAME_BUCKETS        4096                        // 桶数，必须是2的幂
+#define NFS_NAME_CLASSES        4
+#define NFS_NAME_MIN_SZ         32
+
+// 基于epoch的延迟回收: 待回收对象攒到这么多时尝试推进epoch
+#define NFS_EPOCH_BATCH         32
+
+// 位图分配器的摘要层数上限，每层把下一层的64个字压成一位
+#define NFS_BITMAP_LEVELS       4
+
+// inode表块缓存(直接映射)，inode按块读写，同一块中相邻inode的装载共用一次IO
+#define NFS_ITABLE_SLOTS        32                          // 缓存的inode表块数，必须是2的幂
+
+// 元数据日志: 磁盘末尾的环形日志区，第一块是日志超级块，其余依次存放事务。
+// 每个事务为 描述块 + 各元数据块的映像 + 提交块，多个操作的修改攒成一个事务顺序写入(group commit)，
+// 映像留在内存里，日志区用掉一半时才写回原位置(检查点)
+#define NFS_JNL_BLKS            256                         // 新格式化的磁盘的日志区块数
+#define NFS_JNL_BUCKETS         256                         // 块映像表的桶数，必须是2的幂
+#define NFS_JNL_INTERVAL        5                           // 后台提交的默认间隔(秒)
+#define NFS_JNL_SB_MAGIC        0x4A534221
+#define NFS_JNL_DESC_MAGIC      0x4A444553
+#define NFS_JNL_COMMIT_MAGIC    0x4A434D54
+
+// 空闲区间就近查找时，向goal两侧各最多查看的区间数
+#define NFS_EXTENT_NEAR_SCAN    64
+
+// 新建顶层目录时，把inode区均分成这么多段，放进空闲最多的一段，使各顶层目录彼此分散
+#define NFS_SPREAD_SLOTS        8
+
+// 磁盘布局设计: 磁盘划分为若干块组，每组为 | Super(1) | Inode Map(*) | DATA Map(*) | INODE(*) | DATA(*) |
+// 第0组的Super块是超级块(含组描述符)，其余组的这一块保留不用。组的大小按磁盘大小在格式化时确定:
+// 每组的数据位图先取一块，组数超过NFS_MAX_GROUPS时按块数加大，使16组能铺满磁盘。
+// 4MB的磁盘只有一组、位图各一块，布局与fs.layout一致
 #define NFS_INODE_PER_BLK       8     // 一个逻辑块能放8个inode
 #define NFS_SUPER_BLKS          1
-#define NFS_INODE_MAP_BLKS      1
-#define NFS_DATA_MAP_BLKS       1
-#define NFS_INODE_BLKS          64    // 4096/8/8(磁盘大小为4096个逻辑块，维护一个文件需要8个逻辑块即一个索引块+七个数据块)
-#define NFS_DATA_BLKS           4029  // 4096-64-1-1-1
+#define NFS_DEFAULT_BYTES_PER_INODE 8192  // 格式化时每8KB磁盘空间配一个inode(维护一个文件需要8个逻辑块即一个索引块+七个数据块)
+#define NFS_GROUP_MIN_BLKS      64    // 尾部不足这么多块的零头不成组
+#define NFS_MAX_GROUPS          16    // 组描述符放在超级块里，数量受超级块大小限制
 
 /******************************************************************************
 * SECTION: Macro Function
 *******************************************************************************/
 #define NFS_IO_SZ()                     (nfs_super.sz_io)    // 512B
 #define NFS_BLK_SZ()                    (nfs_super.sz_blks)  // 1KB
-#define NFS_DISK_SZ()                   (nfs_super.sz_disk)  // 4MB
+#define NFS_DISK_SZ()                   (nfs_super.sz_disk)  // 4MB到上百GB
 #define NFS_DRIVER()                    (nfs_super.fd)
-#define NFS_BLKS_SZ(blks)               ((blks) * NFS_BLK_SZ())
-#define NFS_DENTRY_PER_BLK()            (NFS_BLK_SZ() / sizeof(struct nfs_dentry))
+#define NFS_BLKS_SZ(blks)               ((off_t)(blks) * NFS_BLK_SZ())  // 大磁盘上的偏移超过int，一律按64位算
+#define NFS_BLK_BITS()                  (NFS_BLK_SZ() * UINT8_BITS)  // 一个位图块能覆盖的编号数
+#define NFS_INO_SZ()                    (nfs_super.sz_ino)   // 每个inode在inode区的槽位大小，128B
+#define NFS_JNL_LOG_BLKS()              (nfs_super.jnl_blks - 1)  // 日志区中存放事务的块数
+#define NFS_JNL_DESC_CAP()              ((int)((NFS_BLK_SZ() - sizeof(struct nfs_jdesc_d)) / sizeof(int)))  // 一个描述块能记录的块号数
+#define NFS_INLINE_SZ()                 ((int)(NFS_INO_SZ() - sizeof(struct nfs_inode_d)))  // inode之后可存放内联数据的字节数
+#define NFS_DIRENT_LEN(name_len)        ((int)NFS_ROUND_UP(offsetof(struct nfs_dirent_d, name) + (name_len), 4))  // 目录项记录的最小长度
 
 // 向下取整以及向上取整
 #define NFS_ROUND_DOWN(value, round)    ((value) % (round) == 0 ? (value) : ((value) / (round)) * (round))
 #define NFS_ROUND_UP(value, round)      ((value) % (round) == 0 ? (value) : ((value) / (round) + 1) * (round))
 
-// 复制文件名到某个dentry中
-#define NFS_ASSIGN_FNAME(pnfs_dentry, _fname) memcpy(pnfs_dentry->fname, _fname, strlen(_fname))
+// 调试构建下统计堆分配次数，用来确认查找热路径上没有任何分配
+#ifndef NDEBUG
+extern __thread long nfs_alloc_cnt;
+#define NFS_MALLOC(size)                (nfs_alloc_cnt++, malloc(size))
+#define NFS_CALLOC(cnt, size)           (nfs_alloc_cnt++, calloc(cnt, size))
+#define NFS_ALIGNED_ALLOC(align, size)  (nfs_alloc_cnt++, aligned_alloc(align, size))
+#else
+#define NFS_MALLOC(size)                malloc(size)
+#define NFS_CALLOC(cnt, size)           calloc(cnt, size)
+#define NFS_ALIGNED_ALLOC(align, size)  aligned_alloc(align, size)
+#endif
+
+// 记录常驻内存的inode、dentry、目录索引和数据块缓冲的字节数，释放时传入负数
+#define NFS_MEM_CHARGE(bytes)           __atomic_add_fetch(&nfs_super.mem_used, (long)(bytes), __ATOMIC_RELAXED)
+
+// 由嵌入的成员指针得到外层结构体指针
+#define NFS_CONTAINER_OF(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 // 计算inode和data的偏移量                                     
-#define NFS_INO_OFS(ino)                (nfs_super.inode_offset + NFS_BLKS_SZ(ino))   // inode基地址初始偏移+前面的inode占用的空间
-#define NFS_DATA_OFS(dno)               (nfs_super.data_offset + NFS_BLKS_SZ(dno))     // data基地址初始偏移+前面的data占用的空间
+// inode号和数据块号都是全局编号: 组号 * 每组容量 + 组内序号
+#define NFS_INO_GROUP(ino)              ((ino) / nfs_super.inodes_per_group)
+#define NFS_INO_IDX(ino)                ((ino) % nfs_super.inodes_per_group)
+#define NFS_DNO_GROUP(dno)              ((dno) / nfs_super.data_per_group)
+#define NFS_DNO_IDX(dno)                ((dno) % nfs_super.data_per_group)
+#define NFS_INO_OFS(ino)                (nfs_super.groups[NFS_INO_GROUP(ino)].inode_offset + (off_t)NFS_INO_IDX(ino) * NFS_INO_SZ())   // 所在组inode区的偏移+组内前面的inode占用的空间
+#define NFS_DATA_OFS(dno)               (nfs_super.groups[NFS_DNO_GROUP(dno)].data_offset + NFS_BLKS_SZ(NFS_DNO_IDX(dno)))    // 所在组data区的偏移+组内前面的data占用的空间
 
 // 判断inode指向的是是目录还是普通文件
 #define NFS_IS_DIR(pinode)              (pinode->dentry->ftype == NFS_DIR)
 #define NFS_IS_REG(pinode)              (pinode->dentry->ftype == NFS_REG_FILE)
+#define NFS_MAPPED_BLKS(pinode)         ((pinode)->block_allocted - (pinode)->delay_cnt)   // 已有物理块的数据块数
+#define NFS_IS_INLINE(pinode)           ((pinode)->block_allocted > 0 && (pinode)->block_pointer[0] == NFS_DNO_INLINE)
+#define NFS_BLK_CAP(pinode, blk)        ((blk) == 0 && NFS_IS_INLINE(pinode) ? NFS_INLINE_SZ() : NFS_BLK_SZ())  // 第blk块可用的字节数
 
 /******************************************************************************
 * SECTION: FS Specific Structure - In memory structure
 *******************************************************************************/
 struct custom_options {
 	const char*        device;
+	int                negative_timeout;  // 内核负向dentry缓存时间(秒)
+	int                mem_limit;         // 常驻内存上限(KB)，0表示不限
+	int                bytes_per_inode;   // 格式化时每多少字节磁盘空间配一个inode，0表示默认值；已格式化的磁盘忽略
+	int                commit_interval;   // 日志后台提交的间隔(秒)，0表示不定时提交
+};
+
+// 按64位字扫描的位图分配器，words原地指向磁盘位图在内存中的副本
+struct nfs_bitmap {
+    uint64_t*          words;                           // 位图本体
+    int                nbits;                           // 有效位数
+    int                nwords;                          // 字数
+    int                levels;                          // 摘要层数
+    uint64_t*          sum[NFS_BITMAP_LEVELS];          // sum[0]第w位: words[w]有空闲位; sum[l+1]第w位: sum[l][w]非0
+    int                sum_bits[NFS_BITMAP_LEVELS];     // 各层摘要的有效位数
+    int                hint;                            // next-fit: 上次分配所在的字
+    int                free_cnt;                        // 空闲位数
+    int                blk_words;                       // 一个磁盘位图块包含的字数
+    uint64_t*          dirty;                           // 第b位: 第b个位图块在上次写入日志之后被修改过
+};
+
+// 侵入式红黑树节点，嵌在使用者的结构体里
+struct nfs_rb_node {
+    struct nfs_rb_node* parent;
+    struct nfs_rb_node* left;
+    struct nfs_rb_node* right;
+    boolean             red;
+};
+
+struct nfs_rb_root {
+    struct nfs_rb_node* node;
+};
+
+// 一段连续的空闲数据块[start, start + len)
+struct nfs_extent {
+    int                start;
+    int                len;
+    struct nfs_rb_node by_start;                        // 挂在按起始块号排序的树上
+    struct nfs_rb_node by_len;                          // 挂在按(长度, 起始块号)排序的树上
+};
+
+// 空闲数据块区间索引，与data位图保持同步
+struct nfs_extent_tree {
+    struct nfs_rb_root by_start;
+    struct nfs_rb_root by_len;
+    int                cnt;                             // 区间个数
+    int                boundary;                        // 区间不跨越它的整数倍(每组的数据块数)
+};
+
+// 块映像表的表项: 某个元数据块最新的内容，写回原位置之前读盘都以它为准
+struct nfs_jblk {
+    int                blk;               // 磁盘块号
+    boolean            running;           // 属于还没提交的事务
+    struct nfs_jblk*   hnext;             // 同一桶的下一项
+    uint8_t            data[];            // 块内容
+};
+
+// 延迟回收的链接头，嵌在需要延迟释放的结构体里，宽限期过后调用func
+struct nfs_rcu_head {
+    struct nfs_rcu_head* next;
+    void               (*func)(struct nfs_rcu_head *);
+};
+
+// 每个进入过读侧临界区的线程一条记录，线程退出后记录留给新线程复用
+struct nfs_epoch_rec {
+    uint64_t              state;                    // (进入时看到的全局epoch << 1) | 是否在临界区内
+    int                   depth;                    // 临界区嵌套深度，只有所属线程访问
+    int                   in_use;                   // 是否属于某个存活的线程
+    struct nfs_epoch_rec* next;
+};
+
+typedef enum nfs_slab_type {
+    NFS_SLAB_DENTRY,
+    NFS_SLAB_INODE,
+    NFS_SLAB_BLK,                                       // 数据块缓冲，大小为一个逻辑块
+    NFS_SLAB_NAME,                                      // 驻留的文件名，占用之后NFS_NAME_CLASSES个类型号
+    NFS_SLAB_TYPES = NFS_SLAB_NAME + NFS_NAME_CLASSES
+} NFS_SLAB_TYPE;
+
+// arena向系统申请的一大块内存，slab从中切出对象，卸载时整体释放
+struct nfs_arena_chunk {
+    struct nfs_arena_chunk* next;
+};
+
+// 一种对象的共享空闲链表，空闲对象的第一个字指向下一个空闲对象
+struct nfs_slab {
+    int                obj_sz;                          // 对象大小，按缓存行向上取整，文件名为档位大小
+    void*              free_list;
+    int                free_cnt;
+    pthread_mutex_t    lock;
+};
+
+// 线程私有的对象弹匣，gen与nfs_super.slab_gen不一致说明属于已经卸载的arena，直接作废
+struct nfs_magazine {
+    uint32_t           gen;
+    int                cnt;
+    void*              objs[NFS_MAG_SZ];
 };
 
+// LRU链表节点，嵌在inode里
+struct nfs_lru_node {
+    struct nfs_lru_node* prev;
+    struct nfs_lru_node* next;
+};
+
+// 内存中的块组，位图和分配器都按组独立
+struct nfs_group {
+    int                max_ino;           // 组内inode数量
+    int                max_dno;           // 组内数据块数量
+    off_t              map_inode_offset;  // inode位图在磁盘中的偏移
+    off_t              map_data_offset;   // data位图在磁盘中的偏移
+    off_t              inode_offset;      // inode区在磁盘中的偏移
+    off_t              data_offset;       // data区在磁盘中的偏移
+    uint8_t*           map_inode;         // inode位图内存起点
+    uint8_t*           map_data;          // data位图内存起点
+    struct nfs_bitmap  ino_bmap;          // inode位图分配器，空闲计数即free_cnt
+    struct nfs_bitmap  data_bmap;         // data位图分配器，由nfs_super.alloc_lock保护
+    pthread_mutex_t    ino_lock;          // 保护ino_bmap
+};
+
+/*
+ * 加锁顺序(先左后右，不允许反向):
+ *   ns_lock -> 目录inode的lock -> 普通文件inode的lock -> load_lock
+ *           -> ino_lock / alloc_lock -> dcache_lock / epoch_lock / lru_lock / itable_lock -> jnl_lock -> io_lock
+ * 修改元数据的操作在最外层(ns_lock之前)持有jnl_barrier读锁，见nfs_journal_start。
+ * slab的lock和arena_lock只在分配器内部使用，不再获取其他锁，任何地方都可以调用分配器。
+ * name_lock只保护文件名驻留表，持有期间只会调用分配器。
+ * 同时锁两个目录时(rename)，一个是另一个的祖先则祖先在前，否则inode号小的在前。
+ * 删除dentry或inode的操作(unlink、rmdir、rename以及内存超限时的换出)持有ns_lock写锁，其余修改操作持有读锁，
+ * 因此持有读锁期间拿到的dentry和inode指针不会被释放；
+ * 通过打开句柄进行的操作不经过路径查找，只锁句柄对应的inode。
+ *
+ * 路径查找不加锁: 在epoch临界区内沿目录哈希索引和全路径缓存前进，
+ * 写者用release store发布新的索引和目录项，摘除的dentry、inode和旧索引经nfs_epoch_retire
+ * 等所有读者离开后才释放；rename修改dentry名字和父目录期间rename_seq为奇数，查找据此重试。
+ * getattr只靠epoch，不碰ns_lock，拿到的dentry可能随后被换出，要重新取inode。
+ */
+
 struct nfs_super {
     /* TODO: Define yourself */
     uint32_t           magic;             // 幻数
@@ -94,30 +343,86 @@ struct nfs_super {
 
     int                sz_io;             // 512B
     int                sz_blks;           // 1KB
-    int                sz_disk;           // 4MB
+    int                sz_ino;            // 128B
+    off_t              sz_disk;           // 4MB到上百GB
     int                sz_usage;          // 已使用空间大小
 
-    int                max_ino;           // 索引节点最大数量
-    uint8_t*           map_inode;         // inode位图内存起点
-    int                map_inode_blks;    // inode位图占用的逻辑块数量
-    int                map_inode_offset;  // inode位图在磁盘中的偏移
+    int                max_ino;           // inode号上界(group_cnt * inodes_per_group)
+    int                map_inode_blks;    // 每组inode位图占用的逻辑块数量
 
-    int                max_dno;           // 数据位图最大数量
-    uint8_t*           map_data;          // data位图内存起点
-    int                map_data_blks;     // data位图占用的逻辑块数量
-    int                map_data_offset;   // data位图在磁盘中的偏移
+    int                max_dno;           // 数据块号上界(group_cnt * data_per_group)
+    int                map_data_blks;     // 每组data位图占用的逻辑块数量
+    struct nfs_extent_tree data_extents;  // 空闲数据块区间索引，区间不跨组
+    int                delay_blks;        // 已经预扣、但还没有选定物理位置的数据块数
+    struct nfs_lru_node rsv_list;         // 预留窗口非空的普通文件，由alloc_lock保护
 
-    int                inode_offset;      // inode在磁盘中的偏移
-    int                data_offset;       // data在磁盘中的偏移
+    int                group_cnt;         // 块组数量
+    int                inodes_per_group;  // 每组inode号的跨度(第0组的inode数)
+    int                data_per_group;    // 每组数据块号的跨度(第0组的数据块数)
+    struct nfs_group   groups[NFS_MAX_GROUPS];
 
     boolean            is_mounted;        // 是否挂载
     struct nfs_dentry* root_dentry;       // 根目录dentry
+
+    pthread_rwlock_t   ns_lock;           // 命名空间锁，见上面的加锁顺序
+    pthread_mutex_t    alloc_lock;        // 数据块分配: data位图、空闲区间索引、delay_blks和各文件的预留窗口
+    pthread_mutex_t    load_lock;         // 从磁盘装载inode和inode缓存，避免同一inode被装载两次
+    pthread_mutex_t    dcache_lock;       // 全路径缓存和负向缓存
+    pthread_mutex_t    io_lock;           // 驱动的seek和读写必须成对完成
+    pthread_mutex_t    itable_lock;       // inode表块缓存
+    uint8_t*           itable;            // NFS_ITABLE_SLOTS个缓存块
+    int                itable_blk[NFS_ITABLE_SLOTS]; // 各缓存块对应的磁盘块号，-1表示空
+
+    uint32_t           rename_seq;        // rename修改dentry或换出目录时为奇数，无锁查找据此判断是否要重试
+    uint64_t           epoch;             // 全局epoch，所有在临界区内的线程都已看到它时才推进
+    struct nfs_epoch_rec* epoch_recs;     // 各线程的epoch记录，只增不减
+    pthread_key_t      epoch_key;         // 线程退出时归还epoch记录
+    pthread_mutex_t    epoch_lock;        // 待回收链表
+    struct nfs_rcu_head* limbo[3];        // 按retire时的epoch模3分桶的待回收对象
+    int                limbo_cnt[3];      // 各桶中的对象数
+
+    long               mem_limit;         // 常驻内存上限(字节)，0表示不限
+    long               mem_used;          // 常驻内存(字节)，见NFS_MEM_CHARGE
+    pthread_mutex_t    lru_lock;          // LRU链表
+    struct nfs_lru_node lru;              // 可换出inode的链表头，next一端最久未用
+    int                lru_cnt;           // 链表上的inode数
+
+    struct nfs_slab    slabs[NFS_SLAB_TYPES]; // 各类对象的空闲链表
+    struct nfs_arena_chunk* arena;        // 本次挂载申请的所有大块
+    uint8_t*           arena_cur;         // 当前大块中尚未切分的部分
+    uint8_t*           arena_end;
+    pthread_mutex_t    arena_lock;        // arena的切分
+    uint32_t           slab_gen;          // 每次挂载加一，使各线程弹匣中上一次挂载的对象作废
+
+    off_t              jnl_offset;        // 日志区在磁盘中的偏移
+    int                jnl_blks;          // 日志区块数，0表示没有日志(磁盘太小)
+    int                blks_per_group;    // 每组的块数
+    boolean            jnl_on;            // 元数据经日志写入，卸载时关闭
+    pthread_rwlock_t   jnl_barrier;       // 修改元数据的操作持有读锁，提交持有写锁，事务因此只包含完整的操作
+    pthread_mutex_t    jnl_lock;          // 块映像表、撤销列表、脏inode链表和日志位置
+    struct nfs_jblk*   jnl_map[NFS_JNL_BUCKETS]; // 块映像表，按块号散列
+    int                jnl_cnt;           // 映像数
+    int                jnl_run;           // 其中属于还没提交的事务的映像数
+    int*               jnl_revoke;        // 还没提交的事务中作废的块号: 释放掉的目录块，重放时不能再写回
+    int                jnl_revoke_cnt;
+    int                jnl_revoke_cap;
+    struct nfs_lru_node jnl_dirty;        // 元数据有改动、还没写进日志的inode
+    int                jnl_dirty_cnt;
+    int                jnl_start;         // 最早一个还没做检查点的事务在日志区中的位置
+    uint32_t           jnl_start_seq;     // 该事务的序号
+    int                jnl_head;          // 下一个事务写入的位置
+    uint32_t           jnl_seq;           // 下一个事务的序号
+    pthread_t          jnl_thread;        // 定时提交的后台线程
+    pthread_cond_t     jnl_cond;          // 唤醒后台线程，与jnl_lock配合
+    boolean            jnl_stop;          // 通知后台线程退出
+    int                jnl_interval;      // 后台提交的间隔(秒)，0表示只在攒够修改、fsync和卸载时提交
+    pthread_mutex_t    name_lock;         // 文件名驻留表
 };
 
 struct nfs_inode {
     /* TODO: Define yourself */
     uint32_t           ino;                               // 索引编号                         
-    int                size;                              // 文件占用空间
+    off_t              size;                              // 文件占用空间
     int                link;                              // 连接数默认为1(不考虑软链接和硬链接)
     int                block_pointer[NFS_DATA_PER_FILE];  // 数据块索引
     int                dir_cnt;                           // 如果是目录型文件，则代表有几个目录项
@@ -126,35 +431,176 @@ struct nfs_inode {
     NFS_FILE_TYPE      ftype;                             // 文件类型
     uint8_t*           data[NFS_DATA_PER_FILE];           // 指向数据块的指针
     int                block_allocted;                    // 已分配数据块数量
+    struct nfs_dindex* dir_index;                         // 目录型文件: 子dentry的哈希索引，无锁读取
+    int                dir_index_used;                    // 已占用槽位数(含墓碑)
+    int                dir_off_next;                      // 目录型文件: 下一个加入的目录项的readdir偏移
+    int                open_cnt;                          // 被open/opendir打开的次数
+    int                refcnt;                            // 引用数: 指向它的dentry一个，每个打开句柄和目录游标各一个
+    struct nfs_inode*  hnext;                             // inode缓存中同一桶的下一个inode
+    struct nfs_lru_node lru;                              // 挂在nfs_super.lru上，根目录不挂
+    int                lru_ref;                           // 上次扫描之后被访问过，扫描时再给一次机会
+    uint32_t           data_dirty;                        // 普通文件: 脏数据块位图，第i位对应data[i]
+    struct nfs_lru_node jnl_dirty;                        // 元数据改动还没写进日志时挂在nfs_super.jnl_dirty上
+    int                flags;                             // NFS_FLAG_INO_*
+    int                rsv_start;                         // 普通文件: 预留窗口起始数据块号，紧接在最后一个数据块之后
+    int                rsv_len;                           // 预留窗口中还未使用的块数，这些块已从分配器中拿走
+    int                rsv_win;                           // 下次补充预留窗口时的大小，0表示不预留
+    struct nfs_lru_node rsv_node;                         // 预留窗口非空时挂在nfs_super.rsv_list上
+    int                delay_cnt;                         // 尾部还没有物理块的数据块数(延迟分配)
+    pthread_rwlock_t   lock;                              // 保护上面的字段、目录项链表和哈希索引的修改
+    pthread_mutex_t    load_lock;                         // 持有读锁的读者装载数据块时互斥，持有写锁时不必再加
+    struct nfs_rcu_head rcu;                              // 释放后等宽限期过去再回收
+};
+
+// 驻留的文件名，同名的dentry共用一份，引用计数归零后经epoch回收
+struct nfs_name {
+    union {
+        struct {
+            struct nfs_name* next;                  // 驻留表的桶内链表
+            uint32_t         refcnt;                // 引用它的dentry数，由name_lock保护
+            uint32_t         hash;                  // 即nfs_name_hash(str, len)
+        };
+        struct nfs_rcu_head rcu;                    // 离开驻留表之后才使用
+    };
+    uint16_t           len;                         // 不含结尾的'\0'
+    char               str[];
 };
 
+/*
+ * dentry正好一个缓存行: 路径查找用到的字段在前，名字在驻留表中，只存指针。
+ * neg_cnt和d_off只在dentry挂在目录树上时使用，与释放后才用的rcu共用空间。
+ */
 struct nfs_dentry {
-    /* TODO: Define yourself */
-    char               fname[NFS_MAX_FILE_NAME];    // dentry指向的文件名
-    struct nfs_dentry* parent;                      // 父目录的dentry            
-    struct nfs_dentry* brother;                     // 兄弟dentry
+    uint32_t           hash;                        // 文件名哈希，建立目录索引时缓存
+    uint8_t            ftype;                       // 文件类型(NFS_FILE_TYPE)
+    uint8_t            unhashed;                    // 已从目录树中摘除，不能再进入路径缓存，由dcache_lock保护
     int                ino;                         // 指向的inode编号
+    uint32_t           dir_gen;                     // 目录型文件: 目录项增删时递增，用于使负向缓存和readdir游标失效
+    const struct nfs_name* name;                    // 文件名，rename时整体替换
     struct nfs_inode*  inode;                       // 指向的inode  
-    NFS_FILE_TYPE      ftype;                       // 文件类型
+    struct nfs_dentry* parent;                      // 父目录的dentry            
+    struct nfs_dentry* brother;                     // 兄弟dentry
+    union {
+        struct {
+            int        neg_cnt;                     // 目录型文件: 以它为父目录的负向缓存项数量
+            int        d_off;                       // 在父目录中的readdir偏移，链表上从头到尾递减
+        };
+        struct nfs_rcu_head rcu;                    // 释放后等宽限期过去再回收
+    };
+};
+
+// 目录哈希索引的一个槽位，哈希值与dentry指针放在一起，探测时先比哈希再解引用
+struct nfs_dindex_slot {
+    uint32_t           hash;
+    struct nfs_dentry* dentry;                      // NULL为空槽，NFS_DINDEX_TOMB为墓碑
+};
+
+// 目录哈希索引，槽位数和槽位放在一起，扩容时整体替换，无锁的读者不会看到不一致的大小
+struct nfs_dindex {
+    struct nfs_rcu_head rcu;
+    int                 cap;                        // 槽位数(2的幂)
+    struct nfs_dindex_slot slot[];
+};
+
+// opendir时分配、保存在fi->fh中的目录游标，readdir从上次停下的位置继续
+struct nfs_dir_cursor {
+    struct nfs_dentry* dir;                         // 被打开的目录
+    struct nfs_dentry* next;                        // 下一个要输出的目录项
+    off_t              offset;                      // 已输出的最后一项的偏移
+    uint32_t           gen;                         // 保存游标时目录的dir_gen
+};
+
+// open时分配、保存在fi->fh中的文件句柄，钉住inode，read/write等直接使用，不再解析路径
+struct nfs_file {
+    struct nfs_inode*  inode;                       // 打开的文件
+    int                refcnt;                      // 句柄引用计数
+    int                flags;                       // open时的标志
+    int                ra_next;                     // 顺序读时预期的下一个块，同一句柄上的读可能并发，原子读写
+    int                ra_size;                     // 当前预读窗口大小(块数)，同上
+    int                wb_start;                    // write-behind窗口中第一个未写回的块
+    off_t              wb_next;                     // 顺序写时预期的下一个偏移
+};
+
+// 全路径缓存项，只记录哈希和长度，命中后沿dentry父链逐段核对
+struct nfs_pcache_entry {
+    uint32_t           hash;
+    int                len;
+    struct nfs_dentry* dentry;
+};
+
+struct nfs_pcache_set {
+    struct nfs_pcache_entry way[NFS_PCACHE_WAYS];
+    int                victim;                      // 下一次替换的路
+};
+
+// 在已有哈希值的基础上继续累加一段字符串(FNV-1a可以分段计算)
+static inline uint32_t nfs_hash_extend(uint32_t hash, const char * str, int len) {
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= NFS_FNV_PRIME;
+    }
+    return hash;
+}
+
+// 负向缓存项，gen与父目录的dir_gen不一致即视为失效
+struct nfs_ncache_entry {
+    uint32_t           hash;
+    int                len;
+    struct nfs_dentry* parent;
+    uint32_t           gen;
+    int                name_len;
+    char               name[NFS_NCACHE_NAME_LEN];
+};
 
+struct nfs_ncache_set {
+    struct nfs_ncache_entry way[NFS_NCACHE_WAYS];
+    int                victim;
 };
 
-// 生成新的dentry
-static inline struct nfs_dentry* new_dentry(char * fname, NFS_FILE_TYPE ftype) {
-    struct nfs_dentry * dentry = (struct nfs_dentry *)malloc(sizeof(struct nfs_dentry));
-    memset(dentry, 0, sizeof(struct nfs_dentry));
-    NFS_ASSIGN_FNAME(dentry, fname);
-    dentry->ftype   = ftype;
-    dentry->ino     = -1;
-    dentry->inode   = NULL;
-    dentry->parent  = NULL;
-    dentry->brother = NULL;  
-    return dentry;                                          
+// 文件名哈希(FNV-1a)
+static inline uint32_t nfs_name_hash(const char * name, int len) {
+    return nfs_hash_extend(NFS_FNV_OFFSET, name, len);
+}
+
+// 顺序计数器: 写者修改期间为奇数，读者前后两次读到相同的偶数才说明没有撞上修改
+static inline uint32_t nfs_seq_read_begin(uint32_t * seq) {
+    uint32_t val;
+
+    while ((val = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return val;
+}
+
+static inline boolean nfs_seq_read_retry(uint32_t * seq, uint32_t val) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != val;
+}
+
+static inline void nfs_seq_write_begin(uint32_t * seq) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void nfs_seq_write_end(uint32_t * seq) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
 }
 
 /******************************************************************************
 * SECTION: FS Specific Structure - To Disk structure
 *******************************************************************************/
+// 各偏移以块为单位
+struct nfs_group_d {
+    int                max_ino;           // 组内inode数量
+    int                max_dno;           // 组内数据块数量
+    int                map_inode_offset;  // inode位图在磁盘中的偏移
+    int                map_data_offset;   // data位图在磁盘中的偏移
+    int                inode_offset;      // inode区在磁盘中的偏移
+    int                data_offset;       // data区在磁盘中的偏移
+    int                free_inodes;       // 空闲inode数
+    int                free_blocks;       // 空闲数据块数
+};
+
 struct nfs_super_d {
     uint32_t           magic;             // 幻数
     int                sz_usage;          // 已使用空间大小
@@ -169,22 +615,61 @@ struct nfs_super_d {
 
     int                inode_offset;      // inode在磁盘中的偏移
     int                data_offset;       // data在磁盘中的偏移
+
+    int                group_cnt;         // 块组数量
+    int                inodes_per_group;  // 每组inode号的跨度
+    int                data_per_group;    // 每组数据块号的跨度
+    struct nfs_group_d groups[NFS_MAX_GROUPS];
+    int                sz_ino;            // inode槽位大小
+    int                jnl_offset;        // 日志区在磁盘中的偏移(块)
+    int                jnl_blks;          // 日志区块数，0表示没有日志(磁盘太小)
+    int                blks_per_group;    // 每组的块数，为0的是旧版本格式化的磁盘，不能挂载
+};
+
+// 日志超级块: 重放从start处序号为seq的事务开始，直到序号不连续或提交块校验失败
+struct nfs_jsb_d {
+    uint32_t           magic;
+    uint32_t           seq;               // start处事务的序号
+    int                start;             // 日志区内的块位置(不含日志超级块)
+};
+
+// 事务描述块，blks依次是nr_blks个映像的原位置块号和nr_revoke个作废的块号
+struct nfs_jdesc_d {
+    uint32_t           magic;
+    uint32_t           seq;
+    int                nr_blks;
+    int                nr_revoke;
+    int                blks[];
+};
+
+// 事务提交块，csum覆盖描述块和全部映像
+struct nfs_jcommit_d {
+    uint32_t           magic;
+    uint32_t           seq;
+    uint32_t           csum;
 };
 
 struct nfs_inode_d {
     uint32_t           ino;                               // 索引编号                         
-    int                size;                              // 文件占用空间(用了多少个逻辑块) 
     int                link;                              // 连接数默认为1(不考虑软链接和硬链接)
+    int64_t            size;                              // 文件大小(字节)，与内存中的off_t同宽
     int                block_pointer[NFS_DATA_PER_FILE];  // 数据块索引
     int                dir_cnt;                           // 如果是目录型文件，则代表有几个目录项
     NFS_FILE_TYPE      ftype;                             // 文件类型
     int                block_allocted;                    // 已分配数据块数量
 };
 
-struct nfs_dentry_d {
-    char               fname[NFS_MAX_FILE_NAME];    // dentry指向的文件名
-    int                ino;                         // 指向的inode编号
-    NFS_FILE_TYPE      ftype;                       // 文件类型
+/*
+ * 目录数据块中的变长目录项记录(ext2风格)。每个块被记录首尾相接地铺满，rec_len是到下一条记录的距离，
+ * 记录实际只需要NFS_DIRENT_LEN(name_len)字节，多出的部分是空闲空间，插入时可以拆出来用。
+ * 删除的记录并入同一块中的前一条；块中第一条记录被删除时只把ino置0(根目录不会作为目录项出现)。
+ */
+struct nfs_dirent_d {
+    int                ino;                         // 指向的inode编号，0表示空闲记录
+    uint16_t           rec_len;                     // 记录总长度，4字节对齐
+    uint8_t            name_len;                    // 文件名长度
+    uint8_t            ftype;                       // 文件类型
+    char               name[];                      // 文件名，不以'\0'结尾
 };
 
 #endif /* _TYPES_H_ */
\ No newline at end of file
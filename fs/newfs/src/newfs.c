@@ -12,6 +12,10 @@
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--negative_timeout=%d", negative_timeout),
+	OPTION("--mem_limit=%d", mem_limit),
+	OPTION("--bytes_per_inode=%d", bytes_per_inode),
+	OPTION("--commit_interval=%d", commit_interval),
 	FUSE_OPT_END
 };
 
@@ -27,18 +31,244 @@ static struct fuse_operations operations = {
 	.getattr = newfs_getattr,				 /* 获取文件属性，类似stat，必须完成 */
 	.readdir = newfs_readdir,				 /* 填充dentrys */
 	.mknod = newfs_mknod,					 /* 创建文件，touch相关 */
-	.write = NULL,								  	 /* 写入文件 */
-	.read = NULL,								  	 /* 读文件 */
+	.write = newfs_write,					 /* 写入文件 */
+	.read = newfs_read,						 /* 读文件 */
 	.utimens = newfs_utimens,				 /* 修改时间，忽略，避免touch报错 */
-	.truncate = NULL,						  		 /* 改变文件大小 */
-	.unlink = NULL,							  		 /* 删除文件 */
-	.rmdir	= NULL,							  		 /* 删除目录， rm -r */
-	.rename = NULL,							  		 /* 重命名，mv */
+	.truncate = newfs_truncate,				 /* 改变文件大小 */
+	.ftruncate = newfs_ftruncate,			 /* 通过打开的句柄改变文件大小 */
+	.fgetattr = newfs_fgetattr,				 /* 通过打开的句柄获取文件属性 */
+	.fallocate = newfs_fallocate,			 /* 预先分配数据块 */
+	.unlink = newfs_unlink,					 /* 删除文件 */
+	.rmdir	= newfs_rmdir,					 /* 删除目录， rm -r */
+	.rename = newfs_rename,					 /* 重命名，mv */
 
-	.open = NULL,							
-	.opendir = NULL,
+	.open = newfs_open,						 /* 打开文件，在fi->fh中保存文件句柄 */
+	.release = newfs_release,				 /* 关闭文件，释放句柄 */
+	.flush = newfs_flush,					 /* 每次close，写回已有物理块的脏数据 */
+	.fsync = newfs_fsync,					 /* 单个文件落盘 */
+	.fsyncdir = newfs_fsyncdir,				 /* 单个目录落盘 */
+	.opendir = newfs_opendir,				 /* 打开目录，在fi->fh中保存readdir游标 */
+	.releasedir = newfs_releasedir,			 /* 关闭目录，释放游标 */
 	.access = NULL
 };
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+/**
+ * @brief 根据inode填充文件属性，getattr和fgetattr共用
+ * 
+ * @param inode 
+ * @param is_root 是否为根目录
+ * @param nfs_stat 返回状态
+ */
+static void nfs_fill_stat(struct nfs_inode* inode, boolean is_root, struct stat * nfs_stat) {
+	// 根据文件类型设置相应的属性
+	if (NFS_IS_DIR(inode)) {
+		nfs_stat->st_mode = S_IFDIR | NFS_DEFAULT_PERM;
+		nfs_stat->st_size = inode->size;
+	}
+	else if (NFS_IS_REG(inode)) {
+		nfs_stat->st_mode = S_IFREG | NFS_DEFAULT_PERM;
+		nfs_stat->st_size = inode->size;
+	}
+	
+	// 设置其他属性
+	nfs_stat->st_nlink = 1;
+	nfs_stat->st_uid 	 = getuid();
+	nfs_stat->st_gid 	 = getgid();
+	nfs_stat->st_atime   = time(NULL);
+	nfs_stat->st_mtime   = time(NULL);
+	nfs_stat->st_blksize = NFS_IO_SZ();
+	nfs_stat->st_blocks  = NFS_DATA_PER_FILE;
+
+	if (is_root) {
+		nfs_stat->st_size	= nfs_super.sz_usage; 
+		nfs_stat->st_blocks = NFS_DISK_SZ() / NFS_IO_SZ();
+		nfs_stat->st_nlink  = 2;		/* !特殊，根目录link数为2 */
+	}
+}
+
+/**
+ * @brief 在父目录下创建dentry及其inode，mkdir和mknod共用
+ * 
+ * 调用者持有ns_lock读锁。路径解析和加锁之间可能有其他线程创建了同名文件，
+ * 因此拿到父目录写锁之后要再查一次
+ * 
+ * @param parent 父目录dentry
+ * @param fname 文件名
+ * @param ftype 文件类型
+ * @return int 0成功，否则返回对应错误号
+ */
+static int nfs_create(struct nfs_dentry* parent, const char* fname, NFS_FILE_TYPE ftype) {
+	struct nfs_inode*  parent_inode = parent->inode;
+	struct nfs_dentry* dentry;
+	struct nfs_inode*  inode;
+	int ret = NFS_ERROR_NONE;
+
+	if (strlen(fname) >= NFS_MAX_FILE_NAME) {
+		return -NFS_ERROR_NAMETOOLONG;
+	}
+	pthread_rwlock_wrlock(&parent_inode->lock);
+	if (nfs_dindex_find(parent_inode, fname, strlen(fname)) != NULL) {
+		ret = -NFS_ERROR_EXISTS;
+		goto out;
+	}
+	dentry = new_dentry((char *)fname, ftype);
+	if (dentry == NULL) {
+		ret = -NFS_ERROR_NOSPACE;
+		goto out;
+	}
+	dentry->parent = parent;
+	inode = nfs_alloc_inode(dentry);
+	if (inode == NULL) {
+		nfs_discard_dentry(dentry);
+		ret = -NFS_ERROR_NOSPACE;
+		goto out;
+	}
+	ret = nfs_alloc_dentry(parent_inode, dentry);
+	if (ret < 0) {
+		nfs_drop_inode(inode);
+		nfs_discard_dentry(dentry);
+		goto out;
+	}
+	NFS_MEM_CHARGE(sizeof(struct nfs_dentry));
+	ret = NFS_ERROR_NONE;
+out:
+	pthread_rwlock_unlock(&parent_inode->lock);
+	return ret;
+}
+
+/**
+ * @brief 放掉已从目录中摘除的inode的引用。普通文件还被打开着时由最后一个句柄释放inode
+ * 
+ * @param inode 
+ */
+static void nfs_put_unlinked(struct nfs_inode* inode) {
+	if (!NFS_IS_DIR(inode)) {
+		// 还开着的句柄关闭时不再写回数据；不在目录树中的inode也不再参与换出
+		pthread_rwlock_wrlock(&inode->lock);
+		inode->flags |= NFS_FLAG_INO_UNLINKED;
+		pthread_rwlock_unlock(&inode->lock);
+		nfs_lru_del(inode);
+	}
+	nfs_inode_put(inode);
+}
+
+/**
+ * @brief 删除普通文件的dentry并放掉它对inode的引用
+ * 
+ * 调用者持有ns_lock写锁
+ * 
+ * @param dentry 
+ * @return int 0成功，否则返回对应错误号
+ */
+static int nfs_do_unlink(struct nfs_dentry* dentry) {
+	struct nfs_inode* parent_inode = dentry->parent->inode;
+	int ret;
+
+	// 先让路径缓存失效，再摘除目录项并释放inode
+	nfs_dcache_unhash(dentry);
+	pthread_rwlock_wrlock(&parent_inode->lock);
+	ret = nfs_drop_dentry(parent_inode, dentry);
+	pthread_rwlock_unlock(&parent_inode->lock);
+	if (ret < 0) {
+		return ret;
+	}
+	nfs_put_unlinked(dentry->inode);
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 目录能否删除: 必须为空，且没有被打开
+ * 
+ * @param inode 
+ * @return int 
+ */
+static int nfs_rmdir_check(struct nfs_inode* inode) {
+	int ret = NFS_ERROR_NONE;
+
+	pthread_rwlock_wrlock(&inode->lock);
+	if (inode->dir_cnt != 0) {
+		ret = -NFS_ERROR_NOTEMPTY;
+	}
+	// 还有游标指向该目录，暂不允许删除
+	else if (inode->open_cnt != 0) {
+		ret = -NFS_ERROR_BUSY;
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	return ret;
+}
+
+/**
+ * @brief 删除空目录
+ * 
+ * 调用者持有ns_lock写锁
+ * 
+ * @param dentry 
+ * @return int 0成功，否则返回对应错误号
+ */
+static int nfs_do_rmdir(struct nfs_dentry* dentry) {
+	struct nfs_inode* parent_inode = dentry->parent->inode;
+	int ret;
+
+	ret = nfs_rmdir_check(dentry->inode);
+	if (ret != NFS_ERROR_NONE) {
+		return ret;
+	}
+
+	nfs_dcache_unhash(dentry);
+	pthread_rwlock_wrlock(&parent_inode->lock);
+	ret = nfs_drop_dentry(parent_inode, dentry);
+	pthread_rwlock_unlock(&parent_inode->lock);
+	if (ret < 0) {
+		return ret;
+	}
+	nfs_put_unlinked(dentry->inode);
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 按固定顺序给两个目录加写锁：祖先在前，互不为祖先时ino小的在前
+ * 
+ * @param a 
+ * @param b 可以和a相同
+ */
+static void nfs_lock_dirs(struct nfs_dentry* a, struct nfs_dentry* b) {
+	struct nfs_dentry* cursor;
+	struct nfs_dentry* tmp;
+
+	if (a == b) {
+		pthread_rwlock_wrlock(&a->inode->lock);
+		return;
+	}
+	for (cursor = a->parent; cursor != NULL && cursor != b; cursor = cursor->parent);
+	if (cursor == b) {
+		// b是a的祖先
+		tmp = a; a = b; b = tmp;
+	}
+	else {
+		for (cursor = b->parent; cursor != NULL && cursor != a; cursor = cursor->parent);
+		if (cursor == NULL && a->ino > b->ino) {
+			tmp = a; a = b; b = tmp;
+		}
+	}
+	pthread_rwlock_wrlock(&a->inode->lock);
+	pthread_rwlock_wrlock(&b->inode->lock);
+}
+
+/**
+ * @brief 释放nfs_lock_dirs加的锁
+ * 
+ * @param a 
+ * @param b 
+ */
+static void nfs_unlock_dirs(struct nfs_dentry* a, struct nfs_dentry* b) {
+	pthread_rwlock_unlock(&a->inode->lock);
+	if (a != b) {
+		pthread_rwlock_unlock(&b->inode->lock);
+	}
+}
+
 /******************************************************************************
 * SECTION: 必做函数实现
 *******************************************************************************/
@@ -90,29 +320,33 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	/* TODO: 解析路径，创建目录 */
 	(void)mode;
 	boolean is_find, is_root;
-	char* fname;
-	struct nfs_dentry* last_dentry = nfs_lookup(path, &is_find, &is_root);
-	struct nfs_dentry* dentry;
-	struct nfs_inode*  inode;
+	int ret;
+	struct nfs_dentry* last_dentry;
+
+	nfs_journal_start();
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	last_dentry = nfs_lookup(path, &is_find, &is_root);
 
+	// 路径上的inode读不出来，不能当作不存在
+	if (last_dentry == NULL) {
+		ret = -NFS_ERROR_IO;
+	}
 	// 目录已经存在
-	if (is_find) {
-		return -NFS_ERROR_EXISTS;
+	else if (is_find) {
+		ret = -NFS_ERROR_EXISTS;
 	}
-
 	// 上级文件是普通文件,不能再包含目录
-	if (NFS_IS_REG(last_dentry->inode)) {
-		return -NFS_ERROR_UNSUPPORTED;
+	else if (NFS_IS_REG(last_dentry->inode)) {
+		ret = -NFS_ERROR_UNSUPPORTED;
 	}
-	
 	// 创建一个新目录 
-	fname  = nfs_get_fname(path);
-	dentry = new_dentry(fname, NFS_DIR); 
-	dentry->parent = last_dentry;
-	inode  = nfs_alloc_inode(dentry);
-	nfs_alloc_dentry(last_dentry->inode, dentry);
-	
-	return NFS_ERROR_NONE;
+	else {
+		ret = nfs_create(last_dentry, nfs_get_fname(path), NFS_DIR);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	nfs_mem_reclaim();
+	return ret;
 }
 
 /**
@@ -125,36 +359,60 @@ int newfs_mkdir(const char* path, mode_t mode) {
 int newfs_getattr(const char* path, struct stat * nfs_stat) {
 	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/nfs.c的nfs_getattr()函数实现 */
 	boolean	is_find, is_root;
-	// 路径解析
-	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
-	if (is_find == FALSE) { // 找不到对应文件
-		return -NFS_ERROR_NOTFOUND;
-	}
+	struct nfs_dentry* dentry;
+	struct nfs_inode*  inode = NULL;
+#ifndef NDEBUG
+	long alloc_cnt, load_cnt;
+#endif
 
-	// 根据文件类型设置相应的属性
-	if (NFS_IS_DIR(dentry->inode)) {
-		nfs_stat->st_mode = S_IFDIR | NFS_DEFAULT_PERM;
-		nfs_stat->st_size = dentry->inode->dir_cnt * sizeof(struct nfs_dentry_d);
+	// 路径解析，只靠epoch临界区保证dentry和inode在用完之前不被释放，不加命名空间锁
+	nfs_epoch_enter();
+#ifndef NDEBUG
+	// 线程第一次进入临界区时分配的epoch记录不算在路径解析里
+	alloc_cnt = nfs_alloc_cnt;
+	load_cnt  = nfs_load_cnt;
+#endif
+	dentry = nfs_lookup(path, &is_find, &is_root);
+#ifndef NDEBUG
+	// 涉及的inode都已在内存中时，路径解析不应该有任何堆分配(计数是线程私有的，后台提交和其他请求的分配不会算进来)
+	if (load_cnt == nfs_load_cnt && alloc_cnt != nfs_alloc_cnt) {
+		NFS_DBG("[%s] %ld heap allocations while resolving %s\n", __func__, nfs_alloc_cnt - alloc_cnt, path);
 	}
-	else if (NFS_IS_REG(dentry->inode)) {
-		nfs_stat->st_mode = S_IFREG | NFS_DEFAULT_PERM;
-		nfs_stat->st_size = dentry->inode->size;
+#endif
+	// 不持有ns_lock，解析完成后inode可能已被换出(重新装载即可)，dentry也可能随父目录被换出(重新解析)
+	while (is_find && (inode = nfs_get_inode(dentry)) == NULL) {
+		dentry = nfs_lookup(path, &is_find, &is_root);
+	}
+	if (is_find == FALSE) { // 找不到对应文件
+		nfs_epoch_exit();
+		return dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
 	}
-	
-	// 设置其他属性
-	nfs_stat->st_nlink = 1;
-	nfs_stat->st_uid 	 = getuid();
-	nfs_stat->st_gid 	 = getgid();
-	nfs_stat->st_atime   = time(NULL);
-	nfs_stat->st_mtime   = time(NULL);
-	nfs_stat->st_blksize = NFS_IO_SZ();
-	nfs_stat->st_blocks  = NFS_DATA_PER_FILE;
 
-	if (is_root) {
-		nfs_stat->st_size	= nfs_super.sz_usage; 
-		nfs_stat->st_blocks = NFS_DISK_SZ() / NFS_IO_SZ();
-		nfs_stat->st_nlink  = 2;		/* !特殊，根目录link数为2 */
+	pthread_rwlock_rdlock(&inode->lock);
+	nfs_fill_stat(inode, is_root, nfs_stat);
+	pthread_rwlock_unlock(&inode->lock);
+	nfs_epoch_exit();
+	nfs_mem_reclaim();
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 通过open建立的句柄获取文件属性，不再解析路径
+ * 
+ * @param path 相对于挂载点的路径
+ * @param nfs_stat 返回状态
+ * @param fi fi->fh中保存着open建立的文件句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fgetattr(const char* path, struct stat * nfs_stat, struct fuse_file_info* fi) {
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	if (file == NULL) {
+		return newfs_getattr(path, nfs_stat);
 	}
+	pthread_rwlock_rdlock(&file->inode->lock);
+	nfs_fill_stat(file->inode, FALSE, nfs_stat);
+	pthread_rwlock_unlock(&file->inode->lock);
 	return NFS_ERROR_NONE;
 }
 
@@ -170,34 +428,65 @@ int newfs_getattr(const char* path, struct stat * nfs_stat) {
  * buf: name会被复制到buf中
  * name: dentry名字
  * stbuf: 文件状态，可忽略
- * off: 下一次offset从哪里开始，这里可以理解为第几个dentry
+ * off: 下一次offset从哪里开始，这里是刚填入的dentry的d_off
  * 
- * @param offset 第几个目录项？
- * @param fi 可忽略
+ * @param offset 上一次填入的最后一个dentry的d_off，0表示从头开始
+ * @param fi fi->fh中保存着opendir建立的游标
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
 			    		 struct fuse_file_info * fi) {
-    /* TODO: 解析路径，获取目录的Inode，并读取目录项，利用filler填充到buf，可参考/fs/simplefs/nfs.c的nfs_readdir()函数实现 */
+	struct nfs_dir_cursor  tmp_cursor;
+	struct nfs_dir_cursor* cursor = (struct nfs_dir_cursor *)(uintptr_t)fi->fh;
+	struct nfs_dentry*     sub_dentry;
+	struct nfs_inode*      dir_inode;
 	boolean	is_find, is_root;
-	int		cur_dir = offset;
 
-	struct nfs_dentry* dentry = nfs_lookup(path, &is_find, &is_root);
-	struct nfs_dentry* sub_dentry;
-	struct nfs_inode* inode;
+	// 目录项可能正被删除，遍历期间持有ns_lock读锁和目录的读锁
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	// 没有经过opendir时临时建立一个游标
+	if (cursor == NULL) {
+		cursor = &tmp_cursor;
+		cursor->dir = nfs_lookup(path, &is_find, &is_root);
+		if (!is_find) {
+			pthread_rwlock_unlock(&nfs_super.ns_lock);
+			return cursor->dir == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+		}
+		cursor->next = NULL;
+		cursor->offset = -1;
+	}
+	dir_inode = cursor->dir->inode;
+	pthread_rwlock_rdlock(&dir_inode->lock);
 
-	// 存在指定路径下的文件
-	if (is_find) {
-		inode = dentry->inode;
-		// 根据当前offset找到对应的dentry
-		sub_dentry = nfs_get_dentry(inode, cur_dir);
-		if (sub_dentry) {
-			// 调用fill填装结果到buf中
-			filler(buf, sub_dentry->fname, NULL, ++offset);
+	// 游标停在offset处且目录没有变化时直接续上，否则按偏移重新定位(偏移沿链表递减)
+	if (offset == 0) {
+		sub_dentry = cursor->dir->inode->dentrys;
+	}
+	else if (cursor->offset == offset && cursor->gen == cursor->dir->dir_gen) {
+		sub_dentry = cursor->next;
+	}
+	else {
+		sub_dentry = cursor->dir->inode->dentrys;
+		while (sub_dentry != NULL && sub_dentry->d_off >= offset) {
+			sub_dentry = sub_dentry->brother;
 		}
-		return NFS_ERROR_NONE;
 	}
-	return -NFS_ERROR_NOTFOUND;
+
+	// 一次调用尽量填满buf，filler返回非0表示buf已满
+	while (sub_dentry != NULL) {
+		if (filler(buf, sub_dentry->name->str, NULL, sub_dentry->d_off) != 0) {
+			break;
+		}
+		offset = sub_dentry->d_off;
+		sub_dentry = sub_dentry->brother;
+	}
+
+	cursor->next   = sub_dentry;
+	cursor->offset = offset;
+	cursor->gen    = cursor->dir->dir_gen;
+	pthread_rwlock_unlock(&dir_inode->lock);
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -211,32 +500,25 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	/* TODO: 解析路径，并创建相应的文件 */
 	boolean	is_find, is_root;
+	int		ret;
+	struct nfs_dentry* last_dentry;
 	
-	struct nfs_dentry* last_dentry = nfs_lookup(path, &is_find, &is_root);
-	struct nfs_dentry* dentry;
-	struct nfs_inode*  inode;
-	char* fname;
-	
-	if (is_find == TRUE) {
-		return -NFS_ERROR_EXISTS;
+	nfs_journal_start();
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	last_dentry = nfs_lookup(path, &is_find, &is_root);
+	if (last_dentry == NULL) {
+		ret = -NFS_ERROR_IO;
 	}
-
-	fname = nfs_get_fname(path);
-	
-	if (S_ISREG(mode)) {
-		dentry = new_dentry(fname, NFS_REG_FILE);
-	}
-	else if (S_ISDIR(mode)) {
-		dentry = new_dentry(fname, NFS_DIR);
+	else if (is_find == TRUE) {
+		ret = -NFS_ERROR_EXISTS;
 	}
 	else {
-		dentry = new_dentry(fname, NFS_REG_FILE);
+		ret = nfs_create(last_dentry, nfs_get_fname(path), S_ISDIR(mode) ? NFS_DIR : NFS_REG_FILE);
 	}
-	dentry->parent = last_dentry;
-	inode = nfs_alloc_inode(dentry);
-	nfs_alloc_dentry(last_dentry->inode, dentry);
-
-	return NFS_ERROR_NONE;
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	nfs_mem_reclaim();
+	return ret;
 }
 
 /**
@@ -260,13 +542,26 @@ int newfs_utimens(const char* path, const struct timespec tv[2]) {
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi fi->fh中保存着open建立的文件句柄
  * @return int 写入大小
  */
 int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
-	/* 选做 */
-	return size;
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	int ret;
+
+	(void)path;
+	if (file == NULL) {
+		return -NFS_ERROR_INVAL;
+	}
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&file->inode->lock);
+	ret = nfs_file_write(file, buf, size, offset);
+	pthread_rwlock_unlock(&file->inode->lock);
+	nfs_journal_stop();
+	nfs_mem_reclaim();
+	return ret;
 }
 
 /**
@@ -276,13 +571,25 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi fi->fh中保存着open建立的文件句柄
  * @return int 读取大小
  */
 int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
-	/* 选做 */
-	return size;			   
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	int ret;
+
+	(void)path;
+	if (file == NULL) {
+		return -NFS_ERROR_INVAL;
+	}
+	// 读者之间只在装载数据块时互斥，见nfs_file_read
+	pthread_rwlock_rdlock(&file->inode->lock);
+	ret = nfs_file_read(file, buf, size, offset);
+	pthread_rwlock_unlock(&file->inode->lock);
+	nfs_mem_reclaim();
+	return ret;
 }
 
 /**
@@ -292,8 +599,25 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_unlink(const char* path) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct nfs_dentry* dentry;
+	int ret;
+
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (is_find == FALSE) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	else if (NFS_IS_DIR(dentry->inode)) {
+		ret = -NFS_ERROR_ISDIR;
+	}
+	else {
+		ret = nfs_do_unlink(dentry);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -309,8 +633,134 @@ int newfs_unlink(const char* path) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rmdir(const char* path) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct nfs_dentry* dentry;
+	int ret;
+
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (is_find == FALSE) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	else if (is_root) {
+		ret = -NFS_ERROR_INVAL;
+	}
+	else if (!NFS_IS_DIR(dentry->inode)) {
+		ret = -NFS_ERROR_NOTDIR;
+	}
+	else {
+		ret = nfs_do_rmdir(dentry);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	return ret;
+}
+
+/**
+ * @brief 重命名的实际实现，调用者持有ns_lock写锁
+ * 
+ * 目标已存在时dentry接管它的目录记录，否则先在目标目录中写好新记录，空间不足时什么都不改，已存在的目标也还在。
+ * 从检查目标到挂入新目录之间rename_seq为奇数，无锁查找会等待并重试，不会看到改了一半的名字，也不会在中间状态下得出"不存在"
+ * 
+ * @param from 源文件路径
+ * @param to 目标文件路径
+ * @return int 0成功，否则返回对应错误号
+ */
+static int nfs_do_rename(const char* from, const char* to) {
+	boolean	is_find, is_root;
+	struct nfs_dentry* from_dentry = nfs_lookup(from, &is_find, &is_root);
+	struct nfs_dentry* to_dentry;
+	struct nfs_dentry* to_dir;
+	struct nfs_dentry* cursor;
+	struct nfs_dentry* from_parent;
+	const struct nfs_name* old_name;
+	const struct nfs_name* new_name;
+	uint32_t new_hash;
+	char*  fname;
+	int    ret = NFS_ERROR_NONE;
+
+	if (is_find == FALSE) {
+		return from_dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	if (is_root) {
+		return -NFS_ERROR_INVAL;
+	}
+
+	to_dentry = nfs_lookup(to, &is_find, &is_root);
+	if (to_dentry == NULL) {
+		return -NFS_ERROR_IO;
+	}
+	to_dir    = to_dentry;
+	if (is_find) {
+		if (to_dentry == from_dentry) {
+			return NFS_ERROR_NONE;
+		}
+		// 目标已存在: 类型必须一致，目录必须为空，随后被覆盖
+		if (NFS_IS_DIR(from_dentry->inode) && !NFS_IS_DIR(to_dentry->inode)) {
+			return -NFS_ERROR_NOTDIR;
+		}
+		if (!NFS_IS_DIR(from_dentry->inode) && NFS_IS_DIR(to_dentry->inode)) {
+			return -NFS_ERROR_ISDIR;
+		}
+		to_dir = to_dentry->parent;
+	}
+	if (!NFS_IS_DIR(to_dir->inode)) {
+		return -NFS_ERROR_NOTDIR;
+	}
+
+	// 不能把目录移动到它自己的子树下
+	for (cursor = to_dir; cursor != NULL; cursor = cursor->parent) {
+		if (cursor == from_dentry) {
+			return -NFS_ERROR_INVAL;
+		}
+	}
+
+	// 新名字先驻留好，之后的失败路径都要归还它
+	fname = nfs_get_fname(to);
+	if (strlen(fname) >= NFS_MAX_FILE_NAME) {
+		return -NFS_ERROR_NAMETOOLONG;
+	}
+	new_hash = nfs_name_hash(fname, strlen(fname));
+	new_name = nfs_name_get(fname, strlen(fname), new_hash);
+	if (new_name == NULL) {
+		return -NFS_ERROR_NOSPACE;
+	}
+
+	// 从这里开始不能再调用nfs_lookup，它会等待rename_seq变回偶数
+	nfs_seq_write_begin(&nfs_super.rename_seq);
+	if (is_find && NFS_IS_DIR(to_dentry->inode)) {
+		ret = nfs_rmdir_check(to_dentry->inode);
+		if (ret != NFS_ERROR_NONE) {
+			goto out;
+		}
+	}
+
+	// 修改名字和父目录之前，让from及其已装载的后代的路径缓存失效
+	nfs_pcache_invalidate_tree(from_dentry);
+	if (is_find) {
+		nfs_dcache_unhash(to_dentry);
+	}
+	from_parent = from_dentry->parent;
+	old_name    = from_dentry->name;
+	nfs_lock_dirs(from_parent, to_dir);
+	ret = nfs_move_dentry(from_parent->inode, to_dir->inode, from_dentry, new_name, new_hash,
+	                      is_find ? to_dentry : NULL);
+	nfs_unlock_dirs(from_parent, to_dir);
+	if (ret < 0) {
+		goto out;
+	}
+	// 被覆盖的目标已经不在目录中，放掉它的inode
+	if (is_find) {
+		nfs_put_unlinked(to_dentry->inode);
+	}
+	// 无锁查找可能还拿着旧名字，引用归还给驻留表，等宽限期过后才回收
+	nfs_name_put(old_name);
+	new_name = NULL;
+out:
+	nfs_seq_write_end(&nfs_super.rename_seq);
+	nfs_name_put(new_name);
+	return ret < 0 ? ret : NFS_ERROR_NONE;
 }
 
 /**
@@ -321,8 +771,14 @@ int newfs_rmdir(const char* path) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rename(const char* from, const char* to) {
-	/* 选做 */
-	return 0;
+	int ret;
+
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&nfs_super.ns_lock);
+	ret = nfs_do_rename(from, to);
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -334,8 +790,172 @@ int newfs_rename(const char* from, const char* to) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_open(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct nfs_dentry* dentry;
+	struct nfs_inode*  inode;
+	struct nfs_file*   file;
+	int ret = NFS_ERROR_NONE;
+
+	nfs_journal_start();
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (!is_find) {
+		pthread_rwlock_unlock(&nfs_super.ns_lock);
+		nfs_journal_stop();
+		return dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	inode = dentry->inode;
+	if (NFS_IS_DIR(inode)) {
+		pthread_rwlock_unlock(&nfs_super.ns_lock);
+		nfs_journal_stop();
+		return -NFS_ERROR_ISDIR;
+	}
+
+	pthread_rwlock_wrlock(&inode->lock);
+	if (fi->flags & O_TRUNC) {
+		ret = nfs_truncate_data(inode, 0);
+	}
+	if (ret == NFS_ERROR_NONE) {
+		file = nfs_file_open(inode, fi->flags);
+		if (file == NULL) {
+			ret = -NFS_ERROR_NOSPACE;
+		}
+		else {
+			fi->fh = (uint64_t)(uintptr_t)file;
+		}
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	nfs_mem_reclaim();
+	return ret;
+}
+
+/**
+ * @brief 关闭文件，释放open时建立的句柄
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_release(const char* path, struct fuse_file_info* fi) {
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	(void)path;
+	if (file != NULL) {
+		// 最后一次关闭已删除的文件时释放inode
+		nfs_journal_start();
+		nfs_file_put(file);
+		nfs_journal_stop();
+		fi->fh = 0;
+	}
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭文件描述符时调用，同一个句柄可能调用多次。写回已经有物理块的脏数据块，
+ * 写回出错时close能得到错误；延迟分配的块留到最后一次关闭再定位置
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi fi->fh中保存着open建立的文件句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_flush(const char* path, struct fuse_file_info* fi) {
+	struct nfs_file*  file = (struct nfs_file *)(uintptr_t)fi->fh;
+	struct nfs_inode* inode;
+	int ret = NFS_ERROR_NONE;
+
+	(void)path;
+	if (file == NULL) {
+		return NFS_ERROR_NONE;
+	}
+	inode = file->inode;
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&inode->lock);
+	if (!(inode->flags & NFS_FLAG_INO_UNLINKED)) {
+		ret = nfs_flush_data_blks(inode, 0, NFS_MAPPED_BLKS(inode));
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	nfs_journal_stop();
+	return ret;
+}
+
+/**
+ * @brief fsync和fsyncdir的实际实现: 先写回这个文件自己的脏数据块，元数据有改动时再提交日志，
+ * inode、所在目录的块和改过的位图随当前事务一次顺序写入，不再从根目录重写整棵树。
+ * 小到建不下日志区的磁盘直接写回inode和所在目录，再写回改过的位图
+ * 
+ * @param path 相对于挂载点的路径，inode为NULL时用它查找
+ * @param inode 打开的句柄对应的inode
+ * @param datasync 非0时只要求数据能读回
+ * @return int 0成功，否则返回对应错误号
+ */
+static int nfs_do_fsync(const char* path, struct nfs_inode* inode, int datasync) {
+	boolean	is_find, is_root;
+	struct nfs_dentry* dentry = NULL;
+	struct nfs_dentry* parent;
+	int ret;
+
+	nfs_journal_start();
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	if (inode == NULL) {
+		dentry = nfs_lookup(path, &is_find, &is_root);
+		inode  = is_find ? dentry->inode : NULL;
+	}
+	if (inode == NULL) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	else {
+		pthread_rwlock_wrlock(&inode->lock);
+		ret = nfs_fsync_data(inode, datasync != 0);
+		pthread_rwlock_unlock(&inode->lock);
+	}
+	// 按目录在前、文件在后的顺序分别加锁写回
+	if (ret > 0 && !nfs_super.jnl_on) {
+		parent = inode->dentry->parent;
+		if (parent != NULL) {
+			pthread_rwlock_wrlock(&parent->inode->lock);
+			ret = nfs_write_inode(parent->inode) == NFS_ERROR_NONE ? ret : -NFS_ERROR_IO;
+			pthread_rwlock_unlock(&parent->inode->lock);
+		}
+		pthread_rwlock_wrlock(&inode->lock);
+		ret = nfs_write_inode(inode) == NFS_ERROR_NONE ? ret : -NFS_ERROR_IO;
+		pthread_rwlock_unlock(&inode->lock);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	if (ret > 0) {
+		ret = nfs_journal_commit();
+	}
+	return ret;
+}
+
+/**
+ * @brief 把文件的数据和元数据写到磁盘上
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 非0时为fdatasync，文件大小和块映射没变时不写元数据
+ * @param fi fi->fh中保存着open建立的文件句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	return nfs_do_fsync(path, file == NULL ? NULL : file->inode, datasync);
+}
+
+/**
+ * @brief 把目录的目录项写到磁盘上
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 对目录没有区别
+ * @param fi fi->fh中保存着opendir建立的游标
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) {
+	struct nfs_dir_cursor* cursor = (struct nfs_dir_cursor *)(uintptr_t)fi->fh;
+
+	return nfs_do_fsync(path, cursor == NULL ? NULL : cursor->dir->inode, datasync);
 }
 
 /**
@@ -346,8 +966,66 @@ int newfs_open(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_opendir(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct nfs_dentry*     dentry;
+	struct nfs_dir_cursor* cursor;
+	int ret = NFS_ERROR_NONE;
+
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (!is_find) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+		goto out;
+	}
+	if (!NFS_IS_DIR(dentry->inode)) {
+		ret = -NFS_ERROR_NOTDIR;
+		goto out;
+	}
+
+	cursor = (struct nfs_dir_cursor *)NFS_MALLOC(sizeof(struct nfs_dir_cursor));
+	if (cursor == NULL) {
+		ret = -NFS_ERROR_NOSPACE;
+		goto out;
+	}
+	pthread_rwlock_wrlock(&dentry->inode->lock);
+	cursor->dir    = dentry;
+	cursor->next   = dentry->inode->dentrys;
+	cursor->offset = 0;
+	cursor->gen    = dentry->dir_gen;
+	dentry->inode->open_cnt++;
+	nfs_inode_get(dentry->inode);
+	pthread_rwlock_unlock(&dentry->inode->lock);
+	fi->fh = (uint64_t)(uintptr_t)cursor;
+out:
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_mem_reclaim();
+	return ret;
+}
+
+/**
+ * @brief 关闭目录文件，释放opendir时分配的游标
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_releasedir(const char* path, struct fuse_file_info* fi) {
+	struct nfs_dir_cursor* cursor = (struct nfs_dir_cursor *)(uintptr_t)fi->fh;
+	struct nfs_inode*      inode;
+
+	(void)path;
+	if (cursor != NULL) {
+		inode = cursor->dir->inode;
+		nfs_journal_start();
+		pthread_rwlock_wrlock(&inode->lock);
+		inode->open_cnt--;
+		pthread_rwlock_unlock(&inode->lock);
+		nfs_inode_put(inode);
+		nfs_journal_stop();
+		free(cursor);
+		fi->fh = 0;
+	}
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -358,8 +1036,93 @@ int newfs_opendir(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_truncate(const char* path, off_t offset) {
-	/* 选做 */
-	return 0;
+	boolean	is_find, is_root;
+	struct nfs_dentry* dentry;
+	int ret;
+
+	nfs_journal_start();
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (!is_find) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	else if (NFS_IS_DIR(dentry->inode)) {
+		ret = -NFS_ERROR_ISDIR;
+	}
+	else {
+		pthread_rwlock_wrlock(&dentry->inode->lock);
+		ret = nfs_truncate_data(dentry->inode, offset);
+		pthread_rwlock_unlock(&dentry->inode->lock);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	return ret;
+}
+
+/**
+ * @brief 通过open建立的句柄改变文件大小
+ * 
+ * @param path 相对于挂载点的路径
+ * @param offset 改变后文件大小
+ * @param fi fi->fh中保存着open建立的文件句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ftruncate(const char* path, off_t offset, struct fuse_file_info* fi) {
+	struct nfs_file* file = (struct nfs_file *)(uintptr_t)fi->fh;
+
+	int ret;
+
+	if (file == NULL) {
+		return newfs_truncate(path, offset);
+	}
+	nfs_journal_start();
+	pthread_rwlock_wrlock(&file->inode->lock);
+	ret = nfs_truncate_data(file->inode, offset);
+	pthread_rwlock_unlock(&file->inode->lock);
+	nfs_journal_stop();
+	return ret;
+}
+
+/**
+ * @brief 为文件预先分配数据块
+ * 
+ * @param path 相对于挂载点的路径
+ * @param mode 0或FALLOC_FL_KEEP_SIZE，其余模式不支持
+ * @param offset 起始偏移
+ * @param length 长度
+ * @param fi fi->fh中保存着open建立的文件句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+	struct nfs_file*   file = (struct nfs_file *)(uintptr_t)fi->fh;
+	struct nfs_dentry* dentry;
+	boolean	is_find, is_root;
+	int ret;
+
+	nfs_journal_start();
+	if (file != NULL) {
+		pthread_rwlock_wrlock(&file->inode->lock);
+		ret = nfs_fallocate_data(file->inode, mode, offset, length);
+		pthread_rwlock_unlock(&file->inode->lock);
+		nfs_journal_stop();
+		return ret;
+	}
+	pthread_rwlock_rdlock(&nfs_super.ns_lock);
+	dentry = nfs_lookup(path, &is_find, &is_root);
+	if (!is_find) {
+		ret = dentry == NULL ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+	}
+	else if (NFS_IS_DIR(dentry->inode)) {
+		ret = -NFS_ERROR_ISDIR;
+	}
+	else {
+		pthread_rwlock_wrlock(&dentry->inode->lock);
+		ret = nfs_fallocate_data(dentry->inode, mode, offset, length);
+		pthread_rwlock_unlock(&dentry->inode->lock);
+	}
+	pthread_rwlock_unlock(&nfs_super.ns_lock);
+	nfs_journal_stop();
+	return ret;
 }
 
 
@@ -385,12 +1148,21 @@ int newfs_access(const char* path, int type) {
 int main(int argc, char **argv)
 {
     int ret;
+	char neg_opt[64];
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	nfs_options.device = strdup("/home/Young/ddriver");
+	nfs_options.negative_timeout = NFS_DEFAULT_NEG_TIMEOUT;
+	nfs_options.mem_limit = NFS_DEFAULT_MEM_LIMIT;
+	nfs_options.bytes_per_inode = NFS_DEFAULT_BYTES_PER_INODE;
+	nfs_options.commit_interval = NFS_JNL_INTERVAL;
 
 	if (fuse_opt_parse(&args, &nfs_options, option_spec, NULL) == -1)
 		return -1;
+
+	// 让内核也缓存"不存在"的查找结果，重复的miss不必再进入用户态
+	snprintf(neg_opt, sizeof(neg_opt), "-onegative_timeout=%d", nfs_options.negative_timeout);
+	fuse_opt_add_arg(&args, neg_opt);
 	
 	ret = fuse_main(args.argc, args.argv, &operations, NULL);
 	fuse_opt_free_args(&args);
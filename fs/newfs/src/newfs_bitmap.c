@@ -0,0 +1,350 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 位图按64位字扫描。磁盘上的位图是字节数组，第b字节第k位对应编号b*8+k，
+ * 在小端机器上恰好等价于第w个64位字的第j位对应编号w*64+j，因此可以原地按字访问。
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "nfs_bitmap assumes a little-endian host"
+#endif
+
+#define NFS_WORD_BITS           64
+#define NFS_WORD_IDX(idx)       ((idx) / NFS_WORD_BITS)
+#define NFS_WORD_BIT(idx)       (1ULL << ((idx) % NFS_WORD_BITS))
+
+/**
+ * @brief 第w个字中超出nbits的无效位，视为已占用
+ *
+ * @param bm
+ * @param w 字序号
+ * @return uint64_t
+ */
+static inline uint64_t nfs_bitmap_tail(struct nfs_bitmap* bm, int w) {
+    int valid = bm->nbits - w * NFS_WORD_BITS;
+
+    if (valid >= NFS_WORD_BITS) {
+        return 0;
+    }
+    return ~0ULL << valid;
+}
+
+/**
+ * @brief 第w个字是否已经没有空闲位
+ *
+ * @param bm
+ * @param w 字序号
+ * @return boolean
+ */
+static inline boolean nfs_bitmap_full(struct nfs_bitmap* bm, int w) {
+    return (bm->words[w] | nfs_bitmap_tail(bm, w)) == ~0ULL;
+}
+
+/**
+ * @brief 第w个字被修改，记下它所在的磁盘位图块，提交时只写这些块
+ *
+ * @param bm
+ * @param w 字序号
+ */
+static inline void nfs_bitmap_touch(struct nfs_bitmap* bm, int w) {
+    int blk = w / bm->blk_words;
+
+    bm->dirty[NFS_WORD_IDX(blk)] |= NFS_WORD_BIT(blk);
+}
+
+/**
+ * @brief 第w个字重新有了空闲位，逐层置位摘要，上层已置位时提前停止
+ *
+ * @param bm
+ * @param w 字序号
+ */
+static void nfs_bitmap_sum_set(struct nfs_bitmap* bm, int w) {
+    uint64_t old;
+
+    for (int lvl = 0; lvl < bm->levels; lvl++) {
+        old = bm->sum[lvl][NFS_WORD_IDX(w)];
+        bm->sum[lvl][NFS_WORD_IDX(w)] = old | NFS_WORD_BIT(w);
+        if (old != 0) {
+            break;
+        }
+        w = NFS_WORD_IDX(w);
+    }
+}
+
+/**
+ * @brief 第w个字被占满，逐层清除摘要，摘要字仍非0时提前停止
+ *
+ * @param bm
+ * @param w 字序号
+ */
+static void nfs_bitmap_sum_clear(struct nfs_bitmap* bm, int w) {
+    for (int lvl = 0; lvl < bm->levels; lvl++) {
+        bm->sum[lvl][NFS_WORD_IDX(w)] &= ~NFS_WORD_BIT(w);
+        if (bm->sum[lvl][NFS_WORD_IDX(w)] != 0) {
+            break;
+        }
+        w = NFS_WORD_IDX(w);
+    }
+}
+
+/**
+ * @brief 在第lvl层摘要中找出序号不小于idx的第一个置位，整字为0时借助上一层跳过
+ *
+ * @param bm
+ * @param lvl 摘要层
+ * @param idx 起始位序号
+ * @return int 找不到返回-1
+ */
+static int nfs_bitmap_sum_next(struct nfs_bitmap* bm, int lvl, int idx) {
+    uint64_t word;
+    int      w;
+
+    while (idx < bm->sum_bits[lvl]) {
+        w    = NFS_WORD_IDX(idx);
+        word = bm->sum[lvl][w] & (~0ULL << (idx % NFS_WORD_BITS));
+        if (word != 0) {
+            return w * NFS_WORD_BITS + __builtin_ctzll(word);
+        }
+        if (lvl + 1 < bm->levels) {
+            w = nfs_bitmap_sum_next(bm, lvl + 1, w + 1);
+            if (w < 0) {
+                return -1;
+            }
+        }
+        else {
+            w = w + 1;
+        }
+        idx = w * NFS_WORD_BITS;
+    }
+    return -1;
+}
+
+/**
+ * @brief 在已经读入内存的位图上建立摘要，位图本身原地使用，不做拷贝
+ *
+ * @param bm
+ * @param map 位图内存，大小须为8字节的整数倍
+ * @param nbits 有效位数
+ * @return int
+ */
+int nfs_bitmap_init(struct nfs_bitmap* bm, uint8_t* map, int nbits) {
+    int n;
+
+    memset(bm, 0, sizeof(struct nfs_bitmap));
+    bm->words     = (uint64_t *)map;
+    bm->nbits     = nbits;
+    bm->nwords    = (nbits + NFS_WORD_BITS - 1) / NFS_WORD_BITS;
+    bm->blk_words = NFS_BLK_SZ() / sizeof(uint64_t);
+
+    // 每个磁盘位图块一位
+    n = (bm->nwords + bm->blk_words - 1) / bm->blk_words;
+    bm->dirty = (uint64_t *)NFS_CALLOC(n / NFS_WORD_BITS + 1, sizeof(uint64_t));
+    if (bm->dirty == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+
+    // 每层一位对应下一层的一个字，直到顶层只剩一个字
+    n = bm->nwords;
+    do {
+        bm->sum_bits[bm->levels] = n;
+        bm->sum[bm->levels]      = (uint64_t *)NFS_CALLOC((n + NFS_WORD_BITS - 1) / NFS_WORD_BITS,
+                                                          sizeof(uint64_t));
+        if (bm->sum[bm->levels] == NULL) {
+            nfs_bitmap_destroy(bm);
+            return -NFS_ERROR_NOSPACE;
+        }
+        bm->levels++;
+        n = (n + NFS_WORD_BITS - 1) / NFS_WORD_BITS;
+    } while (n > 1 && bm->levels < NFS_BITMAP_LEVELS);
+
+    for (int w = 0; w < bm->nwords; w++) {
+        bm->free_cnt += __builtin_popcountll(~(bm->words[w] | nfs_bitmap_tail(bm, w)));
+        if (!nfs_bitmap_full(bm, w)) {
+            nfs_bitmap_sum_set(bm, w);
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放摘要，位图内存归调用者所有
+ *
+ * @param bm
+ */
+void nfs_bitmap_destroy(struct nfs_bitmap* bm) {
+    for (int lvl = 0; lvl < NFS_BITMAP_LEVELS; lvl++) {
+        free(bm->sum[lvl]);
+        bm->sum[lvl] = NULL;
+    }
+    free(bm->dirty);
+    bm->dirty  = NULL;
+    bm->levels = 0;
+}
+
+/**
+ * @brief 取出序号最小的一个被修改过的位图块，并清除它的标记
+ *
+ * @param bm
+ * @return int 位图块序号(相对位图起点)，没有时返回-1
+ */
+int nfs_bitmap_pop_dirty(struct nfs_bitmap* bm) {
+    int nblks = (bm->nwords + bm->blk_words - 1) / bm->blk_words;
+    int blk;
+
+    for (int w = 0; w * NFS_WORD_BITS < nblks; w++) {
+        if (bm->dirty[w] != 0) {
+            blk = w * NFS_WORD_BITS + __builtin_ctzll(bm->dirty[w]);
+            bm->dirty[w] &= bm->dirty[w] - 1;
+            return blk;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 占用第w个字中free_mask里最低的空闲位
+ *
+ * @param bm
+ * @param w 字序号
+ * @param free_mask 可选的空闲位，不能为0
+ * @return int 分配到的编号
+ */
+static int nfs_bitmap_take(struct nfs_bitmap* bm, int w, uint64_t free_mask) {
+    int bit = __builtin_ctzll(free_mask);
+
+    bm->words[w] |= 1ULL << bit;
+    if (nfs_bitmap_full(bm, w)) {
+        nfs_bitmap_sum_clear(bm, w);
+    }
+    bm->hint = w;
+    bm->free_cnt--;
+    nfs_bitmap_touch(bm, w);
+    return w * NFS_WORD_BITS + bit;
+}
+
+/**
+ * @brief 分配一个空闲位，从上次分配的字开始向后找(next-fit)，到尾部后回绕
+ *
+ * @param bm
+ * @return int 分配到的编号，没有空闲位时返回-NFS_ERROR_NOSPACE
+ */
+int nfs_bitmap_alloc(struct nfs_bitmap* bm) {
+    int w = nfs_bitmap_sum_next(bm, 0, bm->hint);
+
+    if (w < 0) {
+        w = nfs_bitmap_sum_next(bm, 0, 0);
+        if (w < 0) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    return nfs_bitmap_take(bm, w, ~(bm->words[w] | nfs_bitmap_tail(bm, w)));
+}
+
+/**
+ * @brief 分配goal处或其后第一个空闲位，到尾部后回绕
+ *
+ * @param bm
+ * @param goal 期望的编号，越界时退化为nfs_bitmap_alloc
+ * @return int 分配到的编号，没有空闲位时返回-NFS_ERROR_NOSPACE
+ */
+int nfs_bitmap_alloc_near(struct nfs_bitmap* bm, int goal) {
+    uint64_t free_mask;
+    int      w;
+
+    if (goal < 0 || goal >= bm->nbits) {
+        return nfs_bitmap_alloc(bm);
+    }
+
+    w         = NFS_WORD_IDX(goal);
+    free_mask = ~(bm->words[w] | nfs_bitmap_tail(bm, w)) & (~0ULL << (goal % NFS_WORD_BITS));
+    if (free_mask != 0) {
+        return nfs_bitmap_take(bm, w, free_mask);
+    }
+
+    w = nfs_bitmap_sum_next(bm, 0, w + 1);
+    if (w < 0) {
+        w = nfs_bitmap_sum_next(bm, 0, 0);
+        if (w < 0) {
+            return -NFS_ERROR_NOSPACE;
+        }
+    }
+    return nfs_bitmap_take(bm, w, ~(bm->words[w] | nfs_bitmap_tail(bm, w)));
+}
+
+/**
+ * @brief 统计[start, start + len)中的空闲位数
+ *
+ * @param bm
+ * @param start
+ * @param len
+ * @return int
+ */
+int nfs_bitmap_count_free(struct nfs_bitmap* bm, int start, int len) {
+    int      end = start + len > bm->nbits ? bm->nbits : start + len;
+    int      cnt = 0;
+    uint64_t mask;
+
+    while (start < end) {
+        mask = ~0ULL << (start % NFS_WORD_BITS);
+        if (end - NFS_ROUND_DOWN(start, NFS_WORD_BITS) < NFS_WORD_BITS) {
+            mask &= ~(~0ULL << (end % NFS_WORD_BITS));
+        }
+        cnt  += __builtin_popcountll(~bm->words[NFS_WORD_IDX(start)] & mask);
+        start = NFS_ROUND_DOWN(start, NFS_WORD_BITS) + NFS_WORD_BITS;
+    }
+    return cnt;
+}
+
+/**
+ * @brief 将指定编号标记为已占用
+ *
+ * @param bm
+ * @param idx
+ */
+void nfs_bitmap_set(struct nfs_bitmap* bm, int idx) {
+    int w = NFS_WORD_IDX(idx);
+
+    if (idx < 0 || idx >= bm->nbits || (bm->words[w] & NFS_WORD_BIT(idx))) {
+        return;
+    }
+    bm->words[w] |= NFS_WORD_BIT(idx);
+    if (nfs_bitmap_full(bm, w)) {
+        nfs_bitmap_sum_clear(bm, w);
+    }
+    bm->free_cnt--;
+    nfs_bitmap_touch(bm, w);
+}
+
+/**
+ * @brief 释放指定编号，直接按编号定位
+ *
+ * @param bm
+ * @param idx
+ */
+void nfs_bitmap_free(struct nfs_bitmap* bm, int idx) {
+    int     w = NFS_WORD_IDX(idx);
+    boolean was_full;
+
+    if (idx < 0 || idx >= bm->nbits || !(bm->words[w] & NFS_WORD_BIT(idx))) {
+        return;
+    }
+    was_full = nfs_bitmap_full(bm, w);
+    bm->words[w] &= ~NFS_WORD_BIT(idx);
+    if (was_full) {
+        nfs_bitmap_sum_set(bm, w);
+    }
+    bm->free_cnt++;
+    nfs_bitmap_touch(bm, w);
+}
+
+/**
+ * @brief 指定编号是否已占用
+ *
+ * @param bm
+ * @param idx
+ * @return boolean
+ */
+boolean nfs_bitmap_test(struct nfs_bitmap* bm, int idx) {
+    return (bm->words[NFS_WORD_IDX(idx)] & NFS_WORD_BIT(idx)) != 0;
+}
@@ -0,0 +1,553 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 目录哈希索引的修改都在目录inode的写锁下进行，查找不加锁: 槽位先写哈希再用release store
+ * 写dentry指针，扩容时建好新表再整体替换，旧表经epoch延迟释放。
+ * 装载因子不超过3/4，无锁的读者沿探测链总能遇到空槽而停下。
+ */
+
+/**
+ * @brief 宽限期过后释放旧的目录哈希索引
+ *
+ * @param head
+ */
+static void nfs_dindex_reclaim(struct nfs_rcu_head* head) {
+    free(NFS_CONTAINER_OF(head, struct nfs_dindex, rcu));
+}
+
+/**
+ * @brief 不再使用的索引不计入常驻内存，等宽限期过后释放
+ *
+ * @param index
+ */
+static void nfs_dindex_retire(struct nfs_dindex* index) {
+    NFS_MEM_CHARGE(-(long)(sizeof(struct nfs_dindex) + index->cap * sizeof(struct nfs_dindex_slot)));
+    nfs_epoch_retire(&index->rcu, nfs_dindex_reclaim);
+}
+
+/**
+ * @brief 按指定槽位数重建目录哈希索引，顺带清理墓碑
+ *
+ * @param inode 目录inode
+ * @param cap 新槽位数，必须是2的幂
+ * @return int
+ */
+static int nfs_dindex_resize(struct nfs_inode* inode, int cap) {
+    struct nfs_dindex*  old_index = inode->dir_index;
+    struct nfs_dindex*  new_index;
+    struct nfs_dentry*  dentry_cursor;
+    int                 pos;
+
+    new_index = (struct nfs_dindex*)NFS_CALLOC(1, sizeof(struct nfs_dindex) 
+                                                  + cap * sizeof(struct nfs_dindex_slot));
+    if (new_index == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    new_index->cap = cap;
+    NFS_MEM_CHARGE(sizeof(struct nfs_dindex) + cap * sizeof(struct nfs_dindex_slot));
+
+    // 只搬迁有效槽位，墓碑在这里被丢弃
+    for (int i = 0; old_index != NULL && i < old_index->cap; i++) {
+        dentry_cursor = old_index->slot[i].dentry;
+        if (dentry_cursor == NULL || dentry_cursor == NFS_DINDEX_TOMB) {
+            continue;
+        }
+        pos = old_index->slot[i].hash & (cap - 1);
+        while (new_index->slot[pos].dentry != NULL) {
+            pos = (pos + 1) & (cap - 1);
+        }
+        new_index->slot[pos] = old_index->slot[i];
+    }
+
+    __atomic_store_n(&inode->dir_index, new_index, __ATOMIC_RELEASE);
+    inode->dir_index_used = inode->dir_cnt;
+    if (old_index != NULL) {
+        nfs_dindex_retire(old_index);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 预留能容纳cnt个目录项的索引空间，装载目录时一次分配到位，避免逐个插入时反复扩容
+ *
+ * @param inode 目录inode
+ * @param cnt 预计的目录项数量
+ * @return int
+ */
+int nfs_dindex_reserve(struct nfs_inode* inode, int cnt) {
+    int cap = NFS_DINDEX_MIN_SLOTS;
+
+    // 装载因子控制在3/4以内
+    while (cap * 3 < (cnt + 1) * 4) {
+        cap <<= 1;
+    }
+    if (inode->dir_index != NULL && cap <= inode->dir_index->cap) {
+        return NFS_ERROR_NONE;
+    }
+    return nfs_dindex_resize(inode, cap);
+}
+
+/**
+ * @brief 将dentry加入父目录的哈希索引，dentry的名字、哈希等字段须已填好
+ *
+ * @param inode 父目录inode
+ * @param dentry 已经缓存了hash的dentry
+ * @return int
+ */
+int nfs_dindex_insert(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dindex* index = inode->dir_index;
+    int pos;
+    int ret;
+
+    // 有效项加墓碑超过3/4时扩容(或原地重建)
+    if (index == NULL || (inode->dir_index_used + 1) * 4 > index->cap * 3) {
+        int cap = index != NULL ? index->cap : NFS_DINDEX_MIN_SLOTS;
+        while ((inode->dir_cnt + 1) * 2 > cap) {
+            cap <<= 1;
+        }
+        ret = nfs_dindex_resize(inode, cap);
+        if (ret != NFS_ERROR_NONE) {
+            return ret;
+        }
+        index = inode->dir_index;
+    }
+
+    // 线性探测到空槽或墓碑
+    pos = dentry->hash & (index->cap - 1);
+    while (index->slot[pos].dentry != NULL && index->slot[pos].dentry != NFS_DINDEX_TOMB) {
+        pos = (pos + 1) & (index->cap - 1);
+    }
+    if (index->slot[pos].dentry == NULL) {
+        inode->dir_index_used++;
+    }
+    __atomic_store_n(&index->slot[pos].hash, dentry->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->slot[pos].dentry, dentry, __ATOMIC_RELEASE);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将dentry从父目录的哈希索引中删除，留下墓碑保证探测链不断
+ *
+ * @param inode 父目录inode
+ * @param dentry
+ */
+void nfs_dindex_remove(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dindex* index = inode->dir_index;
+    int pos;
+
+    if (index == NULL) {
+        return;
+    }
+    pos = dentry->hash & (index->cap - 1);
+    while (index->slot[pos].dentry != NULL) {
+        if (index->slot[pos].dentry == dentry) {
+            __atomic_store_n(&index->slot[pos].dentry, NFS_DINDEX_TOMB, __ATOMIC_RELEASE);
+            return;
+        }
+        pos = (pos + 1) & (index->cap - 1);
+    }
+}
+
+/**
+ * @brief 在目录中按名字查找子dentry，不加锁，调用者在epoch临界区内或持有目录的锁
+ *
+ * @param inode 目录inode
+ * @param name 文件名，不要求以'\0'结尾
+ * @param len 文件名长度
+ * @return struct nfs_dentry* 找不到返回NULL
+ */
+struct nfs_dentry* nfs_dindex_find(struct nfs_inode* inode, const char* name, int len) {
+    struct nfs_dindex* index = __atomic_load_n(&inode->dir_index, __ATOMIC_ACQUIRE);
+    uint32_t           hash;
+    int                pos;
+    struct nfs_dentry* dentry;
+    const struct nfs_name* dname;
+
+    if (index == NULL) {
+        return NULL;
+    }
+    hash = nfs_name_hash(name, len);
+    pos  = hash & (index->cap - 1);
+    while ((dentry = __atomic_load_n(&index->slot[pos].dentry, __ATOMIC_ACQUIRE)) != NULL) {
+        // 先比较槽位里的哈希，命中后才去访问dentry本身
+        if (dentry != NFS_DINDEX_TOMB && __atomic_load_n(&index->slot[pos].hash, __ATOMIC_RELAXED) == hash) {
+            // 名字只读一次，rename同时替换时长度和内容仍属于同一份名字
+            dname = __atomic_load_n(&dentry->name, __ATOMIC_ACQUIRE);
+            if (dname->len == len && memcmp(dname->str, name, len) == 0) {
+                return dentry;
+            }
+        }
+        pos = (pos + 1) & (index->cap - 1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 释放目录哈希索引，可能还有读者在上面查找，所以延迟释放
+ *
+ * @param inode
+ */
+void nfs_dindex_free(struct nfs_inode* inode) {
+    struct nfs_dindex* index = inode->dir_index;
+
+    __atomic_store_n(&inode->dir_index, NULL, __ATOMIC_RELEASE);
+    inode->dir_index_used = 0;
+    if (index != NULL) {
+        nfs_dindex_retire(index);
+    }
+}
+
+/******************************************************************************
+* SECTION: 全路径dentry缓存
+* 两个缓存的修改都由nfs_super.dcache_lock保护。全路径缓存的查询不加锁，只在epoch临界区内进行:
+* 命中项总要沿父链核对，读到新旧混杂的哈希和长度只会多核对一次或少命中一次；
+* 已经摘除的dentry(unhashed)和rename期间得到的结果不会被加入缓存，
+* 因此缓存里的指针在所指dentry被延迟释放之前一定已被清除。
+*******************************************************************************/
+static struct nfs_pcache_set nfs_pcache[NFS_PCACHE_SETS];
+static struct nfs_ncache_set nfs_ncache[NFS_NCACHE_SETS];
+
+/**
+ * @brief 由dentry的父链重新计算出它的全路径哈希及路径长度
+ *
+ * @param dentry
+ * @param len 输出路径长度
+ * @return uint32_t
+ */
+static uint32_t nfs_dentry_path_hash(struct nfs_dentry* dentry, int* len) {
+    const struct nfs_name* name;
+    uint32_t               hash;
+
+    if (dentry->parent == NULL) {
+        *len = 0;
+        return NFS_FNV_OFFSET;
+    }
+    name  = __atomic_load_n(&dentry->name, __ATOMIC_ACQUIRE);
+    hash  = nfs_dentry_path_hash(dentry->parent, len);
+    hash  = nfs_hash_extend(hash, "/", 1);
+    hash  = nfs_hash_extend(hash, name->str, name->len);
+    *len += name->len + 1;
+    return hash;
+}
+
+/**
+ * @brief 沿父链从后往前逐段比对，确认dentry确实对应该路径，哈希碰撞和重命名后的残留项都会在这里被挡掉
+ *
+ * @param dentry
+ * @param path
+ * @param len
+ * @return boolean
+ */
+static boolean nfs_dentry_match_path(struct nfs_dentry* dentry, const char* path, int len) {
+    const struct nfs_name* name;
+
+    while (dentry->parent != NULL) {
+        name = __atomic_load_n(&dentry->name, __ATOMIC_ACQUIRE);
+        len -= name->len;
+        if (len < 1 || path[len - 1] != '/' 
+            || memcmp(path + len, name->str, name->len) != 0) {
+            return FALSE;
+        }
+        len--;
+        dentry = dentry->parent;
+    }
+    return len == 0;
+}
+
+/**
+ * @brief 查询全路径缓存
+ *
+ * @param path 以'/'开头的路径
+ * @param len 路径长度，不含结尾的'/'
+ * @return struct nfs_dentry* 未命中返回NULL
+ */
+struct nfs_dentry* nfs_pcache_find(const char* path, int len) {
+    uint32_t                 hash = nfs_hash_extend(NFS_FNV_OFFSET, path, len);
+    struct nfs_pcache_set*   set  = &nfs_pcache[hash & (NFS_PCACHE_SETS - 1)];
+    struct nfs_pcache_entry* entry;
+    struct nfs_dentry*       dentry;
+
+    for (int i = 0; i < NFS_PCACHE_WAYS; i++) {
+        entry  = &set->way[i];
+        dentry = __atomic_load_n(&entry->dentry, __ATOMIC_ACQUIRE);
+        if (dentry != NULL && __atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash 
+            && __atomic_load_n(&entry->len, __ATOMIC_RELAXED) == len
+            && nfs_dentry_match_path(dentry, path, len)) {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 把路径到dentry的映射加入缓存，组满时轮转替换
+ *
+ * @param path
+ * @param len
+ * @param dentry
+ * @param seq 查找开始时的rename_seq，之后发生过rename则不加入
+ */
+void nfs_pcache_insert(const char* path, int len, struct nfs_dentry* dentry, uint32_t seq) {
+    uint32_t               hash = nfs_hash_extend(NFS_FNV_OFFSET, path, len);
+    struct nfs_pcache_set* set  = &nfs_pcache[hash & (NFS_PCACHE_SETS - 1)];
+    int                    way  = -1;
+
+    pthread_mutex_lock(&nfs_super.dcache_lock);
+    // rename先改rename_seq再加dcache_lock清缓存，这里看到的seq没变，说明之后的清理一定能看到这一项
+    if (dentry->unhashed || __atomic_load_n(&nfs_super.rename_seq, __ATOMIC_ACQUIRE) != seq) {
+        pthread_mutex_unlock(&nfs_super.dcache_lock);
+        return;
+    }
+    for (int i = 0; i < NFS_PCACHE_WAYS; i++) {
+        if (set->way[i].dentry == dentry && set->way[i].hash == hash) {
+            pthread_mutex_unlock(&nfs_super.dcache_lock);
+            return;
+        }
+        if (set->way[i].dentry == NULL && way < 0) {
+            way = i;
+        }
+    }
+    if (way < 0) {
+        way = set->victim;
+        set->victim = (set->victim + 1) % NFS_PCACHE_WAYS;
+    }
+    __atomic_store_n(&set->way[way].dentry, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&set->way[way].hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&set->way[way].len, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&set->way[way].dentry, dentry, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&nfs_super.dcache_lock);
+}
+
+/**
+ * @brief 让dentry当前路径对应的缓存项失效，调用者持有dcache_lock
+ *
+ * @param dentry
+ */
+static void nfs_pcache_invalidate_locked(struct nfs_dentry* dentry) {
+    int                    len;
+    uint32_t               hash = nfs_dentry_path_hash(dentry, &len);
+    struct nfs_pcache_set* set  = &nfs_pcache[hash & (NFS_PCACHE_SETS - 1)];
+
+    for (int i = 0; i < NFS_PCACHE_WAYS; i++) {
+        if (set->way[i].dentry == dentry) {
+            __atomic_store_n(&set->way[i].dentry, NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/**
+ * @brief 让dentry及其所有已装载的后代的缓存项失效，调用者持有dcache_lock
+ *
+ * @param dentry
+ */
+static void nfs_pcache_invalidate_tree_locked(struct nfs_dentry* dentry) {
+    struct nfs_dentry* child;
+
+    nfs_pcache_invalidate_locked(dentry);
+    if (dentry->inode == NULL || dentry->ftype != NFS_DIR) {
+        return;
+    }
+    for (child = dentry->inode->dentrys; child != NULL; child = child->brother) {
+        nfs_pcache_invalidate_tree_locked(child);
+    }
+}
+
+/**
+ * @brief 让dentry及其所有已装载的后代的缓存项失效，用于目录重命名，
+ * 调用者持有ns_lock写锁，并且已经把rename_seq改为奇数
+ *
+ * @param dentry
+ */
+void nfs_pcache_invalidate_tree(struct nfs_dentry* dentry) {
+    pthread_mutex_lock(&nfs_super.dcache_lock);
+    nfs_pcache_invalidate_tree_locked(dentry);
+    pthread_mutex_unlock(&nfs_super.dcache_lock);
+}
+
+/**
+ * @brief 清空全路径缓存，卸载时调用
+ */
+void nfs_pcache_clear() {
+    memset(nfs_pcache, 0, sizeof(nfs_pcache));
+}
+
+/******************************************************************************
+* SECTION: 负向dentry缓存
+*******************************************************************************/
+/**
+ * @brief 查询负向缓存，命中说明path在父目录中确定不存在
+ *
+ * @param path
+ * @param len
+ * @return struct nfs_dentry* 命中时返回父目录dentry，否则返回NULL
+ */
+struct nfs_dentry* nfs_ncache_find(const char* path, int len) {
+    uint32_t                 hash   = nfs_hash_extend(NFS_FNV_OFFSET, path, len);
+    struct nfs_ncache_set*   set    = &nfs_ncache[hash & (NFS_NCACHE_SETS - 1)];
+    struct nfs_dentry*       parent = NULL;
+    struct nfs_ncache_entry* entry;
+
+    pthread_mutex_lock(&nfs_super.dcache_lock);
+    for (int i = 0; i < NFS_NCACHE_WAYS; i++) {
+        entry = &set->way[i];
+        if (entry->parent == NULL || entry->hash != hash || entry->len != len) {
+            continue;
+        }
+        // 父目录在缓存建立后加入过目录项，这一项可能已经过时
+        if (entry->gen != __atomic_load_n(&entry->parent->dir_gen, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (memcmp(path + len - entry->name_len, entry->name, entry->name_len) == 0
+            && nfs_dentry_match_path(entry->parent, path, len - entry->name_len - 1)) {
+            parent = entry->parent;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nfs_super.dcache_lock);
+    return parent;
+}
+
+/**
+ * @brief 记录path不存在于parent目录中
+ *
+ * @param path
+ * @param len
+ * @param parent 父目录dentry
+ * @param gen 父目录的dir_gen，必须在查找目录索引之前读取
+ */
+void nfs_ncache_insert(const char* path, int len, struct nfs_dentry* parent, uint32_t gen) {
+    const char*              fname    = strrchr(path, '/') + 1;
+    int                      name_len = path + len - fname;
+    uint32_t                 hash;
+    struct nfs_ncache_set*   set;
+    struct nfs_ncache_entry* entry = NULL;
+
+    if (name_len > NFS_NCACHE_NAME_LEN) {
+        return;
+    }
+    hash = nfs_hash_extend(NFS_FNV_OFFSET, path, len);
+    set  = &nfs_ncache[hash & (NFS_NCACHE_SETS - 1)];
+
+    pthread_mutex_lock(&nfs_super.dcache_lock);
+    // 父目录已被删除，它的负向缓存项已经清理过，不能再加
+    if (parent->unhashed) {
+        pthread_mutex_unlock(&nfs_super.dcache_lock);
+        return;
+    }
+    for (int i = 0; i < NFS_NCACHE_WAYS; i++) {
+        if (set->way[i].parent == NULL) {
+            entry = &set->way[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = &set->way[set->victim];
+        set->victim = (set->victim + 1) % NFS_NCACHE_WAYS;
+        entry->parent->neg_cnt--;
+    }
+    entry->hash     = hash;
+    entry->len      = len;
+    entry->parent   = parent;
+    entry->gen      = gen;
+    entry->name_len = name_len;
+    memcpy(entry->name, fname, name_len);
+    parent->neg_cnt++;
+    pthread_mutex_unlock(&nfs_super.dcache_lock);
+}
+
+/**
+ * @brief 清除以dentry为父目录的所有负向缓存项，调用者持有dcache_lock
+ *
+ * @param dentry
+ */
+static void nfs_ncache_purge_locked(struct nfs_dentry* dentry) {
+    for (int i = 0; i < NFS_NCACHE_SETS && dentry->neg_cnt > 0; i++) {
+        for (int j = 0; j < NFS_NCACHE_WAYS; j++) {
+            if (nfs_ncache[i].way[j].parent == dentry) {
+                nfs_ncache[i].way[j].parent = NULL;
+                dentry->neg_cnt--;
+            }
+        }
+    }
+}
+
+/**
+ * @brief dentry即将从目录树中摘除: 清掉指向它的全路径缓存项和以它为父目录的负向缓存项，
+ * 并禁止它再进入缓存，之后才能交给nfs_epoch_retire
+ *
+ * @param dentry
+ */
+void nfs_dcache_unhash(struct nfs_dentry* dentry) {
+    pthread_mutex_lock(&nfs_super.dcache_lock);
+    dentry->unhashed = TRUE;
+    nfs_pcache_invalidate_locked(dentry);
+    nfs_ncache_purge_locked(dentry);
+    pthread_mutex_unlock(&nfs_super.dcache_lock);
+}
+
+/**
+ * @brief 清空负向缓存，卸载时调用
+ */
+void nfs_ncache_clear() {
+    memset(nfs_ncache, 0, sizeof(nfs_ncache));
+}
+
+/******************************************************************************
+* SECTION: inode缓存
+* 按inode号索引所有在内存中的inode，由nfs_super.load_lock保护。
+* dentry的inode指针为空时先查这里，命中就直接共享，不再读盘。
+*******************************************************************************/
+static struct nfs_inode* nfs_icache[NFS_ICACHE_BUCKETS];
+
+/**
+ * @brief 按inode号查找内存中的inode，调用者持有load_lock
+ *
+ * @param ino
+ * @return struct nfs_inode* 不在内存中返回NULL
+ */
+struct nfs_inode* nfs_icache_find(int ino) {
+    struct nfs_inode* inode = nfs_icache[ino & (NFS_ICACHE_BUCKETS - 1)];
+
+    while (inode != NULL && inode->ino != ino) {
+        inode = inode->hnext;
+    }
+    return inode;
+}
+
+/**
+ * @brief 把新装载或新分配的inode加入缓存，调用者持有load_lock
+ *
+ * @param inode
+ */
+void nfs_icache_insert(struct nfs_inode* inode) {
+    struct nfs_inode** bucket = &nfs_icache[inode->ino & (NFS_ICACHE_BUCKETS - 1)];
+
+    inode->hnext = *bucket;
+    *bucket      = inode;
+}
+
+/**
+ * @brief 把即将释放的inode移出缓存，调用者持有load_lock
+ *
+ * @param inode
+ */
+void nfs_icache_remove(struct nfs_inode* inode) {
+    struct nfs_inode** link = &nfs_icache[inode->ino & (NFS_ICACHE_BUCKETS - 1)];
+
+    while (*link != NULL && *link != inode) {
+        link = &(*link)->hnext;
+    }
+    if (*link != NULL) {
+        *link = inode->hnext;
+    }
+    inode->hnext = NULL;
+}
+
+/**
+ * @brief 清空inode缓存，卸载时调用
+ */
+void nfs_icache_clear() {
+    memset(nfs_icache, 0, sizeof(nfs_icache));
+}
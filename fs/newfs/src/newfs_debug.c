@@ -3,7 +3,7 @@
 extern struct nfs_super      nfs_super; 
 extern struct custom_options nfs_options;
 
-void nfs_dump_map() {
+static void nfs_dump_inode_map(uint8_t* map_inode) {
     int byte_cursor = 0;
     int bit_cursor = 0;
 
@@ -11,23 +11,43 @@ void nfs_dump_map() {
          byte_cursor+=4)
     {
         for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            printf("%d ", (nfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) >> bit_cursor);   
+            printf("%d ", (map_inode[byte_cursor] & (0x1 << bit_cursor)) >> bit_cursor);   
         }
         printf("\t");
 
         for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            printf("%d ", (nfs_super.map_inode[byte_cursor + 1] & (0x1 << bit_cursor)) >> bit_cursor);   
+            printf("%d ", (map_inode[byte_cursor + 1] & (0x1 << bit_cursor)) >> bit_cursor);   
         }
         printf("\t");
         
         for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            printf("%d ", (nfs_super.map_inode[byte_cursor + 2] & (0x1 << bit_cursor)) >> bit_cursor);   
+            printf("%d ", (map_inode[byte_cursor + 2] & (0x1 << bit_cursor)) >> bit_cursor);   
         }
         printf("\t");
         
         for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            printf("%d ", (nfs_super.map_inode[byte_cursor + 3] & (0x1 << bit_cursor)) >> bit_cursor);   
+            printf("%d ", (map_inode[byte_cursor + 3] & (0x1 << bit_cursor)) >> bit_cursor);   
         }
         printf("\n");
     }
+}
+
+void nfs_dump_map() {
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        printf("group %d:\n", g);
+        nfs_dump_inode_map(nfs_super.groups[g].map_inode);
+    }
+}
+
+/**
+ * @brief 输出本次挂载期间的磁盘IO统计: 驱动记录的读写和寻道次数，以及磁头累计移动的块数
+ */
+void nfs_dump_io_stat() {
+#ifndef NDEBUG
+    struct ddriver_state state;
+
+    ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_STATE, &state);
+    NFS_DBG("[%s] read %d, write %d, seek %d, head travel %ld blks\n", __func__, 
+            state.read_cnt, state.write_cnt, state.seek_cnt, nfs_head_travel / NFS_BLK_SZ());
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 基于epoch的延迟回收。读者进入临界区时记下当前的全局epoch，离开时清除；
+ * 写者先把对象从所有共享结构中摘除，再交给nfs_epoch_retire挂到当时epoch的待回收桶。
+ * 只有所有仍在临界区内的线程都已看到当前epoch时才能把它加一，
+ * 因此epoch从e推进到e+2时，e之前进入临界区的读者都已离开，e时挂入的对象可以释放。
+ */
+
+static __thread struct nfs_epoch_rec* nfs_epoch_self;
+
+/**
+ * @brief 线程退出时归还epoch记录
+ *
+ * @param arg 线程的epoch记录
+ */
+static void nfs_epoch_rec_put(void* arg) {
+    struct nfs_epoch_rec* rec = (struct nfs_epoch_rec *)arg;
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 为当前线程取得一条epoch记录，优先复用已退出线程留下的记录
+ *
+ * @return struct nfs_epoch_rec* 内存不足时返回NULL
+ */
+static struct nfs_epoch_rec* nfs_epoch_rec_get(void) {
+    struct nfs_epoch_rec* rec;
+    int                   unused;
+
+    for (rec = __atomic_load_n(&nfs_super.epoch_recs, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &unused, 1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (rec == NULL) {
+        rec = (struct nfs_epoch_rec *)NFS_CALLOC(1, sizeof(struct nfs_epoch_rec));
+        if (rec == NULL) {
+            return NULL;
+        }
+        rec->in_use = 1;
+        rec->next   = __atomic_load_n(&nfs_super.epoch_recs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&nfs_super.epoch_recs, &rec->next, rec, FALSE,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    rec->depth = 0;
+    pthread_setspecific(nfs_super.epoch_key, rec);
+    nfs_epoch_self = rec;
+    return rec;
+}
+
+/**
+ * @brief 所有在临界区内的线程都已看到当前epoch时把它加一
+ *
+ * @return uint64_t 推进之后(或无法推进时)的全局epoch
+ */
+static uint64_t nfs_epoch_try_advance(void) {
+    uint64_t              epoch = __atomic_load_n(&nfs_super.epoch, __ATOMIC_SEQ_CST);
+    struct nfs_epoch_rec* rec;
+    uint64_t              state;
+
+    for (rec = __atomic_load_n(&nfs_super.epoch_recs, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    if (__atomic_compare_exchange_n(&nfs_super.epoch, &epoch, epoch + 1, FALSE,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        epoch++;
+    }
+    return epoch;
+}
+
+/**
+ * @brief 依次调用链表上各对象的回收函数
+ *
+ * @param head
+ */
+static void nfs_epoch_run(struct nfs_rcu_head* head) {
+    struct nfs_rcu_head* next;
+
+    while (head != NULL) {
+        next = head->next;
+        head->func(head);
+        head = next;
+    }
+}
+
+/**
+ * @brief 建立epoch机制，挂载时调用
+ *
+ * @return int
+ */
+int nfs_epoch_init(void) {
+    nfs_super.epoch      = 0;
+    nfs_super.epoch_recs = NULL;
+    for (int i = 0; i < 3; i++) {
+        nfs_super.limbo[i]     = NULL;
+        nfs_super.limbo_cnt[i] = 0;
+    }
+    nfs_epoch_self = NULL;
+    pthread_mutex_init(&nfs_super.epoch_lock, NULL);
+    if (pthread_key_create(&nfs_super.epoch_key, nfs_epoch_rec_put) != 0) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时调用: 此时已没有其他线程，回收所有待回收对象并释放各线程的记录
+ */
+void nfs_epoch_destroy(void) {
+    struct nfs_epoch_rec* rec;
+    struct nfs_epoch_rec* next;
+    struct nfs_rcu_head*  head;
+    boolean               again;
+
+    // 回收函数可能再retire别的对象(dentry放掉最后一个名字引用)，先摘下整个桶再执行，直到三个桶都空
+    do {
+        again = FALSE;
+        for (int i = 0; i < 3; i++) {
+            head                   = nfs_super.limbo[i];
+            nfs_super.limbo[i]     = NULL;
+            nfs_super.limbo_cnt[i] = 0;
+            if (head != NULL) {
+                nfs_epoch_run(head);
+                again = TRUE;
+            }
+        }
+    } while (again);
+    for (rec = nfs_super.epoch_recs; rec != NULL; rec = next) {
+        next = rec->next;
+        free(rec);
+    }
+    nfs_super.epoch_recs = NULL;
+    nfs_epoch_self       = NULL;
+    pthread_key_delete(nfs_super.epoch_key);
+    pthread_mutex_destroy(&nfs_super.epoch_lock);
+}
+
+/**
+ * @brief 进入读侧临界区，可以嵌套；临界区内读到的dentry、inode和目录索引在离开之前不会被释放
+ */
+void nfs_epoch_enter(void) {
+    struct nfs_epoch_rec* rec = nfs_epoch_self;
+
+    // 记录只在线程第一次进入时分配，内存不足时等别的线程释放内存
+    while (rec == NULL) {
+        rec = nfs_epoch_rec_get();
+        if (rec == NULL) {
+            sched_yield();
+        }
+    }
+    if (rec->depth++ > 0) {
+        return;
+    }
+    // 先公布看到的epoch再读共享结构，seq_cst保证推进者不会漏看这次进入
+    __atomic_store_n(&rec->state, (__atomic_load_n(&nfs_super.epoch, __ATOMIC_SEQ_CST) << 1) | 1,
+                     __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 离开读侧临界区
+ */
+void nfs_epoch_exit(void) {
+    struct nfs_epoch_rec* rec = nfs_epoch_self;
+
+    if (--rec->depth > 0) {
+        return;
+    }
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 延迟回收一个已经从所有共享结构中摘除的对象，宽限期过后调用func
+ *
+ * @param head 对象内嵌的链接头
+ * @param func 回收函数
+ */
+void nfs_epoch_retire(struct nfs_rcu_head* head, void (*func)(struct nfs_rcu_head *)) {
+    struct nfs_rcu_head* ready = NULL;
+    uint64_t             epoch;
+    boolean              advance;
+
+    head->func = func;
+    pthread_mutex_lock(&nfs_super.epoch_lock);
+    epoch      = __atomic_load_n(&nfs_super.epoch, __ATOMIC_SEQ_CST);
+    head->next = nfs_super.limbo[epoch % 3];
+    nfs_super.limbo[epoch % 3] = head;
+    nfs_super.limbo_cnt[epoch % 3]++;
+    advance    = nfs_super.limbo_cnt[0] + nfs_super.limbo_cnt[1] + nfs_super.limbo_cnt[2] >= NFS_EPOCH_BATCH;
+    pthread_mutex_unlock(&nfs_super.epoch_lock);
+
+    if (!advance) {
+        return;
+    }
+    nfs_epoch_try_advance();
+
+    // 全局epoch为e时，模3余e+1的桶里只有e-2及更早挂入的对象，都已过了宽限期
+    pthread_mutex_lock(&nfs_super.epoch_lock);
+    epoch = __atomic_load_n(&nfs_super.epoch, __ATOMIC_SEQ_CST);
+    ready = nfs_super.limbo[(epoch + 1) % 3];
+    nfs_super.limbo[(epoch + 1) % 3]     = NULL;
+    nfs_super.limbo_cnt[(epoch + 1) % 3] = 0;
+    pthread_mutex_unlock(&nfs_super.epoch_lock);
+    nfs_epoch_run(ready);
+}
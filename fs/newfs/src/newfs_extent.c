@@ -0,0 +1,400 @@
+#include "../include/newfs.h"
+
+/*
+ * 空闲数据块区间索引。每个空闲区间同时挂在两棵红黑树上：
+ * by_start按起始块号排序，用来合并相邻区间和做就近查找；
+ * by_len按(长度, 起始块号)排序，用来做最佳适配和精确长度查找。
+ * 内容始终与data位图保持一致，挂载时从各组位图重建，不落盘。
+ * 块号是全局编号，相邻两组的块号连续但物理上不连续，所以区间不跨组。
+ */
+
+#define NFS_EXTENT_OF_START(node)   NFS_CONTAINER_OF(node, struct nfs_extent, by_start)
+#define NFS_EXTENT_OF_LEN(node)     NFS_CONTAINER_OF(node, struct nfs_extent, by_len)
+
+/**
+ * @brief 把区间挂到两棵树上
+ *
+ * @param tree
+ * @param ext
+ */
+static void nfs_extent_insert(struct nfs_extent_tree* tree, struct nfs_extent* ext) {
+    struct nfs_rb_node** link   = &tree->by_start.node;
+    struct nfs_rb_node*  parent = NULL;
+    struct nfs_extent*   cur;
+
+    while (*link != NULL) {
+        parent = *link;
+        cur    = NFS_EXTENT_OF_START(parent);
+        link   = ext->start < cur->start ? &parent->left : &parent->right;
+    }
+    nfs_rb_link(&ext->by_start, parent, link);
+    nfs_rb_insert_fixup(&tree->by_start, &ext->by_start);
+
+    link   = &tree->by_len.node;
+    parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        cur    = NFS_EXTENT_OF_LEN(parent);
+        if (ext->len < cur->len || (ext->len == cur->len && ext->start < cur->start)) {
+            link = &parent->left;
+        }
+        else {
+            link = &parent->right;
+        }
+    }
+    nfs_rb_link(&ext->by_len, parent, link);
+    nfs_rb_insert_fixup(&tree->by_len, &ext->by_len);
+    tree->cnt++;
+}
+
+/**
+ * @brief 把区间从两棵树上摘下，不释放内存
+ *
+ * @param tree
+ * @param ext
+ */
+static void nfs_extent_remove(struct nfs_extent_tree* tree, struct nfs_extent* ext) {
+    nfs_rb_erase(&tree->by_start, &ext->by_start);
+    nfs_rb_erase(&tree->by_len, &ext->by_len);
+    tree->cnt--;
+}
+
+/**
+ * @brief 起始块号不大于dno的最后一个区间
+ *
+ * @param tree
+ * @param dno
+ * @return struct nfs_extent* 没有则返回NULL
+ */
+static struct nfs_extent* nfs_extent_floor(struct nfs_extent_tree* tree, int dno) {
+    struct nfs_rb_node* node = tree->by_start.node;
+    struct nfs_extent*  res  = NULL;
+    struct nfs_extent*  cur;
+
+    while (node != NULL) {
+        cur = NFS_EXTENT_OF_START(node);
+        if (cur->start <= dno) {
+            res  = cur;
+            node = node->right;
+        }
+        else {
+            node = node->left;
+        }
+    }
+    return res;
+}
+
+/**
+ * @brief 新建一个区间并挂到树上，与前后相邻区间合并由调用者保证不会发生
+ *
+ * @param tree
+ * @param start
+ * @param len
+ * @return int
+ */
+static int nfs_extent_add(struct nfs_extent_tree* tree, int start, int len) {
+    struct nfs_extent* ext = (struct nfs_extent *)NFS_MALLOC(sizeof(struct nfs_extent));
+
+    if (ext == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    ext->start = start;
+    ext->len   = len;
+    nfs_extent_insert(tree, ext);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 初始化为空索引
+ *
+ * @param tree
+ * @param boundary 区间不跨越它的整数倍
+ */
+void nfs_extent_init(struct nfs_extent_tree* tree, int boundary) {
+    tree->by_start.node = NULL;
+    tree->by_len.node   = NULL;
+    tree->cnt           = 0;
+    tree->boundary      = boundary;
+}
+
+/**
+ * @brief 扫描一个组的位图，把每段连续的空闲位建成一个区间
+ *
+ * @param tree
+ * @param bm 该组的data位图
+ * @param base 该组第一个数据块的全局块号
+ * @return int
+ */
+int nfs_extent_build(struct nfs_extent_tree* tree, struct nfs_bitmap* bm, int base) {
+    int run_start = -1;
+    int idx       = 0;
+    int ret;
+
+    while (idx < bm->nbits) {
+        // 整字全空或全满时一次跳过64位
+        if (idx % 64 == 0 && idx + 64 <= bm->nbits) {
+            if (bm->words[idx / 64] == 0) {
+                if (run_start < 0) {
+                    run_start = idx;
+                }
+                idx += 64;
+                continue;
+            }
+            if (bm->words[idx / 64] == ~0ULL) {
+                if (run_start >= 0) {
+                    ret = nfs_extent_add(tree, base + run_start, idx - run_start);
+                    if (ret != NFS_ERROR_NONE) {
+                        return ret;
+                    }
+                    run_start = -1;
+                }
+                idx += 64;
+                continue;
+            }
+        }
+        if (nfs_bitmap_test(bm, idx)) {
+            if (run_start >= 0) {
+                ret = nfs_extent_add(tree, base + run_start, idx - run_start);
+                if (ret != NFS_ERROR_NONE) {
+                    return ret;
+                }
+                run_start = -1;
+            }
+        }
+        else if (run_start < 0) {
+            run_start = idx;
+        }
+        idx++;
+    }
+    if (run_start >= 0) {
+        return nfs_extent_add(tree, base + run_start, bm->nbits - run_start);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放全部区间
+ *
+ * @param tree
+ */
+void nfs_extent_destroy(struct nfs_extent_tree* tree) {
+    struct nfs_rb_node* node = tree->by_start.node;
+    struct nfs_rb_node* parent;
+
+    // 后序遍历，先摘掉孩子再释放自己，不会回头访问已经释放的节点
+    while (node != NULL) {
+        if (node->left != NULL) {
+            node = node->left;
+            continue;
+        }
+        if (node->right != NULL) {
+            node = node->right;
+            continue;
+        }
+        parent = node->parent;
+        if (parent != NULL) {
+            if (parent->left == node) {
+                parent->left = NULL;
+            }
+            else {
+                parent->right = NULL;
+            }
+        }
+        free(NFS_EXTENT_OF_START(node));
+        node = parent;
+    }
+    nfs_extent_init(tree, tree->boundary);
+}
+
+/**
+ * @brief 将[start, start + len)从空闲区间中扣除，这段范围必须完整落在同一个空闲区间内
+ *
+ * @param tree
+ * @param start
+ * @param len
+ * @return int
+ */
+int nfs_extent_alloc_range(struct nfs_extent_tree* tree, int start, int len) {
+    struct nfs_extent* ext = nfs_extent_floor(tree, start);
+    int                ext_end;
+
+    if (ext == NULL || start + len > ext->start + ext->len) {
+        return -NFS_ERROR_INVAL;
+    }
+    ext_end = ext->start + ext->len;
+
+    // 右侧还剩一段时需要新的节点，先分配，失败时树保持不变
+    if (start + len < ext_end && start > ext->start) {
+        if (nfs_extent_add(tree, start + len, ext_end - start - len) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        ext_end = start + len;
+    }
+
+    nfs_extent_remove(tree, ext);
+    if (start > ext->start) {
+        ext->len = start - ext->start;
+        nfs_extent_insert(tree, ext);
+    }
+    else if (start + len < ext_end) {
+        ext->start = start + len;
+        ext->len   = ext_end - ext->start;
+        nfs_extent_insert(tree, ext);
+    }
+    else {
+        free(ext);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将[start, start + len)归还为空闲区间，与前后相邻且同组的区间合并
+ *
+ * @param tree
+ * @param start
+ * @param len
+ * @return int
+ */
+int nfs_extent_free_range(struct nfs_extent_tree* tree, int start, int len) {
+    struct nfs_extent*  prev = nfs_extent_floor(tree, start);
+    struct nfs_extent*  next = NULL;
+    struct nfs_rb_node* node;
+
+    node = prev != NULL ? nfs_rb_next(&prev->by_start) : nfs_rb_first(&tree->by_start);
+    if (node != NULL) {
+        next = NFS_EXTENT_OF_START(node);
+    }
+    if (prev != NULL && prev->start + prev->len > start) {
+        return -NFS_ERROR_INVAL;
+    }
+    if (next != NULL && start + len > next->start) {
+        return -NFS_ERROR_INVAL;
+    }
+
+    // 相接处正好是组边界时不合并
+    if (start % tree->boundary == 0) {
+        prev = NULL;
+    }
+    if ((start + len) % tree->boundary == 0) {
+        next = NULL;
+    }
+
+    if (prev != NULL && prev->start + prev->len == start) {
+        nfs_extent_remove(tree, prev);
+        prev->len += len;
+        if (next != NULL && start + len == next->start) {
+            nfs_extent_remove(tree, next);
+            prev->len += next->len;
+            free(next);
+        }
+        nfs_extent_insert(tree, prev);
+        return NFS_ERROR_NONE;
+    }
+    if (next != NULL && start + len == next->start) {
+        nfs_extent_remove(tree, next);
+        next->start  = start;
+        next->len   += len;
+        nfs_extent_insert(tree, next);
+        return NFS_ERROR_NONE;
+    }
+    return nfs_extent_add(tree, start, len);
+}
+
+/**
+ * @brief 最佳适配: 长度不小于len的最短区间，等长时取起始块号最小的
+ *
+ * @param tree
+ * @param len
+ * @return int 区间起始块号，没有返回-1
+ */
+int nfs_extent_best_fit(struct nfs_extent_tree* tree, int len) {
+    struct nfs_rb_node* node = tree->by_len.node;
+    struct nfs_extent*  res  = NULL;
+    struct nfs_extent*  cur;
+
+    while (node != NULL) {
+        cur = NFS_EXTENT_OF_LEN(node);
+        if (cur->len >= len) {
+            res  = cur;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+    return res != NULL ? res->start : -1;
+}
+
+/**
+ * @brief 精确长度: 恰好长len的区间，用它不会留下碎片
+ *
+ * @param tree
+ * @param len
+ * @return int 区间起始块号，没有返回-1
+ */
+int nfs_extent_exact(struct nfs_extent_tree* tree, int len) {
+    struct nfs_rb_node* node = tree->by_len.node;
+    struct nfs_extent*  res  = NULL;
+    struct nfs_extent*  cur;
+
+    // 与最佳适配相同的下界查找，结果恰好等长才算命中
+    while (node != NULL) {
+        cur = NFS_EXTENT_OF_LEN(node);
+        if (cur->len >= len) {
+            res  = cur;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+    return res != NULL && res->len == len ? res->start : -1;
+}
+
+/**
+ * @brief 就近查找: 离goal最近、能放下len个块的位置。goal落在空闲区间内且放得下时直接返回goal，
+ * 否则向两侧各看至多NFS_EXTENT_NEAR_SCAN个区间，都找不到再退回最佳适配
+ *
+ * @param tree
+ * @param goal 期望的起始块号
+ * @param len
+ * @return int 可分配的起始块号，没有返回-1
+ */
+int nfs_extent_near(struct nfs_extent_tree* tree, int goal, int len) {
+    struct nfs_extent*  floor = nfs_extent_floor(tree, goal);
+    struct nfs_rb_node* fwd;
+    struct nfs_rb_node* bwd;
+    struct nfs_extent*  cur;
+    int                 fwd_pos = -1;
+    int                 bwd_pos = -1;
+
+    if (floor != NULL && goal + len <= floor->start + floor->len) {
+        return goal;
+    }
+
+    fwd = floor != NULL ? nfs_rb_next(&floor->by_start) : nfs_rb_first(&tree->by_start);
+    bwd = floor != NULL ? &floor->by_start : NULL;
+    for (int i = 0; i < NFS_EXTENT_NEAR_SCAN && fwd_pos < 0 && fwd != NULL; i++) {
+        cur = NFS_EXTENT_OF_START(fwd);
+        if (cur->len >= len) {
+            fwd_pos = cur->start;
+        }
+        fwd = nfs_rb_next(fwd);
+    }
+    for (int i = 0; i < NFS_EXTENT_NEAR_SCAN && bwd_pos < 0 && bwd != NULL; i++) {
+        cur = NFS_EXTENT_OF_START(bwd);
+        if (cur->len >= len) {
+            // 取区间中最靠近goal的一段
+            bwd_pos = cur->start + cur->len - len;
+        }
+        bwd = nfs_rb_prev(bwd);
+    }
+
+    if (fwd_pos >= 0 && (bwd_pos < 0 || fwd_pos - goal <= goal - bwd_pos)) {
+        return fwd_pos;
+    }
+    if (bwd_pos >= 0) {
+        return bwd_pos;
+    }
+    return nfs_extent_best_fit(tree, len);
+}
@@ -0,0 +1,227 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/**
+ * @brief 为普通文件建立打开句柄，句柄存活期间inode不会被释放
+ *
+ * @param inode 普通文件inode
+ * @param flags open时的标志
+ * @return struct nfs_file* 内存不足时返回NULL
+ */
+struct nfs_file* nfs_file_open(struct nfs_inode* inode, int flags) {
+    struct nfs_file* file = (struct nfs_file *)NFS_MALLOC(sizeof(struct nfs_file));
+
+    if (file == NULL) {
+        return NULL;
+    }
+    file->inode    = inode;
+    file->refcnt   = 1;
+    file->flags    = flags;
+    file->ra_next  = 0;
+    file->ra_size  = 1;
+    file->wb_start = 0;
+    file->wb_next  = 0;
+    inode->open_cnt++;
+    nfs_inode_get(inode);
+    return file;
+}
+
+/**
+ * @brief 增加句柄引用
+ *
+ * @param file
+ */
+void nfs_file_get(struct nfs_file* file) {
+    __atomic_add_fetch(&file->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 释放句柄引用，最后一个引用释放时写回脏数据块并放掉句柄对inode的引用，
+ * 文件的最后一个句柄关闭时归还预留窗口；如果文件在打开期间已被unlink，此时才真正释放inode。
+ * 函数内部给inode加写锁，调用者不能持有
+ *
+ * @param file
+ */
+void nfs_file_put(struct nfs_file* file) {
+    struct nfs_inode*  inode = file->inode;
+
+    if (__atomic_sub_fetch(&file->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&inode->lock);
+    inode->open_cnt--;
+    // 已经不在目录树中的文件不必写回
+    if (!(inode->flags & NFS_FLAG_INO_UNLINKED)) {
+        // 最后一个句柄: 延迟分配的块按最终大小选定物理位置，不再多预留
+        if (inode->open_cnt == 0) {
+            inode->rsv_win = 0;
+        }
+        if (nfs_flush_data_blks(inode, 0, inode->block_allocted) != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error\n", __func__);
+        }
+        if (inode->open_cnt == 0) {
+            nfs_rsv_release(inode);
+        }
+    }
+    pthread_rwlock_unlock(&inode->lock);
+    nfs_inode_put(inode);
+    free(file);
+}
+
+/**
+ * @brief 通过句柄读文件，顺序读时预读窗口逐次翻倍，直到NFS_RA_MAX_BLKS。
+ * 调用者只持有inode读锁，多个读者可以同时进来：装载数据块在inode->load_lock下进行，
+ * 预读窗口只是启发式的估计，并发读同一句柄时各自原子地读写即可
+ *
+ * @param file
+ * @param buf 读出的内容
+ * @param size 读取的字节数
+ * @param offset 相对文件的偏移
+ * @return int 实际读取的字节数，或错误号
+ */
+int nfs_file_read(struct nfs_file* file, char* buf, int size, off_t offset) {
+    struct nfs_inode* inode = file->inode;
+    int      blk, blk_end, blk_ofs, len;
+    int      ra_size;
+    int      done = 0;
+    int      ret;
+
+    if (offset >= inode->size || size <= 0) {
+        return 0;
+    }
+    if (offset + size > inode->size) {
+        size = inode->size - offset;
+    }
+    blk     = offset / NFS_BLK_SZ();
+    blk_end = (offset + size - 1) / NFS_BLK_SZ() + 1;
+
+    // 接着上次读的位置继续读则扩大预读窗口，否则退回到单块
+    ra_size = __atomic_load_n(&file->ra_size, __ATOMIC_RELAXED);
+    if (blk == __atomic_load_n(&file->ra_next, __ATOMIC_RELAXED)) {
+        ra_size = ra_size * 2 > NFS_RA_MAX_BLKS ? NFS_RA_MAX_BLKS : ra_size * 2;
+    }
+    else {
+        ra_size = 1;
+    }
+    __atomic_store_n(&file->ra_size, ra_size, __ATOMIC_RELAXED);
+    len = blk_end - blk > ra_size ? blk_end - blk : ra_size;
+    pthread_mutex_lock(&inode->load_lock);
+    ret = nfs_load_data_blks(inode, blk, len);
+    pthread_mutex_unlock(&inode->load_lock);
+    if (ret != NFS_ERROR_NONE) {
+        return ret;
+    }
+
+    while (done < size) {
+        blk     = (offset + done) / NFS_BLK_SZ();
+        blk_ofs = (offset + done) % NFS_BLK_SZ();
+        len     = NFS_BLK_SZ() - blk_ofs;
+        if (len > size - done) {
+            len = size - done;
+        }
+        // 文件大小之内但还未分配的块按0读出
+        if (blk < inode->block_allocted) {
+            memcpy(buf + done, inode->data[blk] + blk_ofs, len);
+        }
+        else {
+            memset(buf + done, 0, len);
+        }
+        done += len;
+    }
+    __atomic_store_n(&file->ra_next, blk_end, __ATOMIC_RELAXED);
+    return done;
+}
+
+/**
+ * @brief 通过句柄写文件，顺序写时已经越过的数据块立即写回(write-behind)，
+ * 其余脏块留到句柄关闭或卸载时写回。
+ * 新块只预扣空间(延迟分配)，写回时才选定物理位置；
+ * 从文件尾部顺序追加时预留窗口逐次翻倍，写回时新块从窗口中连续取得，
+ * 多个文件同时追加也不会在磁盘上交错；随机写则关闭预留
+ *
+ * @param file
+ * @param buf 写入的内容
+ * @param size 写入的字节数
+ * @param offset 相对文件的偏移
+ * @return int 实际写入的字节数，或错误号
+ */
+int nfs_file_write(struct nfs_file* file, const char* buf, int size, off_t offset) {
+    struct nfs_inode* inode = file->inode;
+    uint8_t* data;
+    int      blk, blk_ofs, len;
+    int      done = 0;
+    int      ret;
+
+    if (size <= 0) {
+        return 0;
+    }
+    if (offset >= NFS_BLKS_SZ(NFS_DATA_PER_FILE)) {
+        return -NFS_ERROR_FBIG;
+    }
+    if (offset + size > NFS_BLKS_SZ(NFS_DATA_PER_FILE)) {
+        size = NFS_BLKS_SZ(NFS_DATA_PER_FILE) - offset;
+    }
+
+    if (offset == file->wb_next && offset + size > NFS_BLKS_SZ(inode->block_allocted)) {
+        if (inode->rsv_len == 0) {
+            inode->rsv_win = inode->rsv_win == 0 ? NFS_RSV_MIN_BLKS : inode->rsv_win * 2;
+            if (inode->rsv_win > NFS_RSV_MAX_BLKS) {
+                inode->rsv_win = NFS_RSV_MAX_BLKS;
+            }
+        }
+    }
+    else if (offset != file->wb_next) {
+        nfs_rsv_release(inode);
+        inode->rsv_win = 0;
+    }
+    // 小文件写进inode块，写出内联容量时先换成普通数据块
+    if ((ret = nfs_inline_prepare(inode, offset + size)) != NFS_ERROR_NONE) {
+        return ret;
+    }
+
+    while (done < size) {
+        blk     = (offset + done) / NFS_BLK_SZ();
+        blk_ofs = (offset + done) % NFS_BLK_SZ();
+        len     = NFS_BLK_SZ() - blk_ofs;
+        if (len > size - done) {
+            len = size - done;
+        }
+        data = nfs_get_data_blk(inode, blk, TRUE);
+        if (data == NULL) {
+            break;
+        }
+        memcpy(data + blk_ofs, buf + done, len);
+        inode->data_dirty |= 1u << blk;
+        done += len;
+    }
+    if (done == 0) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (offset + done > inode->size) {
+        inode->size   = offset + done;
+        inode->flags |= NFS_FLAG_INO_LAYOUT;
+    }
+    nfs_journal_dirty(inode);
+
+    // 顺序写: 写回已经写满、不会再被改动的块；随机写: 从本次位置重新开始跟踪。
+    // 延迟分配的块要等文件大小确定后再定位置，这里只写回已有物理块的部分
+    if (offset == file->wb_next) {
+        blk = (offset + done) / NFS_BLK_SZ();
+        if (blk > NFS_MAPPED_BLKS(inode)) {
+            blk = NFS_MAPPED_BLKS(inode);
+        }
+        if (blk > file->wb_start) {
+            if (nfs_flush_data_blks(inode, file->wb_start, blk - file->wb_start) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+            file->wb_start = blk;
+        }
+    }
+    else {
+        file->wb_start = offset / NFS_BLK_SZ();
+    }
+    file->wb_next = offset + done;
+    return done;
+}
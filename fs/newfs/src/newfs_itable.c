@@ -0,0 +1,108 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * inode表块缓存。磁盘上的inode按NFS_INO_SZ()大小的槽位紧密排列，一个逻辑块放NFS_INODE_PER_BLK个，
+ * 读写都以整块为单位经过这里: 装载时整块读入，同一块中其余inode随后装载时不再访问磁盘；
+ * 写回时只改缓存块中自己的槽位，再把整块交给日志，因此缓存块总与日志看到的内容一致，替换时直接丢弃即可。
+ * 缓存按块号直接映射，itable_lock在读写期间一直持有。
+ */
+
+/**
+ * @brief 分配缓存块，挂载时调用
+ *
+ * @return int
+ */
+int nfs_itable_init(void) {
+    nfs_super.itable = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(NFS_ITABLE_SLOTS));
+    if (nfs_super.itable == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    for (int i = 0; i < NFS_ITABLE_SLOTS; i++) {
+        nfs_super.itable_blk[i] = -1;
+    }
+    pthread_mutex_init(&nfs_super.itable_lock, NULL);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时调用，缓存块与磁盘一致，无需写回
+ */
+void nfs_itable_destroy(void) {
+    free(nfs_super.itable);
+    nfs_super.itable = NULL;
+    pthread_mutex_destroy(&nfs_super.itable_lock);
+}
+
+/**
+ * @brief 取得ino所在inode表块的缓存，不在缓存中时整块读入，调用者持有itable_lock
+ *
+ * @param ino
+ * @return uint8_t* ino的槽位，IO出错时返回NULL
+ */
+static uint8_t* nfs_itable_slot(int ino) {
+    off_t    ofs  = NFS_INO_OFS(ino);
+    int      blk  = ofs / NFS_BLK_SZ();
+    int      idx  = blk & (NFS_ITABLE_SLOTS - 1);
+    uint8_t* data = nfs_super.itable + NFS_BLKS_SZ(idx);
+
+    if (nfs_super.itable_blk[idx] != blk) {
+        if (nfs_journal_read(NFS_BLKS_SZ(blk), data, NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+            nfs_super.itable_blk[idx] = -1;
+            return NULL;
+        }
+        nfs_super.itable_blk[idx] = blk;
+    }
+    return data + ofs % NFS_BLK_SZ();
+}
+
+/**
+ * @brief 读出ino的整个槽位: inode_d及其后的内联数据
+ *
+ * @param ino
+ * @param out 至少NFS_INO_SZ()字节
+ * @return int
+ */
+int nfs_itable_read(int ino, uint8_t* out) {
+    uint8_t* slot;
+
+    pthread_mutex_lock(&nfs_super.itable_lock);
+    slot = nfs_itable_slot(ino);
+    if (slot != NULL) {
+        memcpy(out, slot, NFS_INO_SZ());
+    }
+    pthread_mutex_unlock(&nfs_super.itable_lock);
+    return slot == NULL ? -NFS_ERROR_IO : NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回ino的槽位，并把所在的inode表块整块写进日志
+ *
+ * @param ino
+ * @param inode_d
+ * @param inline_data 内联数据，NFS_INLINE_SZ()字节；为NULL时清零
+ * @return int
+ */
+int nfs_itable_write(int ino, const struct nfs_inode_d* inode_d, const uint8_t* inline_data) {
+    uint8_t* slot;
+    int      ret = NFS_ERROR_NONE;
+
+    pthread_mutex_lock(&nfs_super.itable_lock);
+    slot = nfs_itable_slot(ino);
+    if (slot == NULL) {
+        ret = -NFS_ERROR_IO;
+    }
+    else {
+        memcpy(slot, inode_d, sizeof(struct nfs_inode_d));
+        if (inline_data != NULL) {
+            memcpy(slot + sizeof(struct nfs_inode_d), inline_data, NFS_INLINE_SZ());
+        }
+        else {
+            memset(slot + sizeof(struct nfs_inode_d), 0, NFS_INLINE_SZ());
+        }
+        ret = nfs_journal_write(NFS_INO_OFS(ino) / NFS_BLK_SZ(), slot - NFS_INO_OFS(ino) % NFS_BLK_SZ());
+    }
+    pthread_mutex_unlock(&nfs_super.itable_lock);
+    return ret;
+}
@@ -0,0 +1,733 @@
+#include "../include/newfs.h"
+#include <time.h>
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 元数据日志。inode表块、位图块和目录块不直接写回原位置，而是把整块映像放进内存中的块映像表；
+ * 修改元数据的操作用nfs_journal_start/nfs_journal_stop括起来。提交时挡住新操作、等进行中的操作结束，
+ * 把脏inode和改过的位图也写成映像，再把上次提交之后变过的映像连同描述块、提交块一次顺序写进日志区，
+ * 多个操作的修改因此合并成一次大的顺序写(group commit)。映像一直留在表里，读盘时覆盖磁盘上的旧内容，
+ * 日志区用掉一半时才把所有映像按块号顺序写回原位置并推进日志起点(检查点)。
+ * 挂载时按序号重放完整提交的事务。普通文件的数据块不进日志，提交前先写回(ordered)。
+ */
+
+/**
+ * @brief 在块映像表中查找，调用者持有jnl_lock
+ *
+ * @param blk 磁盘块号
+ * @return struct nfs_jblk* 不存在时返回NULL
+ */
+static struct nfs_jblk* nfs_jmap_find(int blk) {
+    struct nfs_jblk* jb;
+
+    for (jb = nfs_super.jnl_map[blk & (NFS_JNL_BUCKETS - 1)]; jb != NULL && jb->blk != blk; jb = jb->hnext);
+    return jb;
+}
+
+/**
+ * @brief 放入一块的映像，已有则覆盖，调用者持有jnl_lock
+ *
+ * @param blk 磁盘块号
+ * @param data 块内容
+ * @param running 是否属于还没提交的事务
+ * @return int
+ */
+static int nfs_jmap_put(int blk, const uint8_t* data, boolean running) {
+    struct nfs_jblk** bucket = &nfs_super.jnl_map[blk & (NFS_JNL_BUCKETS - 1)];
+    struct nfs_jblk*  jb     = nfs_jmap_find(blk);
+
+    if (jb == NULL) {
+        jb = (struct nfs_jblk *)NFS_MALLOC(sizeof(struct nfs_jblk) + NFS_BLK_SZ());
+        if (jb == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        jb->blk     = blk;
+        jb->running = FALSE;
+        jb->hnext   = *bucket;
+        *bucket     = jb;
+        nfs_super.jnl_cnt++;
+    }
+    memcpy(jb->data, data, NFS_BLK_SZ());
+    if (running && !jb->running) {
+        jb->running = TRUE;
+        nfs_super.jnl_run++;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 丢弃一块的映像，调用者持有jnl_lock
+ *
+ * @param blk 磁盘块号
+ * @return boolean 表中原来是否有这一块
+ */
+static boolean nfs_jmap_remove(int blk) {
+    struct nfs_jblk** link;
+    struct nfs_jblk*  jb;
+
+    for (link = &nfs_super.jnl_map[blk & (NFS_JNL_BUCKETS - 1)]; *link != NULL; link = &(*link)->hnext) {
+        if ((*link)->blk == blk) {
+            jb    = *link;
+            *link = jb->hnext;
+            if (jb->running) {
+                nfs_super.jnl_run--;
+            }
+            nfs_super.jnl_cnt--;
+            free(jb);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief 日志区内位置pos对应的磁盘偏移
+ *
+ * @param pos
+ * @return int
+ */
+static off_t nfs_jnl_ofs(int pos) {
+    return nfs_super.jnl_offset + NFS_BLKS_SZ(1 + pos);
+}
+
+/**
+ * @brief 日志区中已被还没做检查点的事务占用的块数
+ *
+ * @return int
+ */
+static int nfs_jnl_used(void) {
+    return (nfs_super.jnl_head - nfs_super.jnl_start + NFS_JNL_LOG_BLKS()) % NFS_JNL_LOG_BLKS();
+}
+
+/**
+ * @brief 从日志区位置pos起读写cnt块，越过末尾时回绕
+ *
+ * @param pos
+ * @param buf
+ * @param cnt
+ * @param is_write
+ * @return int
+ */
+static int nfs_jnl_rw(int pos, uint8_t* buf, int cnt, boolean is_write) {
+    int run;
+    int ret;
+
+    while (cnt > 0) {
+        run = cnt < NFS_JNL_LOG_BLKS() - pos ? cnt : NFS_JNL_LOG_BLKS() - pos;
+        ret = is_write ? nfs_driver_write(nfs_jnl_ofs(pos), buf, NFS_BLKS_SZ(run))
+                       : nfs_driver_read(nfs_jnl_ofs(pos), buf, NFS_BLKS_SZ(run));
+        if (ret != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+        buf += NFS_BLKS_SZ(run);
+        cnt -= run;
+        pos  = (pos + run) % NFS_JNL_LOG_BLKS();
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 事务的校验和(FNV-1a)
+ *
+ * @param buf
+ * @param len
+ * @return uint32_t
+ */
+static uint32_t nfs_jnl_csum(const uint8_t* buf, int len) {
+    uint32_t h = NFS_FNV_OFFSET;
+
+    for (int i = 0; i < len; i++) {
+        h = (h ^ buf[i]) * NFS_FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * @brief 把日志起点写进日志超级块
+ *
+ * @return int
+ */
+static int nfs_jnl_write_sb(void) {
+    struct nfs_jsb_d jsb;
+
+    jsb.magic = NFS_JNL_SB_MAGIC;
+    jsb.seq   = nfs_super.jnl_start_seq;
+    jsb.start = nfs_super.jnl_start;
+    return nfs_driver_write(nfs_super.jnl_offset, (uint8_t *)&jsb, sizeof(struct nfs_jsb_d));
+}
+
+static int nfs_jblk_cmp(const void* a, const void* b) {
+    return (*(struct nfs_jblk * const *)a)->blk - (*(struct nfs_jblk * const *)b)->blk;
+}
+
+/**
+ * @brief 检查点: 把表中所有映像按块号顺序写回原位置，相邻的块合成一次写，
+ * 随后清空映像表并把日志起点推进到head。调用者持有jnl_lock，表中的映像都已提交
+ *
+ * @return int
+ */
+static int nfs_jnl_checkpoint(void) {
+    struct nfs_jblk** all = NULL;
+    struct nfs_jblk*  jb;
+    uint8_t*          buf = NULL;
+    int               n   = 0;
+    int               i, j;
+    int               ret = NFS_ERROR_NONE;
+
+    if (nfs_super.jnl_cnt > 0) {
+        all = (struct nfs_jblk **)NFS_MALLOC(nfs_super.jnl_cnt * sizeof(struct nfs_jblk *));
+        buf = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(nfs_super.jnl_cnt));
+        if (all == NULL || buf == NULL) {
+            free(all);
+            free(buf);
+            return -NFS_ERROR_NOSPACE;
+        }
+        for (int b = 0; b < NFS_JNL_BUCKETS; b++) {
+            for (jb = nfs_super.jnl_map[b]; jb != NULL; jb = jb->hnext) {
+                all[n++] = jb;
+            }
+        }
+        qsort(all, n, sizeof(struct nfs_jblk *), nfs_jblk_cmp);
+        for (i = 0; i < n; i++) {
+            memcpy(buf + NFS_BLKS_SZ(i), all[i]->data, NFS_BLK_SZ());
+        }
+        for (i = 0; i < n && ret == NFS_ERROR_NONE; i = j) {
+            for (j = i + 1; j < n && all[j]->blk == all[j - 1]->blk + 1; j++);
+            ret = nfs_driver_write(NFS_BLKS_SZ(all[i]->blk), buf + NFS_BLKS_SZ(i), NFS_BLKS_SZ(j - i));
+        }
+        free(buf);
+        free(all);
+        if (ret != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+    }
+    for (int b = 0; b < NFS_JNL_BUCKETS; b++) {
+        while (nfs_super.jnl_map[b] != NULL) {
+            nfs_jmap_remove(nfs_super.jnl_map[b]->blk);
+        }
+    }
+    nfs_super.jnl_start     = nfs_super.jnl_head;
+    nfs_super.jnl_start_seq = nfs_super.jnl_seq;
+    return nfs_jnl_write_sb();
+}
+
+/**
+ * @brief 把改过的位图块写进当前事务，没有日志时直接写回原位置
+ *
+ * @return int
+ */
+static int nfs_jnl_write_bitmaps(void) {
+    struct nfs_group* group;
+    int               ret = NFS_ERROR_NONE;
+    int               i;
+
+    // 预留窗口的块只在内存中有主人，不能以已占用的状态写出去
+    nfs_rsv_release_all();
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        group = &nfs_super.groups[g];
+        pthread_mutex_lock(&group->ino_lock);
+        while ((i = nfs_bitmap_pop_dirty(&group->ino_bmap)) >= 0) {
+            if (nfs_journal_write(group->map_inode_offset / NFS_BLK_SZ() + i,
+                                  group->map_inode + NFS_BLKS_SZ(i)) != NFS_ERROR_NONE) {
+                ret = -NFS_ERROR_IO;
+            }
+        }
+        pthread_mutex_unlock(&group->ino_lock);
+        pthread_mutex_lock(&nfs_super.alloc_lock);
+        while ((i = nfs_bitmap_pop_dirty(&group->data_bmap)) >= 0) {
+            if (nfs_journal_write(group->map_data_offset / NFS_BLK_SZ() + i,
+                                  group->map_data + NFS_BLKS_SZ(i)) != NFS_ERROR_NONE) {
+                ret = -NFS_ERROR_IO;
+            }
+        }
+        pthread_mutex_unlock(&nfs_super.alloc_lock);
+    }
+    return ret;
+}
+
+/**
+ * @brief 提交的实际实现，调用者持有jnl_barrier写锁，此时没有进行中的操作
+ *
+ * @return int
+ */
+static int nfs_jnl_do_commit(void) {
+    struct nfs_lru_node*  node;
+    struct nfs_inode*     inode;
+    struct nfs_jdesc_d*   desc;
+    struct nfs_jcommit_d* commit;
+    struct nfs_jblk*      jb;
+    uint8_t*              buf;
+    int                   n, r, i;
+    int                   ret = NFS_ERROR_NONE;
+
+    // 脏inode写成映像，普通文件的数据块在这里先写回原位置
+    for (;;) {
+        pthread_mutex_lock(&nfs_super.jnl_lock);
+        node = nfs_super.jnl_dirty.next;
+        if (node == &nfs_super.jnl_dirty) {
+            pthread_mutex_unlock(&nfs_super.jnl_lock);
+            break;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev       = NULL;
+        node->next       = NULL;
+        nfs_super.jnl_dirty_cnt--;
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+
+        inode = NFS_CONTAINER_OF(node, struct nfs_inode, jnl_dirty);
+        pthread_rwlock_wrlock(&inode->lock);
+        if (!(inode->flags & NFS_FLAG_INO_UNLINKED) && nfs_write_inode(inode) != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] write inode %d error\n", __func__, inode->ino);
+            ret = -NFS_ERROR_IO;
+        }
+        pthread_rwlock_unlock(&inode->lock);
+    }
+
+    if (nfs_jnl_write_bitmaps() != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_IO;
+    }
+
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    n = nfs_super.jnl_run;
+    r = nfs_super.jnl_revoke_cnt;
+    if (n == 0 && r == 0) {
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        return ret;
+    }
+    // 超出一个事务的容量时只能直接写回原位置，这一次不保证原子
+    if (n + r > NFS_JNL_DESC_CAP() || n + 2 >= NFS_JNL_LOG_BLKS() - nfs_jnl_used()) {
+        NFS_DBG("[%s] transaction of %d blocks too large, writing in place\n", __func__, n);
+        nfs_super.jnl_run        = 0;
+        nfs_super.jnl_revoke_cnt = 0;
+        ret = nfs_jnl_checkpoint();
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        return ret;
+    }
+
+    buf = (uint8_t *)NFS_CALLOC(n + 2, NFS_BLK_SZ());
+    if (buf == NULL) {
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        return -NFS_ERROR_NOSPACE;
+    }
+    desc            = (struct nfs_jdesc_d *)buf;
+    desc->magic     = NFS_JNL_DESC_MAGIC;
+    desc->seq       = nfs_super.jnl_seq;
+    desc->nr_blks   = n;
+    desc->nr_revoke = r;
+    i = 0;
+    for (int b = 0; b < NFS_JNL_BUCKETS; b++) {
+        for (jb = nfs_super.jnl_map[b]; jb != NULL; jb = jb->hnext) {
+            if (jb->running) {
+                desc->blks[i] = jb->blk;
+                memcpy(buf + NFS_BLKS_SZ(1 + i), jb->data, NFS_BLK_SZ());
+                jb->running = FALSE;
+                i++;
+            }
+        }
+    }
+    if (r > 0) {
+        memcpy(desc->blks + n, nfs_super.jnl_revoke, r * sizeof(int));
+    }
+    commit        = (struct nfs_jcommit_d *)(buf + NFS_BLKS_SZ(n + 1));
+    commit->magic = NFS_JNL_COMMIT_MAGIC;
+    commit->seq   = nfs_super.jnl_seq;
+    commit->csum  = nfs_jnl_csum(buf, NFS_BLKS_SZ(n + 1));
+
+    if (nfs_jnl_rw(nfs_super.jnl_head, buf, n + 2, TRUE) != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_IO;
+    }
+    nfs_super.jnl_head       = (nfs_super.jnl_head + n + 2) % NFS_JNL_LOG_BLKS();
+    nfs_super.jnl_seq++;
+    nfs_super.jnl_run        = 0;
+    nfs_super.jnl_revoke_cnt = 0;
+    free(buf);
+
+    // 日志区过半就做检查点，保证下一个事务总能放下
+    if (nfs_jnl_used() > NFS_JNL_LOG_BLKS() / 2 && nfs_jnl_checkpoint() != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_IO;
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return ret;
+}
+
+/**
+ * @brief 挂载时重放日志: 从起点开始读出序号连续、提交块校验通过的事务，
+ * 依次在映像表中应用作废和映像，最后做一次检查点写回原位置
+ *
+ * @return int
+ */
+static int nfs_jnl_replay(void) {
+    struct nfs_jsb_d      jsb;
+    struct nfs_jdesc_d*   desc;
+    struct nfs_jcommit_d* commit;
+    uint8_t*              buf;
+    int                   pos, n, r, txns = 0;
+    uint32_t              seq;
+
+    if (nfs_driver_read(nfs_super.jnl_offset, (uint8_t *)&jsb, sizeof(struct nfs_jsb_d)) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+    if (jsb.magic != NFS_JNL_SB_MAGIC || jsb.start < 0 || jsb.start >= NFS_JNL_LOG_BLKS()) {
+        return -NFS_ERROR_INVAL;
+    }
+    buf = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(NFS_JNL_LOG_BLKS()));
+    if (buf == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    desc = (struct nfs_jdesc_d *)buf;
+    pos  = jsb.start;
+    seq  = jsb.seq;
+    for (;;) {
+        if (nfs_jnl_rw(pos, buf, 1, FALSE) != NFS_ERROR_NONE
+            || desc->magic != NFS_JNL_DESC_MAGIC || desc->seq != seq) {
+            break;
+        }
+        n = desc->nr_blks;
+        r = desc->nr_revoke;
+        if (n < 0 || r < 0 || n + r > NFS_JNL_DESC_CAP() || n + 2 >= NFS_JNL_LOG_BLKS()
+            || nfs_jnl_rw((pos + 1) % NFS_JNL_LOG_BLKS(), buf + NFS_BLK_SZ(), n + 1, FALSE) != NFS_ERROR_NONE) {
+            break;
+        }
+        commit = (struct nfs_jcommit_d *)(buf + NFS_BLKS_SZ(n + 1));
+        if (commit->magic != NFS_JNL_COMMIT_MAGIC || commit->seq != seq
+            || commit->csum != nfs_jnl_csum(buf, NFS_BLKS_SZ(n + 1))) {
+            break;
+        }
+        for (int i = 0; i < r; i++) {
+            nfs_jmap_remove(desc->blks[n + i]);
+        }
+        for (int i = 0; i < n; i++) {
+            if (nfs_jmap_put(desc->blks[i], buf + NFS_BLKS_SZ(1 + i), FALSE) != NFS_ERROR_NONE) {
+                free(buf);
+                return -NFS_ERROR_NOSPACE;
+            }
+        }
+        pos = (pos + n + 2) % NFS_JNL_LOG_BLKS();
+        seq++;
+        txns++;
+    }
+    free(buf);
+
+    nfs_super.jnl_start     = jsb.start;
+    nfs_super.jnl_start_seq = jsb.seq;
+    nfs_super.jnl_head      = pos;
+    nfs_super.jnl_seq       = seq;
+    if (txns == 0) {
+        return NFS_ERROR_NONE;
+    }
+    NFS_DBG("[%s] replayed %d transactions\n", __func__, txns);
+    return nfs_jnl_checkpoint();
+}
+
+/**
+ * @brief 后台线程，每隔jnl_interval秒提交一次；jnl_interval为0时只等待卸载，提交的时机与墙上时间无关
+ *
+ * @param arg
+ * @return void*
+ */
+static void* nfs_jnl_thread(void* arg) {
+    struct timespec ts;
+
+    (void)arg;
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    while (!nfs_super.jnl_stop) {
+        if (nfs_super.jnl_interval == 0) {
+            pthread_cond_wait(&nfs_super.jnl_cond, &nfs_super.jnl_lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += nfs_super.jnl_interval;
+        pthread_cond_timedwait(&nfs_super.jnl_cond, &nfs_super.jnl_lock, &ts);
+        if (nfs_super.jnl_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        nfs_journal_commit();
+        pthread_mutex_lock(&nfs_super.jnl_lock);
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return NULL;
+}
+
+/**
+ * @brief 挂载时调用，在读位图和inode之前。新格式化的磁盘清空日志，否则重放日志，之后启动后台提交线程
+ *
+ * @param is_init 是否刚格式化
+ * @return int
+ */
+int nfs_journal_init(boolean is_init) {
+    pthread_rwlockattr_t attr;
+    uint8_t*             zero;
+    int                  ret = NFS_ERROR_NONE;
+
+    // 写者优先，提交不会被源源不断的新操作饿死
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&nfs_super.jnl_barrier, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&nfs_super.jnl_lock, NULL);
+    pthread_cond_init(&nfs_super.jnl_cond, NULL);
+    memset(nfs_super.jnl_map, 0, sizeof(nfs_super.jnl_map));
+    nfs_super.jnl_cnt        = 0;
+    nfs_super.jnl_run        = 0;
+    nfs_super.jnl_revoke     = NULL;
+    nfs_super.jnl_revoke_cnt = 0;
+    nfs_super.jnl_revoke_cap = 0;
+    nfs_super.jnl_dirty.prev = &nfs_super.jnl_dirty;
+    nfs_super.jnl_dirty.next = &nfs_super.jnl_dirty;
+    nfs_super.jnl_dirty_cnt  = 0;
+    nfs_super.jnl_on         = FALSE;
+    nfs_super.jnl_stop       = FALSE;
+    if (nfs_super.jnl_blks == 0) {
+        return NFS_ERROR_NONE;
+    }
+
+    if (is_init) {
+        // 日志区里可能是旧数据，清掉第一个事务的位置，重放不会误认
+        nfs_super.jnl_start     = 0;
+        nfs_super.jnl_start_seq = 1;
+        nfs_super.jnl_head      = 0;
+        nfs_super.jnl_seq       = 1;
+        zero = (uint8_t *)NFS_CALLOC(1, NFS_BLK_SZ());
+        if (zero == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        ret = nfs_jnl_rw(0, zero, 1, TRUE);
+        free(zero);
+        if (ret == NFS_ERROR_NONE) {
+            ret = nfs_jnl_write_sb();
+        }
+    }
+    else {
+        ret = nfs_jnl_replay();
+    }
+    if (ret != NFS_ERROR_NONE) {
+        return ret;
+    }
+    nfs_super.jnl_on = TRUE;
+    if (pthread_create(&nfs_super.jnl_thread, NULL, nfs_jnl_thread, NULL) != 0) {
+        nfs_super.jnl_on = FALSE;
+        return -NFS_ERROR_NOSPACE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时调用: 停掉后台线程，提交并做检查点，之后的写入直接落到原位置
+ */
+void nfs_journal_destroy(void) {
+    if (nfs_super.jnl_on) {
+        pthread_mutex_lock(&nfs_super.jnl_lock);
+        nfs_super.jnl_stop = TRUE;
+        pthread_cond_signal(&nfs_super.jnl_cond);
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        pthread_join(nfs_super.jnl_thread, NULL);
+
+        pthread_rwlock_wrlock(&nfs_super.jnl_barrier);
+        nfs_jnl_do_commit();
+        pthread_mutex_lock(&nfs_super.jnl_lock);
+        nfs_jnl_checkpoint();
+        nfs_super.jnl_on = FALSE;
+        pthread_mutex_unlock(&nfs_super.jnl_lock);
+        pthread_rwlock_unlock(&nfs_super.jnl_barrier);
+    }
+    free(nfs_super.jnl_revoke);
+    nfs_super.jnl_revoke = NULL;
+    pthread_cond_destroy(&nfs_super.jnl_cond);
+    pthread_mutex_destroy(&nfs_super.jnl_lock);
+    pthread_rwlock_destroy(&nfs_super.jnl_barrier);
+}
+
+/**
+ * @brief 开始一个修改元数据的操作，在获取其他任何锁之前调用，不能嵌套
+ */
+void nfs_journal_start(void) {
+    pthread_rwlock_rdlock(&nfs_super.jnl_barrier);
+}
+
+/**
+ * @brief 结束操作，攒下的修改够多时顺带提交，调用者不能持有任何锁
+ */
+void nfs_journal_stop(void) {
+    int pending;
+
+    pthread_rwlock_unlock(&nfs_super.jnl_barrier);
+    if (!nfs_super.jnl_on) {
+        return;
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    pending = nfs_super.jnl_run + nfs_super.jnl_dirty_cnt;
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    if (pending >= NFS_JNL_LOG_BLKS() / 8) {
+        nfs_journal_commit();
+    }
+}
+
+/**
+ * @brief 提交当前事务，返回时事务已写进日志区。没有日志时只把改过的位图直接写回，
+ * inode和目录块由调用者自己写
+ *
+ * @return int
+ */
+int nfs_journal_commit(void) {
+    int ret;
+
+    if (!nfs_super.jnl_on) {
+        return nfs_super.is_mounted ? nfs_jnl_write_bitmaps() : NFS_ERROR_NONE;
+    }
+    pthread_rwlock_wrlock(&nfs_super.jnl_barrier);
+    ret = nfs_jnl_do_commit();
+    pthread_rwlock_unlock(&nfs_super.jnl_barrier);
+    return ret;
+}
+
+/**
+ * @brief 标记inode的元数据有改动，下次提交时写进日志
+ *
+ * @param inode
+ */
+void nfs_journal_dirty(struct nfs_inode* inode) {
+    if (!nfs_super.jnl_on) {
+        return;
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    if (inode->jnl_dirty.next == NULL) {
+        inode->jnl_dirty.prev               = nfs_super.jnl_dirty.prev;
+        inode->jnl_dirty.next               = &nfs_super.jnl_dirty;
+        nfs_super.jnl_dirty.prev->next      = &inode->jnl_dirty;
+        nfs_super.jnl_dirty.prev            = &inode->jnl_dirty;
+        nfs_super.jnl_dirty_cnt++;
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+}
+
+/**
+ * @brief inode被释放或换出之前调用，把它从脏inode链表上摘下
+ *
+ * @param inode
+ * @return boolean inode是否还需要写回: 有改动没进日志，或者没有日志
+ */
+boolean nfs_journal_forget(struct nfs_inode* inode) {
+    boolean was_dirty;
+
+    if (!nfs_super.jnl_on) {
+        return TRUE;
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    was_dirty = inode->jnl_dirty.next != NULL;
+    if (was_dirty) {
+        inode->jnl_dirty.prev->next = inode->jnl_dirty.next;
+        inode->jnl_dirty.next->prev = inode->jnl_dirty.prev;
+        inode->jnl_dirty.prev       = NULL;
+        inode->jnl_dirty.next       = NULL;
+        nfs_super.jnl_dirty_cnt--;
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return was_dirty;
+}
+
+/**
+ * @brief inode是否还有没提交的改动，调用者持有inode写锁
+ *
+ * @param inode
+ * @return boolean 没有日志时总是TRUE
+ */
+boolean nfs_journal_pending(struct nfs_inode* inode) {
+    boolean pending;
+
+    if (!nfs_super.jnl_on) {
+        return TRUE;
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    pending = inode->jnl_dirty.next != NULL;
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return pending;
+}
+
+/**
+ * @brief 写一个元数据块: 有日志时放进当前事务，否则直接写回原位置
+ *
+ * @param blk 磁盘块号
+ * @param data 整块内容
+ * @return int
+ */
+int nfs_journal_write(int blk, const uint8_t* data) {
+    int ret;
+
+    if (!nfs_super.jnl_on) {
+        return nfs_driver_write(NFS_BLKS_SZ(blk), (uint8_t *)data, NFS_BLK_SZ());
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    ret = nfs_jmap_put(blk, data, TRUE);
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return ret;
+}
+
+/**
+ * @brief 数据块被释放时调用: 丢弃它的映像，并在当前事务中记下作废，
+ * 之后它可能作为普通文件的数据块直接写盘，重放时不能再用旧映像覆盖
+ *
+ * @param blk 磁盘块号
+ * @return int 记不下作废时返回-NFS_ERROR_NOSPACE，映像保持不动，调用者不能释放这个块
+ */
+int nfs_journal_revoke(int blk) {
+    int* grown;
+    int  ret = NFS_ERROR_NONE;
+
+    if (!nfs_super.jnl_on) {
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    if (nfs_jmap_find(blk) != NULL) {
+        // 先保证作废表有空位再丢映像，否则块会被重用而重放仍写回旧映像
+        if (nfs_super.jnl_revoke_cnt == nfs_super.jnl_revoke_cap) {
+            grown = (int *)realloc(nfs_super.jnl_revoke,
+                                   (nfs_super.jnl_revoke_cap * 2 + 16) * sizeof(int));
+            if (grown != NULL) {
+                nfs_super.jnl_revoke     = grown;
+                nfs_super.jnl_revoke_cap = nfs_super.jnl_revoke_cap * 2 + 16;
+            }
+        }
+        if (nfs_super.jnl_revoke_cnt < nfs_super.jnl_revoke_cap) {
+            nfs_jmap_remove(blk);
+            nfs_super.jnl_revoke[nfs_super.jnl_revoke_cnt++] = blk;
+        }
+        else {
+            ret = -NFS_ERROR_NOSPACE;
+        }
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return ret;
+}
+
+/**
+ * @brief 读元数据: 读盘后用映像表中较新的内容覆盖，检查点不会在读盘和覆盖之间发生
+ *
+ * @param offset
+ * @param out
+ * @param size
+ * @return int
+ */
+int nfs_journal_read(off_t offset, uint8_t* out, int size) {
+    struct nfs_jblk* jb;
+    off_t            lo, hi;
+    int              ret;
+
+    if (!nfs_super.jnl_on) {
+        return nfs_driver_read(offset, out, size);
+    }
+    pthread_mutex_lock(&nfs_super.jnl_lock);
+    ret = nfs_driver_read(offset, out, size);
+    for (int blk = offset / NFS_BLK_SZ(); nfs_super.jnl_cnt > 0 && NFS_BLKS_SZ(blk) < offset + size; blk++) {
+        jb = nfs_jmap_find(blk);
+        if (jb != NULL) {
+            lo = NFS_BLKS_SZ(blk) > offset ? NFS_BLKS_SZ(blk) : offset;
+            hi = NFS_BLKS_SZ(blk + 1) < offset + size ? NFS_BLKS_SZ(blk + 1) : offset + size;
+            memcpy(out + lo - offset, jb->data + lo - NFS_BLKS_SZ(blk), hi - lo);
+        }
+    }
+    pthread_mutex_unlock(&nfs_super.jnl_lock);
+    return ret;
+}
@@ -0,0 +1,124 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 内存超限时的换出。除根目录外，每个在内存中的inode都挂在LRU链表上，按装载先后排列；
+ * 查找经过时只置位lru_ref，不动链表(CLOCK近似LRU)，热路径上不加锁。
+ * 换出时从最久未用的一端取inode: 访问过的清掉标记放回另一端，
+ * 干净且只被自己的dentry引用的交给nfs_evict_inode，目录要等子inode都换出后才能换出，
+ * 因此dentry子树总是自下而上地被回收。
+ */
+
+/**
+ * @brief 把inode挂到LRU链表最近使用的一端
+ *
+ * @param inode
+ */
+void nfs_lru_add(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_super.lru_lock);
+    inode->lru.prev          = nfs_super.lru.prev;
+    inode->lru.next          = &nfs_super.lru;
+    nfs_super.lru.prev->next = &inode->lru;
+    nfs_super.lru.prev       = &inode->lru;
+    nfs_super.lru_cnt++;
+    pthread_mutex_unlock(&nfs_super.lru_lock);
+}
+
+/**
+ * @brief 把inode从LRU链表中摘除，不在链表上时什么也不做
+ *
+ * @param inode
+ */
+void nfs_lru_del(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_super.lru_lock);
+    if (inode->lru.next != NULL) {
+        inode->lru.prev->next = inode->lru.next;
+        inode->lru.next->prev = inode->lru.prev;
+        inode->lru.prev       = NULL;
+        inode->lru.next       = NULL;
+        nfs_super.lru_cnt--;
+    }
+    pthread_mutex_unlock(&nfs_super.lru_lock);
+}
+
+/**
+ * @brief 取下最久未用的inode
+ *
+ * @return struct nfs_inode* 链表为空时返回NULL
+ */
+static struct nfs_inode* nfs_lru_pop(void) {
+    struct nfs_lru_node* node;
+
+    pthread_mutex_lock(&nfs_super.lru_lock);
+    node = nfs_super.lru.next;
+    if (node == &nfs_super.lru) {
+        pthread_mutex_unlock(&nfs_super.lru_lock);
+        return NULL;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev       = NULL;
+    node->next       = NULL;
+    nfs_super.lru_cnt--;
+    pthread_mutex_unlock(&nfs_super.lru_lock);
+    return NFS_CONTAINER_OF(node, struct nfs_inode, lru);
+}
+
+/**
+ * @brief 建立空的LRU链表，挂载时调用
+ *
+ * @param limit 常驻内存上限(KB)，0表示不限
+ */
+void nfs_lru_init(int limit) {
+    pthread_mutex_init(&nfs_super.lru_lock, NULL);
+    nfs_super.lru.prev  = &nfs_super.lru;
+    nfs_super.lru.next  = &nfs_super.lru;
+    nfs_super.lru_cnt   = 0;
+    nfs_super.mem_used  = 0;
+    nfs_super.mem_limit = limit > 0 ? (long)limit * 1024 : 0;
+}
+
+/**
+ * @brief 卸载时调用，链表上的inode随目录树一起丢弃
+ */
+void nfs_lru_destroy(void) {
+    pthread_mutex_destroy(&nfs_super.lru_lock);
+}
+
+/**
+ * @brief 常驻内存超过上限时换出冷的inode，直到降到上限的7/8或者没有可换出的为止。
+ * 在各操作释放所有锁之后调用，内部持有ns_lock写锁
+ */
+void nfs_mem_reclaim(void) {
+    struct nfs_inode* inode;
+    long              limit = nfs_super.mem_limit;
+    int               scan;
+
+    if (limit == 0 || __atomic_load_n(&nfs_super.mem_used, __ATOMIC_RELAXED) <= limit) {
+        return;
+    }
+    // 换出时写回的inode进入日志，和其他修改元数据的操作一样要在事务里
+    nfs_journal_start();
+    pthread_rwlock_wrlock(&nfs_super.ns_lock);
+    // 每个inode最多看两遍: 第一遍清掉访问标记，第二遍还没被访问才换出
+    pthread_mutex_lock(&nfs_super.lru_lock);
+    scan = 2 * nfs_super.lru_cnt;
+    pthread_mutex_unlock(&nfs_super.lru_lock);
+    while (scan-- > 0 && __atomic_load_n(&nfs_super.mem_used, __ATOMIC_RELAXED) > NFS_MEM_LOW(limit)) {
+        inode = nfs_lru_pop();
+        if (inode == NULL) {
+            break;
+        }
+        if (__atomic_load_n(&inode->lru_ref, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&inode->lru_ref, 0, __ATOMIC_RELAXED);
+            nfs_lru_add(inode);
+            continue;
+        }
+        if (nfs_evict_inode(inode) != NFS_ERROR_NONE) {
+            nfs_lru_add(inode);
+        }
+    }
+    pthread_rwlock_unlock(&nfs_super.ns_lock);
+    nfs_journal_stop();
+}
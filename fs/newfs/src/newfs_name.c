@@ -0,0 +1,117 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 文件名驻留表。同名的dentry共用一份nfs_name，名字按实际长度放进32到256字节的档位，
+ * 不再在每个dentry里留NFS_MAX_FILE_NAME字节。无锁查找会读dentry当时指向的名字，
+ * 因此引用计数归零的名字先从表中摘除，再经nfs_epoch_retire等读者离开后归还slab。
+ */
+
+static struct nfs_name* nfs_names[NFS_NAME_BUCKETS];
+
+/**
+ * @brief 长度为len的名字所在的档位
+ *
+ * @param len
+ * @return int 档位号
+ */
+static int nfs_name_class(int len) {
+    int sz = offsetof(struct nfs_name, str) + len + 1;
+    int c  = 0;
+
+    while ((NFS_NAME_MIN_SZ << c) < sz) {
+        c++;
+    }
+    return c;
+}
+
+/**
+ * @brief 宽限期过后把名字还给对应档位的slab
+ *
+ * @param head
+ */
+static void nfs_name_reclaim(struct nfs_rcu_head* head) {
+    struct nfs_name* name = NFS_CONTAINER_OF(head, struct nfs_name, rcu);
+    int              c    = nfs_name_class(name->len);
+
+    NFS_MEM_CHARGE(-(long)(NFS_NAME_MIN_SZ << c));
+    nfs_slab_free(NFS_SLAB_NAME + c, name);
+}
+
+/**
+ * @brief 建立空的驻留表，挂载时调用
+ */
+void nfs_name_init(void) {
+    memset(nfs_names, 0, sizeof(nfs_names));
+    pthread_mutex_init(&nfs_super.name_lock, NULL);
+}
+
+/**
+ * @brief 卸载时调用，表中的名字随arena一起释放
+ */
+void nfs_name_destroy(void) {
+    memset(nfs_names, 0, sizeof(nfs_names));
+    pthread_mutex_destroy(&nfs_super.name_lock);
+}
+
+/**
+ * @brief 取得名字的一个引用，表中没有时新建
+ *
+ * @param str 名字，不必以'\0'结尾
+ * @param len 名字长度，必须小于NFS_MAX_FILE_NAME
+ * @param hash nfs_name_hash(str, len)
+ * @return const struct nfs_name* 内存不足时返回NULL
+ */
+const struct nfs_name* nfs_name_get(const char* str, int len, uint32_t hash) {
+    struct nfs_name** bucket = &nfs_names[hash & (NFS_NAME_BUCKETS - 1)];
+    struct nfs_name*  name;
+    int               c;
+
+    pthread_mutex_lock(&nfs_super.name_lock);
+    for (name = *bucket; name != NULL; name = name->next) {
+        if (name->hash == hash && name->len == len && memcmp(name->str, str, len) == 0) {
+            name->refcnt++;
+            pthread_mutex_unlock(&nfs_super.name_lock);
+            return name;
+        }
+    }
+    c    = nfs_name_class(len);
+    name = (struct nfs_name *)nfs_slab_alloc(NFS_SLAB_NAME + c);
+    if (name != NULL) {
+        name->refcnt = 1;
+        name->hash   = hash;
+        name->len    = len;
+        memcpy(name->str, str, len);
+        name->str[len] = '\0';
+        name->next   = *bucket;
+        *bucket      = name;
+        NFS_MEM_CHARGE(NFS_NAME_MIN_SZ << c);
+    }
+    pthread_mutex_unlock(&nfs_super.name_lock);
+    return name;
+}
+
+/**
+ * @brief 释放名字的一个引用，归零时从表中摘除并延迟回收
+ *
+ * @param name 可以为NULL
+ */
+void nfs_name_put(const struct nfs_name* name) {
+    struct nfs_name*  target = (struct nfs_name *)name;
+    struct nfs_name** link;
+
+    if (target == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&nfs_super.name_lock);
+    if (--target->refcnt > 0) {
+        pthread_mutex_unlock(&nfs_super.name_lock);
+        return;
+    }
+    for (link = &nfs_names[target->hash & (NFS_NAME_BUCKETS - 1)]; *link != target; link = &(*link)->next);
+    *link = target->next;
+    pthread_mutex_unlock(&nfs_super.name_lock);
+    // 回收函数可能就地执行并再次进入驻留表，必须在解锁之后retire
+    nfs_epoch_retire(&target->rcu, nfs_name_reclaim);
+}
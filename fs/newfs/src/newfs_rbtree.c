@@ -0,0 +1,334 @@
+#include "../include/newfs.h"
+
+/*
+ * 侵入式红黑树。节点嵌在使用者的结构体里，比较和查找由使用者自己完成：
+ * 先沿树找到插入位置，调用nfs_rb_link挂上，再调用nfs_rb_insert_fixup恢复平衡。
+ */
+
+/**
+ * @brief 以x为轴左旋
+ *
+ * @param root
+ * @param x
+ */
+static void nfs_rb_rotate_left(struct nfs_rb_root* root, struct nfs_rb_node* x) {
+    struct nfs_rb_node* y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root->node = y;
+    }
+    else if (x == x->parent->left) {
+        x->parent->left = y;
+    }
+    else {
+        x->parent->right = y;
+    }
+    y->left   = x;
+    x->parent = y;
+}
+
+/**
+ * @brief 以x为轴右旋
+ *
+ * @param root
+ * @param x
+ */
+static void nfs_rb_rotate_right(struct nfs_rb_root* root, struct nfs_rb_node* x) {
+    struct nfs_rb_node* y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root->node = y;
+    }
+    else if (x == x->parent->right) {
+        x->parent->right = y;
+    }
+    else {
+        x->parent->left = y;
+    }
+    y->right  = x;
+    x->parent = y;
+}
+
+/**
+ * @brief 用v替换u在树中的位置(不处理u的子树)
+ *
+ * @param root
+ * @param u
+ * @param v 可以为NULL
+ */
+static void nfs_rb_transplant(struct nfs_rb_root* root, struct nfs_rb_node* u, struct nfs_rb_node* v) {
+    if (u->parent == NULL) {
+        root->node = v;
+    }
+    else if (u == u->parent->left) {
+        u->parent->left = v;
+    }
+    else {
+        u->parent->right = v;
+    }
+    if (v != NULL) {
+        v->parent = u->parent;
+    }
+}
+
+/**
+ * @brief 把新节点挂到parent的*link处，节点初始为红色
+ *
+ * @param node 新节点
+ * @param parent 父节点，空树时为NULL
+ * @param link 指向parent->left、parent->right或root->node
+ */
+void nfs_rb_link(struct nfs_rb_node* node, struct nfs_rb_node* parent, struct nfs_rb_node** link) {
+    node->parent = parent;
+    node->left   = NULL;
+    node->right  = NULL;
+    node->red    = TRUE;
+    *link        = node;
+}
+
+/**
+ * @brief 插入后恢复红黑性质
+ *
+ * @param root
+ * @param node 刚由nfs_rb_link挂上的节点
+ */
+void nfs_rb_insert_fixup(struct nfs_rb_root* root, struct nfs_rb_node* node) {
+    struct nfs_rb_node* parent;
+    struct nfs_rb_node* gparent;
+    struct nfs_rb_node* uncle;
+
+    while ((parent = node->parent) != NULL && parent->red) {
+        gparent = parent->parent;
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (uncle != NULL && uncle->red) {
+                parent->red  = FALSE;
+                uncle->red   = FALSE;
+                gparent->red = TRUE;
+                node         = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                nfs_rb_rotate_left(root, parent);
+                node   = parent;
+                parent = node->parent;
+            }
+            parent->red  = FALSE;
+            gparent->red = TRUE;
+            nfs_rb_rotate_right(root, gparent);
+        }
+        else {
+            uncle = gparent->left;
+            if (uncle != NULL && uncle->red) {
+                parent->red  = FALSE;
+                uncle->red   = FALSE;
+                gparent->red = TRUE;
+                node         = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                nfs_rb_rotate_right(root, parent);
+                node   = parent;
+                parent = node->parent;
+            }
+            parent->red  = FALSE;
+            gparent->red = TRUE;
+            nfs_rb_rotate_left(root, gparent);
+        }
+    }
+    root->node->red = FALSE;
+}
+
+/**
+ * @brief 删除后恢复红黑性质，x可能为NULL，所以需要同时给出它的父节点
+ *
+ * @param root
+ * @param x 顶替被删节点位置的节点
+ * @param parent x的父节点
+ */
+static void nfs_rb_erase_fixup(struct nfs_rb_root* root, struct nfs_rb_node* x, struct nfs_rb_node* parent) {
+    struct nfs_rb_node* w;
+
+    while (x != root->node && (x == NULL || !x->red)) {
+        if (x == parent->left) {
+            w = parent->right;
+            if (w->red) {
+                w->red      = FALSE;
+                parent->red = TRUE;
+                nfs_rb_rotate_left(root, parent);
+                w = parent->right;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = TRUE;
+                x      = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (w->right == NULL || !w->right->red) {
+                w->left->red = FALSE;
+                w->red       = TRUE;
+                nfs_rb_rotate_right(root, w);
+                w = parent->right;
+            }
+            w->red      = parent->red;
+            parent->red = FALSE;
+            if (w->right != NULL) {
+                w->right->red = FALSE;
+            }
+            nfs_rb_rotate_left(root, parent);
+        }
+        else {
+            w = parent->left;
+            if (w->red) {
+                w->red      = FALSE;
+                parent->red = TRUE;
+                nfs_rb_rotate_right(root, parent);
+                w = parent->left;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = TRUE;
+                x      = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (w->left == NULL || !w->left->red) {
+                w->right->red = FALSE;
+                w->red        = TRUE;
+                nfs_rb_rotate_left(root, w);
+                w = parent->left;
+            }
+            w->red      = parent->red;
+            parent->red = FALSE;
+            if (w->left != NULL) {
+                w->left->red = FALSE;
+            }
+            nfs_rb_rotate_right(root, parent);
+        }
+        x = root->node;
+        break;
+    }
+    if (x != NULL) {
+        x->red = FALSE;
+    }
+}
+
+/**
+ * @brief 从树中摘除节点
+ *
+ * @param root
+ * @param node
+ */
+void nfs_rb_erase(struct nfs_rb_root* root, struct nfs_rb_node* node) {
+    struct nfs_rb_node* y = node;
+    struct nfs_rb_node* x;
+    struct nfs_rb_node* x_parent;
+    boolean             y_red = y->red;
+
+    if (node->left == NULL) {
+        x        = node->right;
+        x_parent = node->parent;
+        nfs_rb_transplant(root, node, node->right);
+    }
+    else if (node->right == NULL) {
+        x        = node->left;
+        x_parent = node->parent;
+        nfs_rb_transplant(root, node, node->left);
+    }
+    else {
+        // 有两个孩子: 用右子树的最小节点y顶替
+        y = node->right;
+        while (y->left != NULL) {
+            y = y->left;
+        }
+        y_red = y->red;
+        x     = y->right;
+        if (y->parent == node) {
+            x_parent = y;
+        }
+        else {
+            x_parent = y->parent;
+            nfs_rb_transplant(root, y, y->right);
+            y->right         = node->right;
+            y->right->parent = y;
+        }
+        nfs_rb_transplant(root, node, y);
+        y->left         = node->left;
+        y->left->parent = y;
+        y->red          = node->red;
+    }
+    if (!y_red) {
+        nfs_rb_erase_fixup(root, x, x_parent);
+    }
+}
+
+/**
+ * @brief 中序第一个节点
+ *
+ * @param root
+ * @return struct nfs_rb_node* 空树返回NULL
+ */
+struct nfs_rb_node* nfs_rb_first(struct nfs_rb_root* root) {
+    struct nfs_rb_node* node = root->node;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->left != NULL) {
+        node = node->left;
+    }
+    return node;
+}
+
+/**
+ * @brief 中序后继
+ *
+ * @param node
+ * @return struct nfs_rb_node* 没有后继返回NULL
+ */
+struct nfs_rb_node* nfs_rb_next(struct nfs_rb_node* node) {
+    struct nfs_rb_node* parent;
+
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return node;
+    }
+    while ((parent = node->parent) != NULL && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
+
+/**
+ * @brief 中序前驱
+ *
+ * @param node
+ * @return struct nfs_rb_node* 没有前驱返回NULL
+ */
+struct nfs_rb_node* nfs_rb_prev(struct nfs_rb_node* node) {
+    struct nfs_rb_node* parent;
+
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return node;
+    }
+    while ((parent = node->parent) != NULL && node == parent->left) {
+        node = parent;
+    }
+    return parent;
+}
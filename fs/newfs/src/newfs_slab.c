@@ -0,0 +1,171 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super      nfs_super;
+
+/*
+ * 按类型的对象池。arena以NFS_ARENA_CHUNK_SZ为单位向系统申请缓存行对齐的大块，
+ * 各类对象从中顺序切出，同类对象在内存中挨在一起，也没有malloc的块头开销。
+ * 文件名按档位大小切分，不按缓存行取整，每次切分的起点仍对齐到缓存行。
+ * 释放的对象先进入线程私有的弹匣，弹匣满了一次把一半还给共享空闲链表；
+ * 分配时弹匣空了一次取回一半，共享链表也空了才切新的对象。
+ * 对象不会还给arena，卸载时连同还在目录树中的dentry和inode一起随arena整体释放。
+ */
+
+static __thread struct nfs_magazine nfs_mags[NFS_SLAB_TYPES];
+
+/**
+ * @brief 从arena切出cnt个obj_sz大小的对象，串成链表
+ *
+ * @param obj_sz 对象大小，缓存行的整数倍
+ * @param cnt 对象个数
+ * @return void* 链表头，内存不足时返回NULL
+ */
+static void* nfs_arena_carve(int obj_sz, int cnt) {
+    struct nfs_arena_chunk* chunk;
+    void*                   head = NULL;
+    uint8_t*                obj;
+
+    pthread_mutex_lock(&nfs_super.arena_lock);
+    nfs_super.arena_cur = (uint8_t *)NFS_ROUND_UP((uintptr_t)nfs_super.arena_cur, NFS_CACHELINE_SZ);
+    for (int i = 0; i < cnt; i++) {
+        if (nfs_super.arena_cur + obj_sz > nfs_super.arena_end) {
+            chunk = (struct nfs_arena_chunk *)NFS_ALIGNED_ALLOC(NFS_CACHELINE_SZ, NFS_ARENA_CHUNK_SZ);
+            if (chunk == NULL) {
+                break;
+            }
+            chunk->next         = nfs_super.arena;
+            nfs_super.arena     = chunk;
+            // 大块开头留出一个缓存行放链接，之后的对象都从缓存行边界开始
+            nfs_super.arena_cur = (uint8_t *)chunk + NFS_CACHELINE_SZ;
+            nfs_super.arena_end = (uint8_t *)chunk + NFS_ARENA_CHUNK_SZ;
+        }
+        obj                  = nfs_super.arena_cur;
+        nfs_super.arena_cur += obj_sz;
+        *(void **)obj        = head;
+        head                 = obj;
+    }
+    pthread_mutex_unlock(&nfs_super.arena_lock);
+    return head;
+}
+
+/**
+ * @brief 取得当前线程对应类型的弹匣，上一次挂载留下的内容直接丢弃
+ *
+ * @param type
+ * @return struct nfs_magazine*
+ */
+static struct nfs_magazine* nfs_mag_get(NFS_SLAB_TYPE type) {
+    struct nfs_magazine* mag = &nfs_mags[type];
+
+    if (mag->gen != nfs_super.slab_gen) {
+        mag->gen = nfs_super.slab_gen;
+        mag->cnt = 0;
+    }
+    return mag;
+}
+
+/**
+ * @brief 建立各类对象的slab，挂载时在第一次分配之前调用，此时逻辑块大小已知
+ */
+void nfs_slab_init(void) {
+    static uint32_t gen;
+    int             sz[NFS_SLAB_TYPES];
+
+    sz[NFS_SLAB_DENTRY] = sizeof(struct nfs_dentry);
+    sz[NFS_SLAB_INODE]  = sizeof(struct nfs_inode);
+    sz[NFS_SLAB_BLK]    = NFS_BLK_SZ();
+    for (int t = 0; t < NFS_SLAB_TYPES; t++) {
+        nfs_super.slabs[t].obj_sz    = t < NFS_SLAB_NAME ? NFS_ROUND_UP(sz[t], NFS_CACHELINE_SZ)
+                                                         : NFS_NAME_MIN_SZ << (t - NFS_SLAB_NAME);
+        nfs_super.slabs[t].free_list = NULL;
+        nfs_super.slabs[t].free_cnt  = 0;
+        pthread_mutex_init(&nfs_super.slabs[t].lock, NULL);
+    }
+    nfs_super.arena     = NULL;
+    nfs_super.arena_cur = NULL;
+    nfs_super.arena_end = NULL;
+    pthread_mutex_init(&nfs_super.arena_lock, NULL);
+    // 从1开始，线程弹匣初始的gen为0，第一次使用时就会被清空
+    nfs_super.slab_gen  = ++gen;
+}
+
+/**
+ * @brief 卸载时调用: 释放arena的所有大块，所有对象随之失效
+ */
+void nfs_slab_destroy(void) {
+    struct nfs_arena_chunk* chunk;
+    struct nfs_arena_chunk* next;
+
+    for (chunk = nfs_super.arena; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    nfs_super.arena = NULL;
+    for (int t = 0; t < NFS_SLAB_TYPES; t++) {
+        nfs_super.slabs[t].free_list = NULL;
+        nfs_super.slabs[t].free_cnt  = 0;
+        pthread_mutex_destroy(&nfs_super.slabs[t].lock);
+    }
+    pthread_mutex_destroy(&nfs_super.arena_lock);
+}
+
+/**
+ * @brief 分配一个对象，内容未初始化
+ *
+ * @param type 对象类型
+ * @return void* 缓存行对齐的对象，内存不足时返回NULL
+ */
+void* nfs_slab_alloc(NFS_SLAB_TYPE type) {
+    struct nfs_magazine* mag  = nfs_mag_get(type);
+    struct nfs_slab*     slab = &nfs_super.slabs[type];
+    void*                obj;
+
+    if (mag->cnt == 0) {
+        // 弹匣空了，先从共享链表取回半个弹匣
+        pthread_mutex_lock(&slab->lock);
+        while (slab->free_list != NULL && mag->cnt < NFS_MAG_SZ / 2) {
+            obj             = slab->free_list;
+            slab->free_list = *(void **)obj;
+            slab->free_cnt--;
+            mag->objs[mag->cnt++] = obj;
+        }
+        pthread_mutex_unlock(&slab->lock);
+    }
+    if (mag->cnt == 0) {
+        obj = nfs_arena_carve(slab->obj_sz, NFS_MAG_SZ / 2);
+        while (obj != NULL) {
+            mag->objs[mag->cnt++] = obj;
+            obj = *(void **)obj;
+        }
+    }
+    if (mag->cnt == 0) {
+        return NULL;
+    }
+    return mag->objs[--mag->cnt];
+}
+
+/**
+ * @brief 归还一个对象
+ *
+ * @param type 对象类型，必须与分配时一致
+ * @param obj 可以为NULL
+ */
+void nfs_slab_free(NFS_SLAB_TYPE type, void* obj) {
+    struct nfs_magazine* mag  = nfs_mag_get(type);
+    struct nfs_slab*     slab = &nfs_super.slabs[type];
+
+    if (obj == NULL) {
+        return;
+    }
+    if (mag->cnt == NFS_MAG_SZ) {
+        // 弹匣满了，把一半还给共享链表
+        pthread_mutex_lock(&slab->lock);
+        while (mag->cnt > NFS_MAG_SZ / 2) {
+            *(void **)mag->objs[mag->cnt - 1] = slab->free_list;
+            slab->free_list = mag->objs[--mag->cnt];
+            slab->free_cnt++;
+        }
+        pthread_mutex_unlock(&slab->lock);
+    }
+    mag->objs[mag->cnt++] = obj;
+}
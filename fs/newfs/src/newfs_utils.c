@@ -2,6 +2,12 @@
 
 struct nfs_super      nfs_super; 
 struct custom_options nfs_options;
+#ifndef NDEBUG
+__thread long         nfs_alloc_cnt;     // 本线程的堆分配次数，日志线程等其他线程的分配不计入
+__thread long         nfs_load_cnt;      // 本线程从磁盘装载inode的次数
+long                  nfs_head_pos;      // 上一次IO结束时磁头所在的字节偏移
+long                  nfs_head_travel;   // 磁头累计移动的字节数
+#endif
 
 /**
  * @brief 获取文件名
@@ -16,6 +22,34 @@ char* nfs_get_fname(const char* path) {
     return q;
 }
 
+/**
+ * @brief 生成新的dentry，从dentry的slab中分配，名字取自驻留表
+ * 
+ * @param fname 文件名，长度必须小于NFS_MAX_FILE_NAME
+ * @param ftype 文件类型
+ * @return struct nfs_dentry* 内存不足时返回NULL
+ */
+struct nfs_dentry* new_dentry(char * fname, NFS_FILE_TYPE ftype) {
+    struct nfs_dentry * dentry = (struct nfs_dentry *)nfs_slab_alloc(NFS_SLAB_DENTRY);
+    int                 len    = strlen(fname);
+    if (dentry == NULL) {
+        return NULL;
+    }
+    memset(dentry, 0, sizeof(struct nfs_dentry));
+    dentry->hash     = nfs_name_hash(fname, len);
+    dentry->name     = nfs_name_get(fname, len, dentry->hash);
+    if (dentry->name == NULL) {
+        nfs_slab_free(NFS_SLAB_DENTRY, dentry);
+        return NULL;
+    }
+    dentry->ftype    = ftype;
+    dentry->ino      = -1;
+    dentry->inode    = NULL;
+    dentry->parent   = NULL;
+    dentry->brother  = NULL;
+    return dentry;
+}
+
 /**
  * @brief 计算路径的层级
  * exm: /av/c/d/f
@@ -40,23 +74,64 @@ int nfs_calc_lvl(const char * path) {
 }
 
 /**
- * @brief 驱动读
+ * @brief 取出路径中的下一段文件名，可重入且不修改原路径
+ * exm: cursor -> "/av/c/d"
+ * -> 返回"av"的起点，len = 2，cursor移动到"/c/d"
+ * @param cursor 路径游标
+ * @param len 输出该段文件名的长度
+ * @return const char* 该段文件名起点，没有更多分段时返回NULL
+ */
+const char* nfs_next_fname(const char ** cursor, int * len) {
+    const char* start = nfs_peek_fname(*cursor);
+    const char* end;
+
+    if (start == NULL) {
+        return NULL;
+    }
+    end = start;
+    while (*end != '/' && *end != '\0') {
+        end++;
+    }
+    *len    = end - start;
+    *cursor = end;
+    return start;
+}
+
+/**
+ * @brief 跳过'/'，返回下一段文件名的起点，但不移动游标
+ * 
+ * @param cursor 
+ * @return const char* 没有更多分段时返回NULL
+ */
+const char* nfs_peek_fname(const char * cursor) {
+    while (*cursor == '/') {
+        cursor++;
+    }
+    return *cursor == '\0' ? NULL : cursor;
+}
+
+/**
+ * @brief 驱动读，调用者持有io_lock
  * 
  * @param offset 
  * @param out_content 
  * @param size 
  * @return int 
  */
-int nfs_driver_read(int offset, uint8_t *out_content, int size) {
+static int nfs_driver_read_locked(off_t offset, uint8_t *out_content, int size) {
     // 对齐，按一个逻辑块大小(两个IO大小)进行读写
-    int      offset_aligned = NFS_ROUND_DOWN(offset, NFS_BLK_SZ());
+    off_t    offset_aligned = NFS_ROUND_DOWN(offset, NFS_BLK_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NFS_ROUND_UP((size + bias), NFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
+    uint8_t* temp_content   = (uint8_t*)NFS_MALLOC(size_aligned);
     uint8_t* cur            = temp_content;
     
     // 磁盘头定位到down位置
     ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
+#ifndef NDEBUG
+    nfs_head_travel += labs(offset_aligned - nfs_head_pos);
+    nfs_head_pos     = offset_aligned + size_aligned;
+#endif
     // 按照IO大小进行读，从down开始读size_aligned大小的内容
     while (size_aligned != 0)
     {
@@ -70,6 +145,23 @@ int nfs_driver_read(int offset, uint8_t *out_content, int size) {
     return NFS_ERROR_NONE;
 }
 
+/**
+ * @brief 驱动读
+ * 
+ * @param offset 
+ * @param out_content 
+ * @param size 
+ * @return int 
+ */
+int nfs_driver_read(off_t offset, uint8_t *out_content, int size) {
+    int ret;
+
+    pthread_mutex_lock(&nfs_super.io_lock);
+    ret = nfs_driver_read_locked(offset, out_content, size);
+    pthread_mutex_unlock(&nfs_super.io_lock);
+    return ret;
+}
+
 /**
  * @brief 驱动写
  * 
@@ -78,19 +170,28 @@ int nfs_driver_read(int offset, uint8_t *out_content, int size) {
  * @param size 
  * @return int 
  */
-int nfs_driver_write(int offset, uint8_t *in_content, int size) {
+int nfs_driver_write(off_t offset, uint8_t *in_content, int size) {
     // 对齐，按一个逻辑块大小(两个IO大小)进行读写
-    int      offset_aligned = NFS_ROUND_DOWN(offset, NFS_BLK_SZ());
+    off_t    offset_aligned = NFS_ROUND_DOWN(offset, NFS_BLK_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NFS_ROUND_UP((size + bias), NFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
+    uint8_t* temp_content   = (uint8_t*)NFS_MALLOC(size_aligned);
     uint8_t* cur            = temp_content;
-    // 读出被写磁盘块到内存
-    nfs_driver_read(offset_aligned, temp_content, size_aligned);
+
+    // 读-改-写整个过程都要持有io_lock，否则会覆盖掉别的线程对同一块其余部分的写
+    pthread_mutex_lock(&nfs_super.io_lock);
+    // 读出被写磁盘块到内存，整块对齐的写全部覆盖，不用读
+    if (bias != 0 || size % NFS_BLK_SZ() != 0) {
+        nfs_driver_read_locked(offset_aligned, temp_content, size_aligned);
+    }
     // 从down+bias开始覆盖size大小的内容
     memcpy(temp_content + bias, in_content, size);
     // 磁盘头定位到down
     ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
+#ifndef NDEBUG
+    nfs_head_travel += labs(offset_aligned - nfs_head_pos);
+    nfs_head_pos     = offset_aligned + size_aligned;
+#endif
 
     // 内容在内存中修改后写回磁盘
     while (size_aligned != 0)
@@ -99,303 +200,1444 @@ int nfs_driver_write(int offset, uint8_t *in_content, int size) {
         cur          += NFS_IO_SZ();
         size_aligned -= NFS_IO_SZ();   
     }
-
-    free(temp_content);
-    return NFS_ERROR_NONE;
+    pthread_mutex_unlock(&nfs_super.io_lock);
+
+    free(temp_content);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放第blk个数据块的内存缓冲
+ * 
+ * @param inode 
+ * @param blk 块序号
+ */
+static void nfs_put_data_buf(struct nfs_inode* inode, int blk) {
+    if (inode->data[blk] != NULL) {
+        nfs_slab_free(NFS_SLAB_BLK, inode->data[blk]);
+        inode->data[blk] = NULL;
+        NFS_MEM_CHARGE(-(long)NFS_BLK_SZ());
+    }
+}
+
+/**
+ * @brief 为还没有数据块的inode建立内联块: 内存中仍是一整块的缓冲，只有前NFS_INLINE_SZ()字节随inode写回
+ * 
+ * @param inode 
+ * @return uint8_t* 清零的缓冲，内存不足时返回NULL
+ */
+static uint8_t* nfs_inline_create(struct nfs_inode* inode) {
+    inode->data[0] = (uint8_t *)nfs_slab_alloc(NFS_SLAB_BLK);
+    if (inode->data[0] == NULL) {
+        return NULL;
+    }
+    memset(inode->data[0], 0, NFS_BLK_SZ());
+    NFS_MEM_CHARGE(NFS_BLK_SZ());
+    inode->block_pointer[0] = NFS_DNO_INLINE;
+    inode->block_allocted   = 1;
+    inode->data_dirty      |= 1u;
+    return inode->data[0];
+}
+
+/**
+ * @brief 内联块放不下时转为普通的延迟分配块，内容留在原来的缓冲中，写回时再选定物理块
+ * 
+ * @param inode 
+ * @return int 空间不足时返回-NFS_ERROR_NOSPACE
+ */
+static int nfs_inline_promote(struct nfs_inode* inode) {
+    inode->block_allocted = 0;
+    if (nfs_delalloc_reserve(inode, 1) != NFS_ERROR_NONE) {
+        inode->block_allocted = 1;
+        return -NFS_ERROR_NOSPACE;
+    }
+    inode->data_dirty |= 1u;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写普通文件的[0, end)范围之前调用: 还没有数据块且end不超过内联容量时改为内联存储；
+ * 内联文件要写到内联容量之外时先转为普通数据块
+ * 
+ * @param inode 
+ * @param end 写入范围的结束偏移
+ * @return int 
+ */
+int nfs_inline_prepare(struct nfs_inode* inode, off_t end) {
+    if (NFS_IS_INLINE(inode)) {
+        return end > NFS_INLINE_SZ() ? nfs_inline_promote(inode) : NFS_ERROR_NONE;
+    }
+    if (inode->block_allocted == 0 && end <= NFS_INLINE_SZ()) {
+        return nfs_inline_create(inode) == NULL ? -NFS_ERROR_NOSPACE : NFS_ERROR_NONE;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将dentry挂到inode的目录项链表头部并加入哈希索引，不涉及数据块分配
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 
+ */
+static int nfs_link_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    if (nfs_dindex_insert(inode, dentry) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+
+    if (inode->dentrys == NULL) {
+        inode->dentrys = dentry;
+    }
+    else {
+        dentry->brother = inode->dentrys;
+        inode->dentrys = dentry;
+    }
+    inode->dir_cnt++;
+    // 偏移只增不减，删除目录项不会改变其他项的偏移
+    dentry->d_off = ++inode->dir_off_next;
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 在目录的数据块缓冲中为dentry写入一条记录: 优先使用空闲记录或从有富余的记录尾部拆出，
+ * 都放不下时在目录末尾追加一个块(只预扣空间，写回时才选定物理块)
+ * 
+ * @param inode 目录inode
+ * @param dentry ino、名字和类型都已设置好
+ * @return int 
+ */
+static int nfs_dirent_add(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    int                  need = NFS_DIRENT_LEN(dentry->name->len);
+    struct nfs_dirent_d* rec  = NULL;
+    struct nfs_dirent_d* next;
+    uint8_t*             blk;
+    int                  blk_no, offset, used = 0;
+
+retry:
+    for (blk_no = 0; blk_no < inode->block_allocted; blk_no++) {
+        blk = nfs_get_data_blk(inode, blk_no, FALSE);
+        if (blk == NULL) {
+            return -NFS_ERROR_IO;
+        }
+        for (offset = 0; offset < NFS_BLK_CAP(inode, blk_no); offset += rec->rec_len) {
+            rec  = (struct nfs_dirent_d *)(blk + offset);
+            used = rec->ino == 0 ? 0 : NFS_DIRENT_LEN(rec->name_len);
+            if (rec->rec_len - used >= need) {
+                goto found;
+            }
+        }
+    }
+    if (NFS_IS_INLINE(inode)) {
+        // 内联块放满了，转为普通数据块，多出的空间并入块中最后一条记录
+        if (nfs_inline_promote(inode) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        rec->rec_len += NFS_BLK_SZ() - NFS_INLINE_SZ();
+        goto retry;
+    }
+    // 空目录先用内联块，目录最多只有NFS_DATA_PER_FILE个数据块。
+    // 根目录除外: tests/checkbm要求它的目录项落在数据区第一块
+    blk = inode->block_allocted == 0 && inode->ino != NFS_ROOT_INO
+        ? nfs_inline_create(inode) : nfs_get_data_blk(inode, blk_no, TRUE);
+    if (blk == NULL) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    rec          = (struct nfs_dirent_d *)blk;
+    rec->ino     = 0;
+    rec->rec_len = NFS_BLK_CAP(inode, blk_no);
+    used         = 0;
+    inode->size  = NFS_BLKS_SZ(inode->block_allocted);
+
+found:
+    if (used > 0) {
+        next          = (struct nfs_dirent_d *)((uint8_t *)rec + used);
+        next->rec_len = rec->rec_len - used;
+        rec->rec_len  = used;
+        rec           = next;
+    }
+    rec->ino      = dentry->ino;
+    rec->name_len = dentry->name->len;
+    rec->ftype    = dentry->ftype;
+    memcpy(rec->name, dentry->name->str, dentry->name->len);
+    inode->data_dirty |= 1u << blk_no;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 删除dentry在目录数据块中的记录，空间并入同一块中的前一条记录；
+ * 目录末尾的块因此变空时归还
+ * 
+ * @param inode 目录inode
+ * @param dentry 
+ * @return int 
+ */
+static int nfs_dirent_del(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dirent_d* rec;
+    struct nfs_dirent_d* prev;
+    uint8_t*             blk;
+    int                  blk_no, offset;
+
+    for (blk_no = 0; blk_no < inode->block_allocted; blk_no++) {
+        blk = nfs_get_data_blk(inode, blk_no, FALSE);
+        if (blk == NULL) {
+            return -NFS_ERROR_IO;
+        }
+        prev = NULL;
+        for (offset = 0; offset < NFS_BLK_CAP(inode, blk_no); offset += rec->rec_len) {
+            rec = (struct nfs_dirent_d *)(blk + offset);
+            // rename在同一目录内时新旧两条记录的ino相同，还要比较名字
+            if (rec->ino == dentry->ino && rec->name_len == dentry->name->len
+                && memcmp(rec->name, dentry->name->str, rec->name_len) == 0) {
+                if (prev != NULL) {
+                    prev->rec_len += rec->rec_len;
+                }
+                else {
+                    rec->ino = 0;
+                }
+                inode->data_dirty |= 1u << blk_no;
+                goto trim;
+            }
+            prev = rec;
+        }
+    }
+    return -NFS_ERROR_NOTFOUND;
+
+trim:
+    // 空块只剩一条横跨整块的空闲记录
+    while (inode->block_allocted > 0) {
+        rec = (struct nfs_dirent_d *)inode->data[inode->block_allocted - 1];
+        if (rec->ino != 0 || rec->rec_len != NFS_BLK_CAP(inode, inode->block_allocted - 1)) {
+            break;
+        }
+        nfs_put_tail_blk(inode);
+        nfs_put_data_buf(inode, inode->block_allocted);
+    }
+    inode->size = NFS_BLKS_SZ(inode->block_allocted);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将dentry插入到inode中，采用头插法，同时维护目录哈希索引和目录数据块中的记录
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 插入后的目录项数量，失败返回错误号
+ */
+int nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    int ret;
+
+    ret = nfs_dirent_add(inode, dentry);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = nfs_link_dentry(inode, dentry);
+    if (ret < 0) {
+        nfs_dirent_del(inode, dentry);
+        return ret;
+    }
+    // 目录中出现了新名字，之前记录的负向结果和readdir游标全部作废
+    __atomic_add_fetch(&inode->dentry->dir_gen, 1, __ATOMIC_RELEASE);
+    nfs_journal_dirty(inode);
+    return ret;
+}
+
+/**
+ * @brief 将dentry从inode的目录项链表和哈希索引中摘除，不动目录数据块中的记录
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 摘除后的目录项数量，dentry不在该目录中时返回-NFS_ERROR_NOTFOUND
+ */
+static int nfs_unlink_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dentry** link = &inode->dentrys;
+
+    while (*link != NULL && *link != dentry) {
+        link = &(*link)->brother;
+    }
+    if (*link == NULL) {
+        return -NFS_ERROR_NOTFOUND;
+    }
+    *link = dentry->brother;
+    dentry->brother = NULL;
+    nfs_dindex_remove(inode, dentry);
+    __atomic_add_fetch(&inode->dentry->dir_gen, 1, __ATOMIC_RELEASE);
+    nfs_journal_dirty(inode);
+
+    inode->dir_cnt--;
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 将dentry从inode的目录项中摘除，目录末尾的数据块变空时将其释放
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 摘除后的目录项数量，失败返回错误号
+ */
+int nfs_drop_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
+    struct nfs_dentry* cursor;
+    int                ret;
+
+    for (cursor = inode->dentrys; cursor != NULL && cursor != dentry; cursor = cursor->brother);
+    if (cursor == NULL) {
+        return -NFS_ERROR_NOTFOUND;
+    }
+    ret = nfs_dirent_del(inode, dentry);
+    if (ret < 0) {
+        return ret;
+    }
+    return nfs_unlink_dentry(inode, dentry);
+}
+
+/**
+ * @brief 在目录数据块中找到dentry的记录
+ * 
+ * @param inode 目录inode
+ * @param dentry 
+ * @param blk_no 返回记录所在的块序号
+ * @return struct nfs_dirent_d* 找不到返回NULL
+ */
+static struct nfs_dirent_d* nfs_dirent_find(struct nfs_inode* inode, struct nfs_dentry* dentry, int* blk_no) {
+    struct nfs_dirent_d* rec;
+    uint8_t*             blk;
+
+    for (*blk_no = 0; *blk_no < inode->block_allocted; (*blk_no)++) {
+        blk = nfs_get_data_blk(inode, *blk_no, FALSE);
+        if (blk == NULL) {
+            return NULL;
+        }
+        for (int offset = 0; offset < NFS_BLK_CAP(inode, *blk_no); offset += rec->rec_len) {
+            rec = (struct nfs_dirent_d *)(blk + offset);
+            if (rec->ino == dentry->ino && rec->name_len == dentry->name->len
+                && memcmp(rec->name, dentry->name->str, rec->name_len) == 0) {
+                return rec;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief rename: 把dentry从from目录移到to目录并改名。按先腾位置、再摘原记录、最后挂入的顺序进行，
+ * 前两步失败时两个目录都保持原样，第三步不会失败。
+ * 目标已存在时直接接管它的记录(记录里的ino改成dentry的，名字本来就相同)，不需要新的空间；
+ * 否则先在to中写好新记录。target随后从to中摘除，它的inode由调用者释放。
+ * 调用者持有两个目录的写锁
+ * 
+ * @param from 原目录inode
+ * @param to 目标目录inode，可以与from相同
+ * @param dentry 被移动的dentry
+ * @param name 新名字
+ * @param hash 新名字的哈希
+ * @param target 同名的已存在的目标，没有时为NULL
+ * @return int 
+ */
+int nfs_move_dentry(struct nfs_inode* from, struct nfs_inode* to, struct nfs_dentry* dentry,
+                    const struct nfs_name* name, uint32_t hash, struct nfs_dentry* target) {
+    struct nfs_dentry    tmp;
+    struct nfs_dirent_d* rec = NULL;
+    int                  blk_no;
+    int                  ret;
+
+    tmp.ino   = dentry->ino;
+    tmp.ftype = dentry->ftype;
+    tmp.name  = name;
+    if (target != NULL) {
+        rec = nfs_dirent_find(to, target, &blk_no);
+        if (rec == NULL) {
+            return -NFS_ERROR_IO;
+        }
+    }
+    else {
+        ret = nfs_dirent_add(to, &tmp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    // 插入时已用槽位(含墓碑)加一不超过3/4就不会扩容
+    ret = nfs_dindex_reserve(to, to->dir_index_used + 1);
+    if (ret == NFS_ERROR_NONE) {
+        // 摘掉原记录只会合并同一块中的记录或释放末尾的空块，rec所在的块不受影响
+        ret = nfs_drop_dentry(from, dentry);
+    }
+    if (ret < 0) {
+        if (target == NULL) {
+            nfs_dirent_del(to, &tmp);
+        }
+        return ret;
+    }
+
+    if (target != NULL) {
+        rec->ino   = dentry->ino;
+        rec->ftype = dentry->ftype;
+        to->data_dirty |= 1u << blk_no;
+        nfs_unlink_dentry(to, target);
+    }
+    // 无锁查找可能还拿着旧名字，旧名字由调用者等换名完成后归还
+    __atomic_store_n(&dentry->name, name, __ATOMIC_RELEASE);
+    dentry->hash   = hash;
+    dentry->parent = to->dentry;
+    nfs_link_dentry(to, dentry);
+    __atomic_add_fetch(&to->dentry->dir_gen, 1, __ATOMIC_RELEASE);
+    nfs_journal_dirty(to);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 新inode的期望位置: 顶层目录放到空闲inode最多的组里空闲最多的一段，使各顶层目录彼此分散；
+ * 其余紧跟父目录的inode
+ * 
+ * @param dentry 新inode对应的dentry，parent已经设置好
+ * @return int 期望的inode号
+ */
+static int nfs_inode_goal(struct nfs_dentry* dentry) {
+    struct nfs_dentry* parent = dentry->parent;
+    struct nfs_group*  group;
+    int slot_sz, best_slot, best_free, best_group, free_cnt;
+
+    if (parent == NULL || parent->inode == NULL) {
+        return 0;
+    }
+    if (dentry->ftype != NFS_DIR || parent != nfs_super.root_dentry) {
+        return parent->ino + 1;
+    }
+
+    // 只是选一个期望位置，各组依次加锁读取即可，不要求整体一致
+    best_group = 0;
+    best_free  = -1;
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        pthread_mutex_lock(&nfs_super.groups[g].ino_lock);
+        free_cnt = nfs_super.groups[g].ino_bmap.free_cnt;
+        pthread_mutex_unlock(&nfs_super.groups[g].ino_lock);
+        if (free_cnt > best_free) {
+            best_free  = free_cnt;
+            best_group = g;
+        }
+    }
+    group     = &nfs_super.groups[best_group];
+    slot_sz   = NFS_ROUND_UP(group->max_ino, NFS_SPREAD_SLOTS) / NFS_SPREAD_SLOTS;
+    best_slot = 0;
+    best_free = -1;
+    pthread_mutex_lock(&group->ino_lock);
+    for (int i = 0; i < NFS_SPREAD_SLOTS; i++) {
+        free_cnt = nfs_bitmap_count_free(&group->ino_bmap, i * slot_sz, slot_sz);
+        if (free_cnt > best_free) {
+            best_free = free_cnt;
+            best_slot = i;
+        }
+    }
+    pthread_mutex_unlock(&group->ino_lock);
+    return best_group * nfs_super.inodes_per_group + best_slot * slot_sz;
+}
+
+/**
+ * @brief 数据块的期望位置: 紧跟文件自己的最后一个物理块；还没有物理块时紧跟父目录的最后一个物理块，
+ * 使目录项和其下文件的内容相邻。调用者持有alloc_lock，块号和块数都在这把锁下修改
+ * 
+ * @param inode 
+ * @return int 期望的数据块号
+ */
+int nfs_data_goal(struct nfs_inode* inode) {
+    struct nfs_dentry* parent = inode->dentry->parent;
+    struct nfs_inode*  parent_inode;
+
+    if (NFS_MAPPED_BLKS(inode) > 0 && !NFS_IS_INLINE(inode)) {
+        return inode->block_pointer[NFS_MAPPED_BLKS(inode) - 1] + 1;
+    }
+    if (parent != NULL && parent->inode != NULL) {
+        parent_inode = parent->inode;
+        if (NFS_MAPPED_BLKS(parent_inode) > 0 && !NFS_IS_INLINE(parent_inode)) {
+            return parent_inode->block_pointer[NFS_MAPPED_BLKS(parent_inode) - 1] + 1;
+        }
+    }
+    // 从inode所在组的数据区开头紧凑地用，组内元数据和数据离得最近
+    return NFS_INO_GROUP(inode->ino) * nfs_super.data_per_group;
+}
+
+/**
+ * @brief 在位图上分配一个inode号，先在goal所在组内从goal往后找，该组已满再依次找后面的组
+ * 
+ * @param goal 期望的inode号
+ * @return int inode号，没有空闲inode时返回-NFS_ERROR_NOSPACE
+ */
+static int nfs_alloc_ino(int goal) {
+    int first = goal >= 0 && goal < nfs_super.max_ino ? NFS_INO_GROUP(goal) : 0;
+    int g, idx;
+
+    for (int i = 0; i < nfs_super.group_cnt; i++) {
+        g   = (first + i) % nfs_super.group_cnt;
+        pthread_mutex_lock(&nfs_super.groups[g].ino_lock);
+        idx = nfs_bitmap_alloc_near(&nfs_super.groups[g].ino_bmap, i == 0 ? NFS_INO_IDX(goal) : 0);
+        pthread_mutex_unlock(&nfs_super.groups[g].ino_lock);
+        if (idx >= 0) {
+            return g * nfs_super.inodes_per_group + idx;
+        }
+    }
+    return -NFS_ERROR_NOSPACE;
+}
+
+/**
+ * @brief 分配一个inode，占用位图
+ * 
+ * @param dentry 该dentry指向分配的inode
+ * @return nfs_inode
+ */
+struct nfs_inode* nfs_alloc_inode(struct nfs_dentry * dentry) {
+    struct nfs_inode* inode;
+    int ino_cursor;
+
+    inode = (struct nfs_inode*)nfs_slab_alloc(NFS_SLAB_INODE);
+    if (inode == NULL) {
+        return NULL;
+    }
+
+    // 数据块不在这里预先分配，等目录项或文件内容需要时再由nfs_alloc_data分配
+    ino_cursor = nfs_alloc_ino(nfs_inode_goal(dentry));
+    if (ino_cursor < 0) {
+        nfs_slab_free(NFS_SLAB_INODE, inode);
+        return NULL;
+    }
+
+    // 为目录项分配inode节点并初始化相关属性
+    inode->ino  = ino_cursor; 
+    inode->size = 0;
+    inode->dir_cnt = 0;
+    inode->block_allocted = 0;
+    inode->dentrys = NULL;
+    inode->dir_index = NULL;
+    inode->dir_index_used = 0;
+    inode->dir_off_next = 0;
+    inode->open_cnt = 0;
+    inode->refcnt = 1;
+    inode->hnext = NULL;
+    inode->lru.prev = NULL;
+    inode->lru.next = NULL;
+    inode->lru_ref = 0;
+    inode->jnl_dirty.prev = NULL;
+    inode->jnl_dirty.next = NULL;
+    pthread_rwlock_init(&inode->lock, NULL);
+    pthread_mutex_init(&inode->load_lock, NULL);
+    NFS_MEM_CHARGE(sizeof(struct nfs_inode));
+
+    // dentry指向分配的inode 
+    dentry->inode = inode;
+    dentry->ino   = inode->ino;
+    // inode指回dentry 
+    inode->dentry = dentry;
+    
+    // 普通文件的数据块缓冲在读写时按需分配
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        inode->data[i] = NULL;
+    }
+    inode->data_dirty = 0;
+    inode->flags = 0;
+    inode->rsv_start = 0;
+    inode->rsv_len = 0;
+    inode->rsv_win = 0;
+    inode->rsv_node.prev = NULL;
+    inode->rsv_node.next = NULL;
+    inode->delay_cnt = 0;
+
+    pthread_mutex_lock(&nfs_super.load_lock);
+    nfs_icache_insert(inode);
+    pthread_mutex_unlock(&nfs_super.load_lock);
+    nfs_journal_dirty(inode);
+    // 根目录常驻内存，不参与换出
+    if (dentry->parent != NULL) {
+        nfs_lru_add(inode);
+    }
+    return inode;
+}
+
+/**
+ * @brief 额外分配一个数据块，调用者持有alloc_lock
+ * @return 分配的数据块号
+ */
+ int nfs_alloc_data() {
+    struct nfs_group* group;
+    int idx, dno;
+
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        group = &nfs_super.groups[g];
+        idx   = nfs_bitmap_alloc(&group->data_bmap);
+        if (idx < 0) {
+            continue;
+        }
+        // 空闲区间索引与位图同步
+        dno = g * nfs_super.data_per_group + idx;
+        if (nfs_extent_alloc_range(&nfs_super.data_extents, dno, 1) != NFS_ERROR_NONE) {
+            nfs_bitmap_free(&group->data_bmap, idx);
+            return -NFS_ERROR_NOSPACE;
+        }
+        return dno;
+    }
+    return -NFS_ERROR_NOSPACE;
+ }
+
+/**
+ * @brief 分配cnt个物理连续的数据块，优先靠近goal，调用者持有alloc_lock
+ * 
+ * @param goal 期望的起始块号，小于0表示不关心位置，取最佳适配
+ * @param cnt 块数
+ * @return int 起始块号，找不到足够长的空闲区间时返回-NFS_ERROR_NOSPACE
+ */
+int nfs_alloc_data_range(int goal, int cnt) {
+    int start;
+
+    if (goal >= 0 && goal < nfs_super.max_dno) {
+        start = nfs_extent_near(&nfs_super.data_extents, goal, cnt);
+    }
+    else {
+        start = nfs_extent_best_fit(&nfs_super.data_extents, cnt);
+    }
+    if (start < 0 || nfs_extent_alloc_range(&nfs_super.data_extents, start, cnt) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    // 区间不跨组，整段都在同一组的位图里
+    for (int i = 0; i < cnt; i++) {
+        nfs_bitmap_set(&nfs_super.groups[NFS_DNO_GROUP(start)].data_bmap, NFS_DNO_IDX(start + i));
+    }
+    return start;
+}
+
+/**
+ * @brief 释放一个数据块，直接按块号定位位图，调用者持有alloc_lock
+ * 
+ * @param dno 数据块号
+ * @return int 日志中记不下作废时返回-NFS_ERROR_NOSPACE，块保持已分配，宁可泄漏也不能被重用
+ */
+int nfs_free_data(int dno) {
+    struct nfs_group* group;
+
+    if (dno < 0 || dno >= nfs_super.max_dno) {
+        return NFS_ERROR_NONE;
+    }
+    group = &nfs_super.groups[NFS_DNO_GROUP(dno)];
+    if (NFS_DNO_IDX(dno) >= group->max_dno || !nfs_bitmap_test(&group->data_bmap, NFS_DNO_IDX(dno))) {
+        return NFS_ERROR_NONE;
+    }
+    // 块可能马上作为普通文件的数据块直接写盘，日志中它作为目录块的旧映像要先作废
+    if (nfs_journal_revoke(NFS_DATA_OFS(dno) / NFS_BLK_SZ()) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] cannot revoke block %d, leaked\n", __func__, dno);
+        return -NFS_ERROR_NOSPACE;
+    }
+    nfs_bitmap_free(&group->data_bmap, NFS_DNO_IDX(dno));
+    nfs_extent_free_range(&nfs_super.data_extents, dno, 1);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 宽限期过后释放inode结构本身
+ * 
+ * @param head 
+ */
+static void nfs_inode_reclaim(struct nfs_rcu_head* head) {
+    struct nfs_inode* inode = NFS_CONTAINER_OF(head, struct nfs_inode, rcu);
+
+    pthread_rwlock_destroy(&inode->lock);
+    pthread_mutex_destroy(&inode->load_lock);
+    nfs_slab_free(NFS_SLAB_INODE, inode);
+}
+
+/**
+ * @brief 宽限期过后释放dentry
+ * 
+ * @param head 
+ */
+static void nfs_dentry_reclaim(struct nfs_rcu_head* head) {
+    nfs_discard_dentry(NFS_CONTAINER_OF(head, struct nfs_dentry, rcu));
+}
+
+/**
+ * @brief 立即释放dentry，只能用于从未挂上目录树或已过宽限期的dentry
+ * 
+ * @param dentry 
+ */
+void nfs_discard_dentry(struct nfs_dentry* dentry) {
+    nfs_name_put(dentry->name);
+    nfs_slab_free(NFS_SLAB_DENTRY, dentry);
+}
+
+/**
+ * @brief 释放已经从目录树中摘除的dentry，无锁查找可能还在访问它，所以延迟释放
+ * 
+ * @param dentry 
+ */
+void nfs_free_dentry(struct nfs_dentry* dentry) {
+    NFS_MEM_CHARGE(-(long)sizeof(struct nfs_dentry));
+    nfs_epoch_retire(&dentry->rcu, nfs_dentry_reclaim);
+}
+
+/**
+ * @brief 释放inode及其占用的数据块，目录型文件要求已经为空
+ * 
+ * @param inode 
+ * @return int 
+ */
+int nfs_drop_inode(struct nfs_inode * inode) {
+    int ino = inode->ino;
+
+    if (inode == nfs_super.root_dentry->inode) {
+        return -NFS_ERROR_INVAL;
+    }
+    if (NFS_IS_DIR(inode) && inode->dir_cnt != 0) {
+        return -NFS_ERROR_INVAL;
+    }
+
+    while (inode->block_allocted > 0) {
+        nfs_put_tail_blk(inode);
+    }
+    nfs_rsv_release(inode);
+    // 先移出inode缓存，inode号归还之后可能马上被新文件用上
+    pthread_mutex_lock(&nfs_super.load_lock);
+    nfs_icache_remove(inode);
+    pthread_mutex_unlock(&nfs_super.load_lock);
+    nfs_lru_del(inode);
+    nfs_journal_forget(inode);
+    pthread_mutex_lock(&nfs_super.groups[NFS_INO_GROUP(ino)].ino_lock);
+    nfs_bitmap_free(&nfs_super.groups[NFS_INO_GROUP(ino)].ino_bmap, NFS_INO_IDX(ino));
+    pthread_mutex_unlock(&nfs_super.groups[NFS_INO_GROUP(ino)].ino_lock);
+
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        nfs_put_data_buf(inode, i);
+    }
+    nfs_dindex_free(inode);
+
+    // 无锁查找可能刚拿到这个dentry，dentry->inode保持不变，inode等宽限期过后再释放
+    inode->dentry->ino = -1;
+    NFS_MEM_CHARGE(-(long)sizeof(struct nfs_inode));
+    nfs_epoch_retire(&inode->rcu, nfs_inode_reclaim);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把干净、只被自己的dentry引用的inode换出内存，之后需要时再从磁盘装载。
+ * 目录连同它的子dentry一起换出，要求子dentry都已没有装载的inode。调用者持有ns_lock写锁
+ * 
+ * @param inode 
+ * @return int 不满足换出条件时返回-NFS_ERROR_BUSY
+ */
+int nfs_evict_inode(struct nfs_inode* inode) {
+    struct nfs_dentry* dentry = inode->dentry;
+    struct nfs_dentry* child;
+    struct nfs_dentry* next;
+    boolean            is_dir = NFS_IS_DIR(inode);
+    int                ret    = NFS_ERROR_NONE;
+
+    pthread_rwlock_wrlock(&inode->lock);
+    if (inode->open_cnt != 0 || (inode->flags & NFS_FLAG_INO_UNLINKED)) {
+        pthread_rwlock_unlock(&inode->lock);
+        return -NFS_ERROR_BUSY;
+    }
+
+    // 装载inode和取得新引用都在load_lock下进行，持有它期间判断的条件不会变
+    pthread_mutex_lock(&nfs_super.load_lock);
+    if (__atomic_load_n(&inode->refcnt, __ATOMIC_ACQUIRE) != 1) {
+        ret = -NFS_ERROR_BUSY;
+    }
+    for (child = is_dir ? inode->dentrys : NULL; child != NULL && ret == NFS_ERROR_NONE; child = child->brother) {
+        if (child->inode != NULL) {
+            ret = -NFS_ERROR_BUSY;
+        }
+    }
+    // 先写回，换出之后从磁盘装载的内容必须与内存中的一致；子inode都不在内存中，不会递归。
+    // 有日志时，上次提交之后没改过的inode已经在日志里，不用再写
+    if (ret == NFS_ERROR_NONE && nfs_journal_forget(inode) && nfs_sync_inode(inode) != NFS_ERROR_NONE) {
+        ret = -NFS_ERROR_IO;
+    }
+    if (ret != NFS_ERROR_NONE) {
+        pthread_mutex_unlock(&nfs_super.load_lock);
+        pthread_rwlock_unlock(&inode->lock);
+        return ret;
+    }
+    if (is_dir) {
+        nfs_seq_write_begin(&nfs_super.rename_seq);
+    }
+    // 无锁查找还可能拿到随目录一起换出的子dentry，标记之后不会再为它们装载inode
+    for (child = is_dir ? inode->dentrys : NULL; child != NULL; child = child->brother) {
+        child->ino = -1;
+    }
+    nfs_icache_remove(inode);
+    __atomic_store_n(&dentry->inode, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&nfs_super.load_lock);
+
+    for (child = is_dir ? inode->dentrys : NULL; child != NULL; child = next) {
+        next = child->brother;
+        nfs_dcache_unhash(child);
+        nfs_free_dentry(child);
+    }
+    if (is_dir) {
+        nfs_seq_write_end(&nfs_super.rename_seq);
+    }
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        nfs_put_data_buf(inode, i);
+    }
+    nfs_dindex_free(inode);
+    pthread_rwlock_unlock(&inode->lock);
+
+    NFS_MEM_CHARGE(-(long)sizeof(struct nfs_inode));
+    nfs_epoch_retire(&inode->rcu, nfs_inode_reclaim);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回inode本身和它的脏数据块，不涉及子目录项。有日志时inode表块和目录块进入当前事务，
+ * 普通文件的数据块总是直接写回
+ * 
+ * @param inode 
+ * @return int 
+ */
+int nfs_write_inode(struct nfs_inode * inode) {
+    struct nfs_inode_d  inode_d;
+    int ino             = inode->ino;
+
+    // 延迟分配的块在这里选定物理位置，之后块号才能写进inode_d
+    if (nfs_delalloc_assign(inode) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] no space\n", __func__);
+        return -NFS_ERROR_NOSPACE;
+    }
+
+    // 把inode的内容拷贝到inode_d中
+    inode_d.ino            = ino;
+    inode_d.size           = inode->size;
+    inode_d.ftype          = inode->dentry->ftype;
+    inode_d.dir_cnt        = inode->dir_cnt;
+    inode_d.block_allocted = inode->block_allocted;
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        inode_d.block_pointer[i] = inode->block_pointer[i];
+    }
+    
+    // 将inode_d刷回磁盘，内联数据紧跟在后面一起写
+    if (nfs_itable_write(ino, &inode_d, NFS_IS_INLINE(inode) ? inode->data[0] : NULL) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    inode->flags &= ~NFS_FLAG_INO_LAYOUT;
+    if (NFS_IS_INLINE(inode)) {
+        inode->data_dirty &= ~1u;
+    }
+
+    // 刷回inode的数据块: 目录项记录在增删时已经写进块缓冲，文件内容也一样，只写回脏块
+    if (nfs_flush_data_blks(inode, 0, inode->block_allocted) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        return -NFS_ERROR_IO;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将内存inode及其下方结构全部刷回磁盘
+ * 
+ * @param inode 
+ * @return int 
+ */
+int nfs_sync_inode(struct nfs_inode * inode) {
+    struct nfs_dentry*  dentry_cursor;
+    int ret;
+
+    ret = nfs_write_inode(inode);
+    if (ret != NFS_ERROR_NONE) {
+        return ret;
+    }
+    if (NFS_IS_DIR(inode)) { // 如果当前inode是目录，目录项的inode也要写回
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; dentry_cursor = dentry_cursor->brother) {
+            if (dentry_cursor->inode != NULL) {
+                nfs_sync_inode(dentry_cursor->inode);
+            }
+        }
+    }
+    else if (NFS_IS_REG(inode)) { 
+        // 预留窗口只存在于内存中，位图写回之前归还
+        nfs_rsv_release(inode);
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief fsync的前半部分: 写回文件的全部脏数据块，调用者持有inode写锁
+ * 
+ * @param inode 
+ * @param datasync 只要求数据能读回: 文件大小和块映射都没变时不必写元数据
+ * @return int 大于0表示inode等元数据还要落盘，小于0为错误号
+ */
+int nfs_fsync_data(struct nfs_inode* inode, boolean datasync) {
+    // 已经不在目录树中的文件崩溃后也找不回来
+    if (inode->flags & NFS_FLAG_INO_UNLINKED) {
+        return 0;
+    }
+    if (nfs_flush_data_blks(inode, 0, inode->block_allocted) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_IO;
+    }
+    // 目录的内容就是元数据；内联数据和inode在同一个槽位，只能随inode写
+    if (datasync && NFS_IS_REG(inode) && !NFS_IS_INLINE(inode) && !(inode->flags & NFS_FLAG_INO_LAYOUT)) {
+        return 0;
+    }
+    return nfs_journal_pending(inode) ? 1 : 0;
+}
+
+/**
+ * @brief 
+ * 
+ * @param dentry dentry指向ino，读取该inode
+ * @param ino inode唯一编号
+ * @return struct nfs_inode* 
+ */
+struct nfs_inode* nfs_read_inode(struct nfs_dentry * dentry, int ino) {
+    struct nfs_inode* inode = (struct nfs_inode*)nfs_slab_alloc(NFS_SLAB_INODE);
+    struct nfs_inode_d inode_d;
+    struct nfs_dentry* sub_dentry;
+    struct nfs_dentry* next;
+    struct nfs_dirent_d* rec;
+    uint8_t* slot = (uint8_t *)nfs_slab_alloc(NFS_SLAB_BLK);
+    char   fname[NFS_MAX_FILE_NAME];
+    int    offset;
+
+    if (inode == NULL || slot == NULL) {
+        nfs_slab_free(NFS_SLAB_INODE, inode);
+        nfs_slab_free(NFS_SLAB_BLK, slot);
+        return NULL;
+    }
+#ifndef NDEBUG
+    nfs_load_cnt++;
+#endif
+    // 从磁盘读索引结点，连同可能存在的内联数据一次读出，同一inode表块中的其他inode留在缓存里 
+    if (nfs_itable_read(ino, slot) != NFS_ERROR_NONE) {
+        NFS_DBG("[%s] io error\n", __func__);
+        nfs_slab_free(NFS_SLAB_INODE, inode);
+        nfs_slab_free(NFS_SLAB_BLK, slot);
+        return NULL;                    
+    }
+    memcpy(&inode_d, slot, sizeof(struct nfs_inode_d));
+    // 根据inode_d的内容初始化inode
+    inode->dir_cnt = 0;
+    inode->ino = inode_d.ino;
+    inode->size = inode_d.size;
+    inode->dentry = dentry;
+    inode->dentrys = NULL;
+    inode->dir_index = NULL;
+    inode->dir_index_used = 0;
+    inode->dir_off_next = 0;
+    inode->open_cnt = 0;
+    inode->refcnt = 1;
+    inode->hnext = NULL;
+    inode->lru.prev = NULL;
+    inode->lru.next = NULL;
+    inode->lru_ref = 0;
+    inode->jnl_dirty.prev = NULL;
+    inode->jnl_dirty.next = NULL;
+    pthread_rwlock_init(&inode->lock, NULL);
+    pthread_mutex_init(&inode->load_lock, NULL);
+    NFS_MEM_CHARGE(sizeof(struct nfs_inode));
+    inode->block_allocted = inode_d.block_allocted;
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        inode->block_pointer[i] = inode_d.block_pointer[i];
+    }
+
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        inode->data[i] = NULL;
+    }
+    inode->data_dirty = 0;
+    inode->flags = 0;
+    inode->rsv_start = 0;
+    inode->rsv_len = 0;
+    inode->rsv_win = 0;
+    inode->rsv_node.prev = NULL;
+    inode->rsv_node.next = NULL;
+    inode->delay_cnt = 0;
+
+    // 内联数据挪到缓冲开头直接作为第0块，否则缓冲用完即还
+    if (NFS_IS_INLINE(inode)) {
+        memmove(slot, slot + sizeof(struct nfs_inode_d), NFS_INLINE_SZ());
+        memset(slot + NFS_INLINE_SZ(), 0, NFS_BLK_SZ() - NFS_INLINE_SZ());
+        inode->data[0] = slot;
+        NFS_MEM_CHARGE(NFS_BLK_SZ());
+    }
+    else {
+        nfs_slab_free(NFS_SLAB_BLK, slot);
+    }
+
+    // 普通文件的数据块在读写时才按需装载；目录的数据块整体装入并常驻，增删目录项直接修改块缓冲
+    if (NFS_IS_DIR(inode)) {
+        // 按目录项数量一次性建好哈希索引
+        nfs_dindex_reserve(inode, inode_d.dir_cnt);
+
+        if (nfs_load_data_blks(inode, 0, inode->block_allocted) != NFS_ERROR_NONE) {
+            NFS_DBG("[%s] io error\n", __func__);
+            goto err;
+        }
+        for (int blk_no = 0; blk_no < inode->block_allocted; blk_no++) {
+            for (offset = 0; offset < NFS_BLK_CAP(inode, blk_no); offset += rec->rec_len) {
+                rec = (struct nfs_dirent_d *)(inode->data[blk_no] + offset);
+                // 磁盘内容不可信: 名字要放得进fname，记录要放得下名字，且不越出本块
+                if (rec->rec_len < NFS_DIRENT_LEN(rec->ino == 0 ? 0 : rec->name_len)
+                    || (rec->ino != 0 && rec->name_len >= NFS_MAX_FILE_NAME)
+                    || offset + rec->rec_len > NFS_BLK_CAP(inode, blk_no)) {
+                    NFS_DBG("[%s] bad dirent\n", __func__);
+                    goto err;
+                }
+                if (rec->ino == 0) {
+                    continue;
+                }
+                // 用目录项记录生成内存中的sub_dentry
+                memcpy(fname, rec->name, rec->name_len);
+                fname[rec->name_len] = '\0';
+                sub_dentry = new_dentry(fname, rec->ftype);
+                if (sub_dentry == NULL) {
+                    NFS_DBG("[%s] no memory\n", __func__);
+                    goto err;
+                }
+                sub_dentry->parent = inode->dentry;
+                sub_dentry->ino    = rec->ino; 
+                // 记录已经在块中，只需挂链表和索引
+                if (nfs_link_dentry(inode, sub_dentry) < 0) {
+                    NFS_DBG("[%s] no memory\n", __func__);
+                    nfs_discard_dentry(sub_dentry);
+                    goto err;
+                }
+                NFS_MEM_CHARGE(sizeof(struct nfs_dentry));
+            }
+        }
+    }
+
+    return inode;
+
+err:
+    // inode还没有交给调用者，子dentry和索引都不可能被别人看到，直接释放
+    for (sub_dentry = inode->dentrys; sub_dentry != NULL; sub_dentry = next) {
+        next = sub_dentry->brother;
+        nfs_discard_dentry(sub_dentry);
+        NFS_MEM_CHARGE(-(long)sizeof(struct nfs_dentry));
+    }
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
+        nfs_put_data_buf(inode, i);
+    }
+    nfs_dindex_free(inode);
+    pthread_rwlock_destroy(&inode->lock);
+    pthread_mutex_destroy(&inode->load_lock);
+    NFS_MEM_CHARGE(-(long)sizeof(struct nfs_inode));
+    nfs_slab_free(NFS_SLAB_INODE, inode);
+    return NULL;
+}
+
+/**
+ * @brief 将文件[start, start + cnt)范围内已分配但还未装载的数据块读入内存，
+ * 物理上连续的块合并成一次驱动读
+ * 
+ * @param inode 
+ * @param start 起始块序号
+ * @param cnt 块数
+ * @return int 
+ */
+int nfs_load_data_blks(struct nfs_inode* inode, int start, int cnt) {
+    int      end = start + cnt;
+    int      run;
+    uint8_t* temp_content;
+
+    if (end > inode->block_allocted) {
+        end = inode->block_allocted;
+    }
+    while (start < end) {
+        if (inode->data[start] != NULL) {
+            start++;
+            continue;
+        }
+        // 找出一段物理连续且都未装载的块
+        run = 1;
+        while (start + run < end && inode->data[start + run] == NULL
+               && inode->block_pointer[start + run] == inode->block_pointer[start] + run) {
+            run++;
+        }
+        temp_content = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(run));
+        if (temp_content == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        // 目录块的新内容可能还只在日志里
+        if ((NFS_IS_DIR(inode) ? nfs_journal_read : nfs_driver_read)(NFS_DATA_OFS(inode->block_pointer[start]),
+                            temp_content, NFS_BLKS_SZ(run)) != NFS_ERROR_NONE) {
+            free(temp_content);
+            return -NFS_ERROR_IO;
+        }
+        for (int i = 0; i < run; i++) {
+            inode->data[start + i] = (uint8_t *)nfs_slab_alloc(NFS_SLAB_BLK);
+            if (inode->data[start + i] == NULL) {
+                free(temp_content);
+                return -NFS_ERROR_NOSPACE;
+            }
+            NFS_MEM_CHARGE(NFS_BLK_SZ());
+            memcpy(inode->data[start + i], temp_content + NFS_BLKS_SZ(i), NFS_BLK_SZ());
+        }
+        free(temp_content);
+        start += run;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将文件[start, start + cnt)范围内的脏数据块写回磁盘，物理上连续的块合并成一次驱动写；
+ * 范围内有延迟分配的块时，先为整个文件尾部选定物理块
+ * 
+ * @param inode 
+ * @param start 起始块序号
+ * @param cnt 块数
+ * @return int 
+ */
+int nfs_flush_data_blks(struct nfs_inode* inode, int start, int cnt) {
+    int      end = start + cnt;
+    int      run;
+    uint8_t* temp_content;
+
+    if (end > inode->block_allocted) {
+        end = inode->block_allocted;
+    }
+    if (end > NFS_MAPPED_BLKS(inode) && nfs_delalloc_assign(inode) != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
+    while (start < end) {
+        // 内联块随inode一起写回
+        if (!(inode->data_dirty & (1u << start)) || inode->block_pointer[start] == NFS_DNO_INLINE) {
+            start++;
+            continue;
+        }
+        // 目录块是元数据，逐块进入日志
+        if (NFS_IS_DIR(inode) && nfs_super.jnl_on) {
+            if (nfs_journal_write(NFS_DATA_OFS(inode->block_pointer[start]) / NFS_BLK_SZ(),
+                                  inode->data[start]) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+            inode->data_dirty &= ~(1u << start);
+            start++;
+            continue;
+        }
+        run = 1;
+        while (start + run < end && (inode->data_dirty & (1u << (start + run)))
+               && inode->block_pointer[start + run] == inode->block_pointer[start] + run) {
+            run++;
+        }
+        temp_content = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(run));
+        if (temp_content == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+        for (int i = 0; i < run; i++) {
+            memcpy(temp_content + NFS_BLKS_SZ(i), inode->data[start + i], NFS_BLK_SZ());
+        }
+        if (nfs_driver_write(NFS_DATA_OFS(inode->block_pointer[start]), temp_content, 
+                             NFS_BLKS_SZ(run)) != NFS_ERROR_NONE) {
+            free(temp_content);
+            return -NFS_ERROR_IO;
+        }
+        free(temp_content);
+        for (int i = 0; i < run; i++) {
+            inode->data_dirty &= ~(1u << (start + i));
+        }
+        start += run;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 归还预留窗口中还未使用的块，调用者持有alloc_lock
+ * 
+ * @param inode 
+ */
+static void nfs_rsv_drop(struct nfs_inode* inode) {
+    while (inode->rsv_len > 0) {
+        inode->rsv_len--;
+        nfs_free_data(inode->rsv_start + inode->rsv_len);
+    }
+    if (inode->rsv_node.next != NULL) {
+        inode->rsv_node.prev->next = inode->rsv_node.next;
+        inode->rsv_node.next->prev = inode->rsv_node.prev;
+        inode->rsv_node.prev       = NULL;
+        inode->rsv_node.next       = NULL;
+    }
+}
+
+/**
+ * @brief 归还普通文件预留窗口中还未使用的块
+ * 
+ * @param inode 
+ */
+void nfs_rsv_release(struct nfs_inode* inode) {
+    pthread_mutex_lock(&nfs_super.alloc_lock);
+    nfs_rsv_drop(inode);
+    pthread_mutex_unlock(&nfs_super.alloc_lock);
+}
+
+/**
+ * @brief 归还所有文件预留窗口中还未使用的块。窗口里的块在位图上已占用却不属于任何inode，
+ * 位图提交进日志前先归还，否则崩溃后这些块再也回收不了
+ * 
+ */
+void nfs_rsv_release_all(void) {
+    pthread_mutex_lock(&nfs_super.alloc_lock);
+    while (nfs_super.rsv_list.next != &nfs_super.rsv_list) {
+        nfs_rsv_drop(NFS_CONTAINER_OF(nfs_super.rsv_list.next, struct nfs_inode, rsv_node));
+    }
+    pthread_mutex_unlock(&nfs_super.alloc_lock);
+}
+
+/**
+ * @brief 还能预扣的数据块数: 位图上的空闲块减去已经预扣的块，调用者持有alloc_lock
+ * 
+ * @return int 
+ */
+static int nfs_delalloc_avail() {
+    int free_cnt = 0;
+
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        free_cnt += nfs_super.groups[g].data_bmap.free_cnt;
+    }
+    return free_cnt - nfs_super.delay_blks;
+}
+
+/**
+ * @brief 为普通文件尾部连续的cnt个块取得数据块号，优先从预留窗口中取；
+ * 窗口不够时按rsv_win一次多拿一段，多出的部分留作下次追加。调用者持有alloc_lock
+ * 
+ * @param inode 
+ * @param cnt 块数
+ * @return int 连续区间的起始块号，没有足够的连续空间时返回-NFS_ERROR_NOSPACE
+ */
+static int nfs_rsv_take(struct nfs_inode* inode, int cnt) {
+    int want, first;
+
+    if (inode->rsv_len < cnt) {
+        // 窗口紧接在文件最后一个块之后，剩余部分不够时整体归还，重新拿一段更长的
+        nfs_rsv_drop(inode);
+        want = inode->rsv_win > cnt ? inode->rsv_win : cnt;
+        if (want > NFS_DATA_PER_FILE - NFS_MAPPED_BLKS(inode)) {
+            want = NFS_DATA_PER_FILE - NFS_MAPPED_BLKS(inode);
+        }
+        // 多拿的部分不能占用别的文件已经预扣的空间
+        if (want > cnt + nfs_delalloc_avail()) {
+            want = cnt + nfs_delalloc_avail();
+        }
+        first = nfs_alloc_data_range(nfs_data_goal(inode), want);
+        if (first < 0 && want > cnt) {
+            want  = cnt;
+            first = nfs_alloc_data_range(nfs_data_goal(inode), want);
+        }
+        if (first < 0) {
+            return first;
+        }
+        inode->rsv_start = first;
+        inode->rsv_len   = want;
+    }
+    first             = inode->rsv_start;
+    inode->rsv_start += cnt;
+    inode->rsv_len   -= cnt;
+    // 只有窗口非空的文件挂在rsv_list上: 窗口用完的inode可能不经nfs_rsv_release就被换出释放
+    if (inode->rsv_len == 0) {
+        nfs_rsv_drop(inode);
+    }
+    else if (inode->rsv_node.next == NULL) {
+        inode->rsv_node.prev          = nfs_super.rsv_list.prev;
+        inode->rsv_node.next          = &nfs_super.rsv_list;
+        nfs_super.rsv_list.prev->next = &inode->rsv_node;
+        nfs_super.rsv_list.prev       = &inode->rsv_node;
+    }
+    return first;
 }
 
 /**
- * @brief 将dentry插入到inode中，采用头插法
+ * @brief 在inode尾部追加cnt个延迟分配的块: 只从空闲空间中预扣数量，物理位置等写回时再定
  * 
  * @param inode 
- * @param dentry 
- * @return int 
+ * @param cnt 块数
+ * @return int 空间不足时返回-NFS_ERROR_NOSPACE
  */
-int nfs_alloc_dentry(struct nfs_inode* inode, struct nfs_dentry* dentry) {
-    if (inode->dentrys == NULL) {
-        inode->dentrys = dentry;
-    }
-    else {
-        dentry->brother = inode->dentrys;
-        inode->dentrys = dentry;
+int nfs_delalloc_reserve(struct nfs_inode* inode, int cnt) {
+    pthread_mutex_lock(&nfs_super.alloc_lock);
+    if (inode->block_allocted + cnt > NFS_DATA_PER_FILE || nfs_delalloc_avail() < cnt) {
+        pthread_mutex_unlock(&nfs_super.alloc_lock);
+        return -NFS_ERROR_NOSPACE;
     }
-    inode->dir_cnt++;
-    inode->size += sizeof(struct nfs_dentry);
-
-    // 判断是否需要重新分配一个数据块
-    if (inode->dir_cnt % NFS_DENTRY_PER_BLK() == 1) {
-        inode->block_pointer[inode->block_allocted] = nfs_alloc_data();
+    nfs_super.delay_blks += cnt;
+    for (int i = 0; i < cnt; i++) {
+        inode->block_pointer[inode->block_allocted] = NFS_DNO_DELAYED;
         inode->block_allocted++;
+        inode->delay_cnt++;
     }
-    return inode->dir_cnt;
+    pthread_mutex_unlock(&nfs_super.alloc_lock);
+    return NFS_ERROR_NONE;
 }
 
 /**
- * @brief 分配一个inode，占用位图
+ * @brief 为inode尾部所有延迟分配的块选定物理块，此时文件大小已经确定，整段尽量连续
  * 
- * @param dentry 该dentry指向分配的inode
- * @return nfs_inode
+ * @param inode 
+ * @return int 
  */
-struct nfs_inode* nfs_alloc_inode(struct nfs_dentry * dentry) {
-    struct nfs_inode* inode;
-    int byte_cursor   = 0; 
-    int bit_cursor    = 0; 
-    int ino_cursor    = 0;  
-    boolean is_find_free_entry   = FALSE;
-
-    inode = (struct nfs_inode*)malloc(sizeof(struct nfs_inode));
+int nfs_delalloc_assign(struct nfs_inode* inode) {
+    int base = NFS_MAPPED_BLKS(inode);
+    int cnt  = inode->delay_cnt;
+    int first, dno;
 
-    // 先按字节寻找空闲的inode位图
-    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_inode_blks); byte_cursor++)
-    {
-        // 再在该字节中遍历8个bit寻找空闲的inode位图
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((nfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                // 当前ino_cursor位置空闲 
-                nfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;           
-                break;
-            }
-            ino_cursor++;
-        }
-        if (is_find_free_entry) {
-            break;
-        }
+    if (cnt == 0) {
+        return NFS_ERROR_NONE;
     }
-
-    /*// 先按字节寻找空闲的inode位图
-    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_inode_blks); byte_cursor++)
-    {
-        // 再在该字节中遍历8个bit寻找空闲的inode位图
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((nfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                // 当前dno_cursor位置空闲 
-                nfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                inode->block_pointer[data_blks_num++] = dno_cursor;
-                // 分配完足够数量的位图再退出
-                if (data_blks_num == NFS_DATA_PER_FILE) {
-                    is_find_enough_entry = TRUE;          
-                    break;
-                }
+    // 预扣的数量转为真正的分配，找不到连续空间再逐块分配
+    pthread_mutex_lock(&nfs_super.alloc_lock);
+    nfs_super.delay_blks -= cnt;
+    first = nfs_rsv_take(inode, cnt);
+    for (int i = 0; i < cnt; i++) {
+        dno = first >= 0 ? first + i : nfs_alloc_data();
+        if (dno < 0) {
+            for (int j = 0; j < i; j++) {
+                nfs_free_data(inode->block_pointer[base + j]);
+                inode->block_pointer[base + j] = NFS_DNO_DELAYED;
             }
-            dno_cursor++;
-        }
-        if (is_find_enough_entry) {
-            break;
-        }
-    }*/
-
-    // 上面的实现有问题,应该是预先分配一个数据块,等到这个数据块不够用的时候再分配新的数据块
-    // 具体实现应该放在alloc_dentry中，新建一个alloc_data函数辅助实现
-
-    // 未找到空闲结点
-    if (!is_find_free_entry || ino_cursor >= nfs_super.max_ino)
-        return -NFS_ERROR_NOSPACE;
-
-    // 为目录项分配inode节点并初始化相关属性
-    inode->ino  = ino_cursor; 
-    inode->size = 0;
-    inode->dir_cnt = 0;
-    inode->block_allocted = 0;
-    inode->dentrys = NULL;
-
-    // dentry指向分配的inode 
-    dentry->inode = inode;
-    dentry->ino   = inode->ino;
-    // inode指回dentry 
-    inode->dentry = dentry;
-    
-    // 文件类型需要分配空间,目录项已经在dentrys里,普通文件不要求额外分配数据块的操作,一次性分配完就好了
-    if (NFS_IS_REG(inode)) {
-        for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
-            inode->data[i] = (uint8_t *)malloc(NFS_BLK_SZ());
+            nfs_super.delay_blks += cnt;
+            pthread_mutex_unlock(&nfs_super.alloc_lock);
+            return -NFS_ERROR_NOSPACE;
         }
+        inode->block_pointer[base + i] = dno;
     }
+    inode->delay_cnt = 0;
+    inode->flags    |= NFS_FLAG_INO_LAYOUT;
+    pthread_mutex_unlock(&nfs_super.alloc_lock);
+    return NFS_ERROR_NONE;
+}
 
-    return inode;
+/**
+ * @brief 去掉inode的最后一个块: 延迟分配的块退回预扣的数量，已有物理块的块归还分配器，内联块不占分配器的空间。
+ * 块的内存缓冲由调用者处理
+ * 
+ * @param inode 
+ * @return int 物理块没能归还时返回nfs_free_data的错误，块仍从inode中去掉
+ */
+int nfs_put_tail_blk(struct nfs_inode* inode) {
+    int ret = NFS_ERROR_NONE;
+
+    pthread_mutex_lock(&nfs_super.alloc_lock);
+    inode->block_allocted--;
+    if (inode->block_pointer[inode->block_allocted] == NFS_DNO_DELAYED) {
+        inode->delay_cnt--;
+        nfs_super.delay_blks--;
+    }
+    else if (inode->block_pointer[inode->block_allocted] != NFS_DNO_INLINE) {
+        ret = nfs_free_data(inode->block_pointer[inode->block_allocted]);
+    }
+    pthread_mutex_unlock(&nfs_super.alloc_lock);
+    inode->data_dirty &= ~(1u << inode->block_allocted);
+    return ret;
 }
 
 /**
- * @brief 额外分配一个数据块
- * @return 分配的数据块号
+ * @brief 取得文件第blk个数据块的内存缓冲，需要时从磁盘装载
+ * 
+ * @param inode 
+ * @param blk 块序号
+ * @param alloc 为TRUE时，块还未分配则连同前面的空洞一起延迟分配
+ * @return uint8_t* 块未分配且alloc为FALSE，或空间不足时返回NULL
  */
- int nfs_alloc_data() {
-    int byte_cursor       = 0; 
-    int bit_cursor        = 0;   
-    int dno_cursor        = 0; 
-    int is_find_free_data = 0;
-
-    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_data_blks); byte_cursor++) {
-        // 再在该字节中遍历8个bit寻找空闲的inode位图
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((nfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {
-                // 当前dno_cursor位置空闲
-                nfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_data = 1;
-                break;
-            }
-            dno_cursor++;
+uint8_t* nfs_get_data_blk(struct nfs_inode* inode, int blk, boolean alloc) {
+    int first = inode->block_allocted;
+
+    if (blk >= NFS_DATA_PER_FILE) {
+        return NULL;
+    }
+    if (blk >= inode->block_allocted) {
+        if (!alloc) {
+            return NULL;
         }
-        if (is_find_free_data) {
-            break;
+        // 空洞连同目标块一起只预扣空间，写回时整个文件尾部一次选定连续的物理块
+        if (nfs_delalloc_reserve(inode, blk - inode->block_allocted + 1) != NFS_ERROR_NONE) {
+            return NULL;
+        }
+        for (int i = first; i <= blk; i++) {
+            inode->data[i] = (uint8_t *)nfs_slab_alloc(NFS_SLAB_BLK);
+            if (inode->data[i] == NULL) {
+                while (inode->block_allocted > first) {
+                    nfs_put_tail_blk(inode);
+                    nfs_put_data_buf(inode, inode->block_allocted);
+                }
+                return NULL;
+            }
+            memset(inode->data[i], 0, NFS_BLK_SZ());
+            NFS_MEM_CHARGE(NFS_BLK_SZ());
+            inode->data_dirty |= 1u << i;
         }
     }
-
-    if (!is_find_free_data || dno_cursor >= nfs_super.max_dno) {
-        return -NFS_ERROR_NOSPACE;
+    if (inode->data[blk] == NULL && nfs_load_data_blks(inode, blk, 1) != NFS_ERROR_NONE) {
+        return NULL;
     }
-
-    return dno_cursor;
- }
+    return inode->data[blk];
+}
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 修改普通文件大小，缩小时释放多余的数据块并清零尾块剩余部分，扩大时不分配数据块
  * 
  * @param inode 
+ * @param size 新的文件大小
  * @return int 
  */
-int nfs_sync_inode(struct nfs_inode * inode) {
-    struct nfs_inode_d  inode_d;
-    struct nfs_dentry*  dentry_cursor;
-    struct nfs_dentry_d dentry_d;
-    int offset;
-    int ino             = inode->ino;
+int nfs_truncate_data(struct nfs_inode* inode, off_t size) {
+    int      blks = NFS_ROUND_UP(size, NFS_BLK_SZ()) / NFS_BLK_SZ();
+    uint8_t* data;
 
-    // 把inode的内容拷贝到inode_d中
-    inode_d.ino            = ino;
-    inode_d.size           = inode->size;
-    inode_d.ftype          = inode->dentry->ftype;
-    inode_d.dir_cnt        = inode->dir_cnt;
-    inode_d.block_allocted = inode->block_allocted;
-    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
-        inode_d.block_pointer[i] = inode->block_pointer[i];
+    if (size < 0) {
+        return -NFS_ERROR_INVAL;
     }
-    
-    // 将inode_d刷回磁盘
-    if (nfs_driver_write(NFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                     sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE) {
-        NFS_DBG("[%s] io error\n", __func__);
-        return -NFS_ERROR_IO;
+    if (size > NFS_BLKS_SZ(NFS_DATA_PER_FILE)) {
+        return -NFS_ERROR_FBIG;
     }
-
-    // 刷回inode的数据块
-    if (NFS_IS_DIR(inode)) { // 如果当前inode是目录，那么数据是目录项，且目录项的inode也要写回                         
-        dentry_cursor     = inode->dentrys;
-        int data_blks_num = 0;
-        // 要将dentry的内容刷回磁盘，目录有block_allocted个数据块
-        while ((dentry_cursor != NULL) && (data_blks_num < inode->block_allocted)) {
-            offset = NFS_DATA_OFS(inode->block_pointer[data_blks_num]);
-            while ((dentry_cursor != NULL) && (offset + sizeof(struct nfs_dentry_d) < NFS_DATA_OFS(inode->block_pointer[data_blks_num] + 1))) {
-                // dentry的内容复制到dentry_d中
-                memcpy(dentry_d.fname, dentry_cursor->fname, NFS_MAX_FILE_NAME);
-                dentry_d.ftype = dentry_cursor->ftype;
-                dentry_d.ino = dentry_cursor->ino;
-                // dentry_d的内容刷回磁盘
-                if (nfs_driver_write(offset, (uint8_t *)&dentry_d, sizeof(struct nfs_dentry_d))!= NFS_ERROR_NONE) {
-                    NFS_DBG("[%s] io error\n", __func__);
-                    return -NFS_ERROR_IO;
-                }
-
-                // 递归处理目录项的内容
-                if (dentry_cursor->inode != NULL) {
-                    nfs_sync_inode(dentry_cursor->inode);
-                }
-
-                dentry_cursor  = dentry_cursor->brother;
-                offset += sizeof(struct nfs_dentry_d);
-            }
-            data_blks_num++;
-        }
+    // 缩小后窗口不再紧接文件尾部
+    if (inode->block_allocted > blks) {
+        nfs_rsv_release(inode);
     }
-    // 如果当前inode是文件，那么数据是文件内容，直接写即可 
-    else if (NFS_IS_REG(inode)) { 
-        // 这里也要保证i < inode->block_allocted
-        // 必做并不需要实现普通文件的write操作，虽然我们前面在alloc_node中为普通文件申请了数据块内存
-        // 但我们并没有为其申请对应的数据位图，所以这里不需要写回去
-        for (int i = 0; i < inode->block_allocted; i++) {
-            if (nfs_driver_write(NFS_DATA_OFS(inode->block_pointer[i]), inode->data[i], NFS_BLKS_SZ(NFS_DATA_PER_FILE)) != NFS_ERROR_NONE) {
-                NFS_DBG("[%s] io error\n", __func__);
-                return -NFS_ERROR_IO;
-            }
+    while (inode->block_allocted > blks) {
+        nfs_put_tail_blk(inode);
+        nfs_put_data_buf(inode, inode->block_allocted);
+    }
+    // 尾块中超出新大小的部分清零，之后再扩大文件时读到的是0
+    if (size % NFS_BLK_SZ() != 0 && size / NFS_BLK_SZ() < inode->block_allocted) {
+        data = nfs_get_data_blk(inode, size / NFS_BLK_SZ(), FALSE);
+        if (data == NULL) {
+            return -NFS_ERROR_IO;
         }
+        memset(data + size % NFS_BLK_SZ(), 0, NFS_BLK_SZ() - size % NFS_BLK_SZ());
+        inode->data_dirty |= 1u << (size / NFS_BLK_SZ());
     }
-
+    inode->size   = size;
+    inode->flags |= NFS_FLAG_INO_LAYOUT;
+    nfs_journal_dirty(inode);
     return NFS_ERROR_NONE;
 }
 
 /**
- * @brief 
+ * @brief 为普通文件的[offset, offset + len)预先分配数据块，块内容为0；
+ * 不带NFS_FALLOC_KEEP_SIZE时文件大小随之扩大
  * 
- * @param dentry dentry指向ino，读取该inode
- * @param ino inode唯一编号
- * @return struct nfs_inode* 
+ * @param inode 
+ * @param mode 0或NFS_FALLOC_KEEP_SIZE
+ * @param offset 
+ * @param len 
+ * @return int 
  */
-struct nfs_inode* nfs_read_inode(struct nfs_dentry * dentry, int ino) {
-    struct nfs_inode* inode = (struct nfs_inode*)malloc(sizeof(struct nfs_inode));
-    struct nfs_inode_d inode_d;
-    struct nfs_dentry* sub_dentry;
-    struct nfs_dentry_d dentry_d;
-    int    dir_cnt = 0;
+int nfs_fallocate_data(struct nfs_inode* inode, int mode, off_t offset, off_t len) {
+    off_t end = offset + len;
 
-    // 从磁盘读索引结点 
-    if (nfs_driver_read(NFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                        sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE) {
-        NFS_DBG("[%s] io error\n", __func__);
-        return NULL;                    
+    if (mode & ~NFS_FALLOC_KEEP_SIZE) {
+        return -NFS_ERROR_NOTSUPP;
     }
-    // 根据inode_d的内容初始化inode
-    inode->dir_cnt = 0;
-    inode->ino = inode_d.ino;
-    inode->size = inode_d.size;
-    inode->dentry = dentry;
-    inode->dentrys = NULL;
-    inode->block_allocted = inode_d.block_allocted;
-    for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
-        inode->block_pointer[i] = inode_d.block_pointer[i];
+    if (offset < 0 || len <= 0) {
+        return -NFS_ERROR_INVAL;
     }
-
-    // 内存中的inode的数据或子目录项部分也需要读出 
-    if (NFS_IS_DIR(inode)) {
-        dir_cnt           = inode_d.dir_cnt;
-        int data_blks_num = 0;
-        int offset;
-
-        // 对所有的目录项都进行处理(先分数据块处理)
-        while((dir_cnt > 0) && (data_blks_num < NFS_DATA_PER_FILE)){
-            offset = NFS_DATA_OFS(inode->block_pointer[data_blks_num]);
-
-            // 再分单独的目录项进行处理
-            while((dir_cnt > 0) && (offset + sizeof(struct nfs_dentry_d) < NFS_DATA_OFS(inode->block_pointer[data_blks_num] + 1))){
-                if (nfs_driver_read(offset, (uint8_t *)&dentry_d, sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE){
-                    NFS_DBG("[%s] io error\n", __func__);
-                    return NULL;  
-                }
-                
-                // 用从磁盘中读出的dentry_d更新内存中的sub_dentry 
-                sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
-                sub_dentry->parent = inode->dentry;
-                sub_dentry->ino    = dentry_d.ino; 
-                nfs_alloc_dentry(inode, sub_dentry);
-
-                offset += sizeof(struct nfs_dentry_d);
-                dir_cnt--;
-            }
-            data_blks_num++;
-        }
+    if (end > NFS_BLKS_SZ(NFS_DATA_PER_FILE)) {
+        return -NFS_ERROR_FBIG;
     }
-    // inode是普通文件则直接读取数据块
-    else if (NFS_IS_REG(inode)) {
-        for (int i = 0; i < NFS_DATA_PER_FILE; i++) {
-            inode->data[i] = (uint8_t *)malloc(NFS_BLKS_SZ(NFS_DATA_PER_FILE));
-            if (nfs_driver_read(NFS_DATA_OFS(inode->block_pointer[i]), (uint8_t *)inode->data[i], 
-                            NFS_BLKS_SZ(NFS_DATA_PER_FILE)) != NFS_ERROR_NONE) {
-                NFS_DBG("[%s] io error\n", __func__);
-                return NULL;                    
-            }
-        }
+    // 前面的空洞一并分配，整段尽量连续
+    if (nfs_inline_prepare(inode, end) != NFS_ERROR_NONE
+        || nfs_get_data_blk(inode, (end - 1) / NFS_BLK_SZ(), TRUE) == NULL) {
+        return -NFS_ERROR_NOSPACE;
     }
-
-    return inode;
+    if (!(mode & NFS_FALLOC_KEEP_SIZE) && end > inode->size) {
+        inode->size = end;
+    }
+    inode->flags |= NFS_FLAG_INO_LAYOUT;
+    nfs_journal_dirty(inode);
+    return NFS_ERROR_NONE;
 }
 
 /**
@@ -420,6 +1662,73 @@ struct nfs_dentry* nfs_get_dentry(struct nfs_inode * inode, int dir) {
     return NULL;
 }
 
+/**
+ * @brief 取得dentry对应的inode: 先看dentry上的指针，再按inode号查inode缓存，都没有才从磁盘读出。
+ * 多个线程同时装载同一inode时只有一个真正读盘，dentry持有所得inode的一个引用
+ * 
+ * @param dentry 
+ * @return struct nfs_inode* dentry已随父目录被换出时返回NULL
+ */
+struct nfs_inode* nfs_get_inode(struct nfs_dentry* dentry) {
+    struct nfs_inode* inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+
+    if (inode != NULL) {
+        if (!__atomic_load_n(&inode->lru_ref, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&inode->lru_ref, 1, __ATOMIC_RELAXED);
+        }
+        return inode;
+    }
+    pthread_mutex_lock(&nfs_super.load_lock);
+    inode = dentry->inode;
+    // 随父目录一起换出的dentry(ino为-1)不再装载，返回NULL由调用者重新查找
+    if (inode == NULL && dentry->ino >= 0) {
+        inode = nfs_icache_find(dentry->ino);
+        if (inode != NULL) {
+            // 原来的dentry已不在内存中，inode改由这个dentry指向
+            nfs_inode_get(inode);
+            inode->dentry = dentry;
+        }
+        else {
+            inode = nfs_read_inode(dentry, dentry->ino);
+            if (inode != NULL) {
+                nfs_icache_insert(inode);
+                if (dentry->parent != NULL) {
+                    nfs_lru_add(inode);
+                }
+            }
+        }
+        __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&nfs_super.load_lock);
+    return inode;
+}
+
+/**
+ * @brief 增加inode引用，调用者已经持有一个引用(或持有ns_lock，保证dentry的引用还在)
+ * 
+ * @param inode 
+ */
+void nfs_inode_get(struct nfs_inode* inode) {
+    __atomic_add_fetch(&inode->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 释放inode引用。只有dentry已被摘除的inode引用才会归零，此时释放inode和它的dentry；
+ * 调用者不能持有inode的锁
+ * 
+ * @param inode 
+ */
+void nfs_inode_put(struct nfs_inode* inode) {
+    struct nfs_dentry* dentry;
+
+    if (__atomic_sub_fetch(&inode->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    dentry = inode->dentry;
+    nfs_drop_inode(inode);
+    nfs_free_dentry(dentry);
+}
+
 /**
  * @brief 查找文件或目录
  * path: /qwe/ad  total_lvl = 2,
@@ -442,93 +1751,243 @@ struct nfs_dentry* nfs_get_dentry(struct nfs_inode * inode, int dir) {
  *      3) find a's inode     lvl = 2
  *      4) find b's dentry    如果此时找不到了，is_find=FALSE且返回的是a的inode对应的dentry
  * 
+ * 途中某个inode装载不出来时返回NULL(is_find=FALSE)。目录刚被换出也会如此，但那时rename_seq已经变了，
+ * nfs_lookup会重试；rename_seq没变仍得到NULL，就是读盘或分配失败
+ * 
  * @param path 
+ * @param seq 开始查找时的rename_seq
  * @return struct nfs_dentry* 
  */
-struct nfs_dentry* nfs_lookup(const char * path, boolean* is_find, boolean* is_root) {
+static struct nfs_dentry* nfs_lookup_rcu(const char * path, boolean* is_find, boolean* is_root, uint32_t seq) {
     struct nfs_dentry* dentry_cursor = nfs_super.root_dentry;
     struct nfs_dentry* dentry_ret = NULL;
     struct nfs_inode*  inode; 
-    int   total_lvl = nfs_calc_lvl(path);
-    int   lvl       = 0;
-    boolean is_hit;
-    char* fname     = NULL;
-    char* path_cpy  = (char*)malloc(sizeof(path));
+    const char* cursor = path;
+    const char* fname;
+    int   fname_len;
+    int   path_len  = strlen(path);
+    int   parent_len;
+    uint32_t gen;
+    boolean is_last;
     *is_root        = FALSE;
-    strcpy(path_cpy, path);
+
+    // 去掉结尾多余的'/'，保证缓存键唯一
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        path_len--;
+    }
 
     // 根目录 
-    if (total_lvl == 0) {                           
+    if (nfs_next_fname(&cursor, &fname_len) == NULL) {                           
         *is_find = TRUE;
         *is_root = TRUE;
-        dentry_ret = nfs_super.root_dentry;
+        return nfs_super.root_dentry;
+    }
+
+    // 先查全路径缓存
+    dentry_ret = nfs_pcache_find(path, path_len);
+    if (dentry_ret != NULL) {
+        *is_find = nfs_get_inode(dentry_ret) != NULL;
+        return *is_find ? dentry_ret : NULL;
+    }
+
+    // 负向缓存命中说明路径确定不存在，直接返回父目录
+    dentry_ret = nfs_ncache_find(path, path_len);
+    if (dentry_ret != NULL) {
+        *is_find = FALSE;
+        return nfs_get_inode(dentry_ret) != NULL ? dentry_ret : NULL;
+    }
+
+    // 再查父路径缓存，命中后只需在父目录的索引中查最后一段(创建文件时常见)
+    parent_len = path_len - 1;
+    while (path[parent_len] != '/') {
+        parent_len--;
+    }
+    dentry_cursor = parent_len == 0 ? nfs_super.root_dentry : nfs_pcache_find(path, parent_len);
+    if (dentry_cursor != NULL && dentry_cursor->ftype == NFS_DIR) {
+        inode      = nfs_get_inode(dentry_cursor);
+        if (inode == NULL) {
+            *is_find = FALSE;
+            return NULL;
+        }
+        gen        = __atomic_load_n(&dentry_cursor->dir_gen, __ATOMIC_ACQUIRE);
+        dentry_ret = nfs_dindex_find(inode, path + parent_len + 1, path_len - parent_len - 1);
+        if (dentry_ret != NULL) {
+            *is_find = nfs_get_inode(dentry_ret) != NULL;
+            if (*is_find) {
+                nfs_pcache_insert(path, path_len, dentry_ret, seq);
+            }
+            return *is_find ? dentry_ret : NULL;
+        }
+        *is_find = FALSE;
+        nfs_ncache_insert(path, path_len, dentry_cursor, gen);
+        return dentry_cursor;
     }
+    dentry_cursor = nfs_super.root_dentry;
 
-    // strtok用来分割路径以此获得最外层文件名
-    fname = strtok(path_cpy, "/");       
-    while (fname)
+    // 在原路径上逐段切片，不拷贝路径也不分配内存
+    cursor = path;
+    fname  = nfs_next_fname(&cursor, &fname_len);
+    while (TRUE)
     {   
-        lvl++;
+        // 看一眼后面是否还有分段，判断当前是否为最后一层
+        is_last = (nfs_peek_fname(cursor) == NULL);
+
         // Cache机制,如果当前dentry的inode为空则从磁盘读出来
-        if (dentry_cursor->inode == NULL) {           
-            nfs_read_inode(dentry_cursor, dentry_cursor->ino);
+        inode = nfs_get_inode(dentry_cursor);
+        if (inode == NULL) {
+            *is_find = FALSE;
+            return NULL;
         }
 
-        inode = dentry_cursor->inode;
-
-        // 还没到对应层数就查到普通文件，无法继续往下查询
-        if (NFS_IS_REG(inode) && lvl < total_lvl) {
-            NFS_DBG("[%s] not a dir\n", __func__);
+        // 还没到最后一层就查到普通文件，无法继续往下查询
+        if (NFS_IS_REG(inode)) {
+            *is_find = FALSE;
             dentry_ret = inode->dentry;
             break;
         }
 
-        // 当前inode对应的是一个目录
-        if (NFS_IS_DIR(inode)) {
-            dentry_cursor = inode->dentrys;
-            is_hit        = FALSE;
-
-            // 遍历子目录项找到对应文件名称的dentry
-            while (dentry_cursor)   
-            {
-                if (memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0) {
-                    is_hit = TRUE;
-                    break;
+        // 通过目录哈希索引找到对应文件名称的dentry，不加锁；
+        // 目录版本号要在查找之前读取: 创建者先发布目录项再递增版本号，查找漏掉的创建一定会让负向缓存项失效
+        gen           = __atomic_load_n(&inode->dentry->dir_gen, __ATOMIC_ACQUIRE);
+        dentry_cursor = nfs_dindex_find(inode, fname, fname_len);
+        
+        // 没有找到对应文件夹名称的目录项则返回最后找到的文件夹的dentry
+        if (dentry_cursor == NULL) {
+            *is_find = FALSE;
+            dentry_ret = inode->dentry;
+            // 只缺最后一段时记下父路径和负向结果，随后的创建可以一次命中父目录
+            if (is_last) {
+                if (parent_len > 0) {
+                    nfs_pcache_insert(path, parent_len, dentry_ret, seq);
                 }
-                dentry_cursor = dentry_cursor->brother;
-            }
-            
-            // 没有找到对应文件夹名称的目录项则返回最后找到的文件夹的dentry
-            if (!is_hit) {
-                *is_find = FALSE;
-                NFS_DBG("[%s] not found %s\n", __func__, fname);
-                dentry_ret = inode->dentry;
-                break;
+                nfs_ncache_insert(path, path_len, dentry_ret, gen);
             }
+            break;
+        }
 
-            if (is_hit && lvl == total_lvl) {
-                *is_find = TRUE;
-                dentry_ret = dentry_cursor;
-                break;
-            }
+        if (is_last) {
+            *is_find = TRUE;
+            dentry_ret = dentry_cursor;
+            nfs_pcache_insert(path, path_len, dentry_ret, seq);
+            break;
         }
-        // 继续使用strtok获取下一层文件的名称
-        fname = strtok(NULL, "/"); 
+        fname = nfs_next_fname(&cursor, &fname_len);
     }
 
     // 再出确保dentry_cursor对应的inode不为空
-    if (dentry_ret->inode == NULL) {
-        dentry_ret->inode = nfs_read_inode(dentry_ret, dentry_ret->ino);
+    if (nfs_get_inode(dentry_ret) == NULL) {
+        *is_find = FALSE;
+        return NULL;
     }
-    
     return dentry_ret;
 }
 
+/**
+ * @brief 查找文件或目录，返回值含义见nfs_lookup_rcu
+ * 
+ * 查找本身不加锁，在epoch临界区内进行，中途撞上rename或目录换出则重试。
+ * 返回NULL表示路径上的inode读不出来，调用者应返回-NFS_ERROR_IO，不能当作"不存在"在根目录下创建。
+ * 返回的dentry在离开临界区后仍要使用，调用者须持有ns_lock，或者自己也处在epoch临界区内
+ * 
+ * @param path 
+ * @param is_find 
+ * @param is_root 
+ * @return struct nfs_dentry* 
+ */
+struct nfs_dentry* nfs_lookup(const char * path, boolean* is_find, boolean* is_root) {
+    struct nfs_dentry* dentry;
+    uint32_t           seq;
+
+    nfs_epoch_enter();
+    do {
+        seq    = nfs_seq_read_begin(&nfs_super.rename_seq);
+        dentry = nfs_lookup_rcu(path, is_find, is_root, seq);
+    } while (nfs_seq_read_retry(&nfs_super.rename_seq, seq));
+    nfs_epoch_exit();
+    return dentry;
+}
+
+/**
+ * @brief 按磁盘大小划分块组并计算各组布局，每组开头依次是(仅第0组有效的)超级块、inode位图、数据位图，
+ * 随后是inode区和数据区；尾部剩余的块装不下一个有意义的组时舍弃。
+ * 一块数据位图覆盖NFS_BLK_BITS()块，磁盘大到NFS_MAX_GROUPS组装不下时，每组的数据位图按需加块，
+ * 每组按bytes_per_inode的比例配inode区，inode位图按第0组(最大的一组)的inode数取块数。
+ * 组描述符和日志区的偏移以块为单位记录。
+ * 日志区从最后一组数据区的末尾划出，最后一组太小时不建日志
+ * 
+ * @param nfs_super_d 要填写的磁盘超级块，sz_ino和jnl_blks必须已经确定
+ * @param bytes_per_inode 每多少字节磁盘空间配一个inode，不小于NFS_BLK_SZ()
+ */
+static void nfs_calc_layout(struct nfs_super_d* nfs_super_d, int bytes_per_inode) {
+    int total_blks     = (int)(nfs_super.sz_disk / NFS_BLK_SZ());
+    int map_data_blks  = NFS_ROUND_UP(total_blks, NFS_MAX_GROUPS * NFS_BLK_BITS()) / (NFS_MAX_GROUPS * NFS_BLK_BITS());
+    int inodes_per_blk = NFS_BLK_SZ() / nfs_super_d->sz_ino;
+    int blks_per_group, group_cnt, map_inode_blks, meta_blks;
+    int gstart, gblks, inode_blks, ino_cnt, g;
+
+    if (map_data_blks == 0) {
+        map_data_blks = 1;
+    }
+    blks_per_group = map_data_blks * NFS_BLK_BITS();
+    group_cnt      = NFS_ROUND_UP(total_blks, blks_per_group) / blks_per_group;
+    gblks          = total_blks < blks_per_group ? total_blks : blks_per_group;
+    ino_cnt        = (int)(NFS_BLKS_SZ(gblks) / bytes_per_inode / inodes_per_blk) * inodes_per_blk;
+    map_inode_blks = NFS_ROUND_UP(ino_cnt, NFS_BLK_BITS()) / NFS_BLK_BITS();
+    if (map_inode_blks == 0) {
+        map_inode_blks = 1;
+    }
+    meta_blks      = NFS_SUPER_BLKS + map_inode_blks + map_data_blks;
+
+    for (g = 0; g < group_cnt; g++) {
+        gstart     = g * blks_per_group;
+        gblks      = total_blks - gstart < blks_per_group ? total_blks - gstart : blks_per_group;
+        inode_blks = (int)(NFS_BLKS_SZ(gblks) / bytes_per_inode / inodes_per_blk);
+        if (inode_blks == 0) {
+            inode_blks = 1;
+        }
+        ino_cnt    = inode_blks * inodes_per_blk;
+        if (gblks < NFS_GROUP_MIN_BLKS || gblks <= meta_blks + inode_blks) {
+            break;
+        }
+        nfs_super_d->groups[g].map_inode_offset = gstart + NFS_SUPER_BLKS;
+        nfs_super_d->groups[g].map_data_offset  = nfs_super_d->groups[g].map_inode_offset + map_inode_blks;
+        nfs_super_d->groups[g].inode_offset     = nfs_super_d->groups[g].map_data_offset + map_data_blks;
+        nfs_super_d->groups[g].data_offset      = nfs_super_d->groups[g].inode_offset + inode_blks;
+        nfs_super_d->groups[g].max_ino          = ino_cnt;
+        nfs_super_d->groups[g].max_dno          = gblks - meta_blks - inode_blks;
+        nfs_super_d->groups[g].free_inodes      = nfs_super_d->groups[g].max_ino;
+        nfs_super_d->groups[g].free_blocks      = nfs_super_d->groups[g].max_dno;
+    }
+    nfs_super_d->group_cnt        = g;
+    nfs_super_d->blks_per_group   = blks_per_group;
+    if (g > 0 && nfs_super_d->groups[g - 1].max_dno >= 2 * nfs_super_d->jnl_blks) {
+        nfs_super_d->groups[g - 1].max_dno     -= nfs_super_d->jnl_blks;
+        nfs_super_d->groups[g - 1].free_blocks  = nfs_super_d->groups[g - 1].max_dno;
+        nfs_super_d->jnl_offset = nfs_super_d->groups[g - 1].data_offset + nfs_super_d->groups[g - 1].max_dno;
+    }
+    else {
+        nfs_super_d->jnl_blks   = 0;
+        nfs_super_d->jnl_offset = 0;
+    }
+    nfs_super_d->inodes_per_group = nfs_super_d->groups[0].max_ino;
+    nfs_super_d->data_per_group   = nfs_super_d->groups[0].max_dno;
+
+    // 旧字段仍填第0组的布局(以字节为单位)，只供查看磁盘的工具参考，挂载不再使用
+    nfs_super_d->map_inode_blks   = map_inode_blks;
+    nfs_super_d->map_data_blks    = map_data_blks;
+    nfs_super_d->map_inode_offset = (int)NFS_BLKS_SZ(nfs_super_d->groups[0].map_inode_offset);
+    nfs_super_d->map_data_offset  = (int)NFS_BLKS_SZ(nfs_super_d->groups[0].map_data_offset);
+    nfs_super_d->inode_offset     = (int)NFS_BLKS_SZ(nfs_super_d->groups[0].inode_offset);
+    nfs_super_d->data_offset      = (int)NFS_BLKS_SZ(nfs_super_d->groups[0].data_offset);
+}
+
 /**
  * @brief 挂载sfs, Layout 如下
  * 
  * Layout
- * 每8个Inode占用一个Blk
+ * | Group 0 | Group 1 | ... |，每组 | Super(1) | Inode Map(*) | DATA Map(*) | INODE(*) | DATA(*) |
+ * 每个Inode占用NFS_INO_SZ()字节，一个Blk放NFS_INODE_PER_BLK个；
+ * 最后一组的DATA之后是 | Journal Super(1) | Journal Log(NFS_JNL_BLKS - 1) |
  * @param options 
  * @return int 
  */
@@ -538,16 +1997,16 @@ int nfs_mount(struct custom_options options){
     struct nfs_super_d  nfs_super_d; 
     struct nfs_dentry*  root_dentry;
     struct nfs_inode*   root_inode;
-
-    int                 inode_num;
-    int                 map_inode_blks;
-    int                 data_num;
-    int                 map_data_blks;
-    
-    int                 super_blks;
+    struct nfs_group*   group;
+    int                 bytes_per_inode = options.bytes_per_inode > 0 ? options.bytes_per_inode 
+                                                                      : NFS_DEFAULT_BYTES_PER_INODE;
     boolean             is_init = FALSE;
 
     nfs_super.is_mounted = FALSE;
+#ifndef NDEBUG
+    nfs_head_pos    = 0;
+    nfs_head_travel = 0;
+#endif
     driver_fd = ddriver_open(options.device);
 
     if (driver_fd < 0) {
@@ -556,11 +2015,34 @@ int nfs_mount(struct custom_options options){
 
     // 向超级块中写入相关信息
     nfs_super.fd = driver_fd;
+    // ddriver只填int大小(小端下即低位)，先清零；能报告更大容量的驱动可以填满64位
+    nfs_super.sz_disk = 0;
     ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &nfs_super.sz_disk);
     ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &nfs_super.sz_io);
     nfs_super.sz_blks = 2 * nfs_super.sz_io;  // 两个IO大小
+
+    // 锁必须在第一次IO之前建立，nfs_driver_read要用io_lock
+    pthread_rwlock_init(&nfs_super.ns_lock, NULL);
+    pthread_mutex_init(&nfs_super.alloc_lock, NULL);
+    nfs_super.rsv_list.prev = &nfs_super.rsv_list;
+    nfs_super.rsv_list.next = &nfs_super.rsv_list;
+    pthread_mutex_init(&nfs_super.load_lock, NULL);
+    pthread_mutex_init(&nfs_super.dcache_lock, NULL);
+    pthread_mutex_init(&nfs_super.io_lock, NULL);
+    for (int g = 0; g < NFS_MAX_GROUPS; g++) {
+        pthread_mutex_init(&nfs_super.groups[g].ino_lock, NULL);
+    }
+    nfs_super.rename_seq = 0;
+    nfs_lru_init(options.mem_limit);
+    nfs_slab_init();
+    nfs_name_init();
+    if (nfs_epoch_init() != NFS_ERROR_NONE || nfs_itable_init() != NFS_ERROR_NONE) {
+        return -NFS_ERROR_NOSPACE;
+    }
     // 新建根目录
     root_dentry = new_dentry("/", NFS_DIR);
+    root_dentry->ino = NFS_ROOT_INO;
+    nfs_icache_clear();
 
     // 读取磁盘超级块内容
     if (nfs_driver_read(NFS_SUPER_OFS, (uint8_t *)(&nfs_super_d), sizeof(struct nfs_super_d)) != NFS_ERROR_NONE) {
@@ -569,66 +2051,116 @@ int nfs_mount(struct custom_options options){
     
     // 根据磁盘超级块的幻数判断是否是第一次挂载
     if (nfs_super_d.magic != NFS_MAGIC_NUM) {    
-        // 计算各部分的大小
-        // 宏定义在type.h中
-        super_blks      = NFS_SUPER_BLKS;
-        map_inode_blks  = NFS_INODE_MAP_BLKS;
-        map_data_blks   = NFS_DATA_MAP_BLKS;
-        inode_num       = NFS_INODE_BLKS;
-        data_num        = NFS_DATA_BLKS;
-
-        // 布局layout 
-        nfs_super.max_ino               = inode_num;
-        nfs_super.max_dno               = data_num;
-        nfs_super_d.map_inode_blks      = map_inode_blks; 
-        nfs_super_d.map_data_blks       = map_data_blks; 
-        nfs_super_d.map_inode_offset    = NFS_SUPER_OFS + NFS_BLKS_SZ(super_blks);
-        nfs_super_d.map_data_offset     = nfs_super_d.map_inode_offset + NFS_BLKS_SZ(map_inode_blks);
-        nfs_super_d.inode_offset        = nfs_super_d.map_data_offset + NFS_BLKS_SZ(map_data_blks);
-        nfs_super_d.data_offset         = nfs_super_d.inode_offset + NFS_BLKS_SZ(inode_num);
-
+        // 布局layout，比例小于块大小时inode区会挤掉大部分数据区，不接受
+        if (bytes_per_inode < NFS_BLK_SZ()) {
+            return -NFS_ERROR_INVAL;
+        }
+        nfs_super_d.sz_ino              = NFS_BLK_SZ() / NFS_INODE_PER_BLK;
+        nfs_super_d.jnl_blks            = NFS_JNL_BLKS;
+        nfs_calc_layout(&nfs_super_d, bytes_per_inode);
         nfs_super_d.sz_usage            = 0;
         nfs_super_d.magic               = NFS_MAGIC_NUM;
 
         is_init = TRUE;
     }
+    else if (nfs_super_d.blks_per_group <= 0) {
+        // 块组、紧密排列的inode和变长目录项之前格式化的磁盘，目录块无法按现在的格式解读，
+        // 不自动重新格式化以免毁掉数据，需要清空磁盘后重新挂载
+        NFS_DBG("[%s] disk was formatted by an older newfs, reformat required\n", __func__);
+        return -NFS_ERROR_INVAL;
+    }
+    // 组描述符和日志区的偏移以块为单位，内存中换算成字节
+    if (nfs_super_d.group_cnt <= 0 || nfs_super_d.group_cnt > NFS_MAX_GROUPS
+        || nfs_super_d.map_inode_blks <= 0 || nfs_super_d.map_data_blks <= 0
+        || nfs_super_d.sz_ino < (int)sizeof(struct nfs_inode_d) || NFS_BLK_SZ() % nfs_super_d.sz_ino != 0
+        || nfs_super_d.jnl_blks < 0 
+        || NFS_BLKS_SZ(nfs_super_d.jnl_offset) + NFS_BLKS_SZ(nfs_super_d.jnl_blks) > nfs_super.sz_disk) {
+        return -NFS_ERROR_INVAL;
+    }
+    nfs_super.sz_ino         = nfs_super_d.sz_ino;
+    nfs_super.jnl_offset     = NFS_BLKS_SZ(nfs_super_d.jnl_offset);
+    nfs_super.jnl_blks       = nfs_super_d.jnl_blks;
+    nfs_super.blks_per_group = nfs_super_d.blks_per_group;
 
     // 建立 in-memory 结构 
     // 初始化超级块
-    nfs_super.sz_usage   = nfs_super_d.sz_usage; 
-
-    // 建立索引位图    
-    nfs_super.map_inode         = (uint8_t *)malloc(NFS_BLKS_SZ(nfs_super_d.map_inode_blks));
+    nfs_super.sz_usage          = nfs_super_d.sz_usage; 
     nfs_super.map_inode_blks    = nfs_super_d.map_inode_blks;
-    nfs_super.map_inode_offset  = nfs_super_d.map_inode_offset;
-    nfs_super.inode_offset      = nfs_super_d.inode_offset;
-
-    // 建立数据位图
-    nfs_super.map_data          = (uint8_t *)malloc(NFS_BLKS_SZ(nfs_super_d.map_data_blks));
     nfs_super.map_data_blks     = nfs_super_d.map_data_blks;
-    nfs_super.map_data_offset   = nfs_super_d.map_data_offset;
-    nfs_super.data_offset       = nfs_super_d.data_offset;
-
-    // 从磁盘中读取索引位图
-    if (nfs_driver_read(nfs_super_d.map_inode_offset, (uint8_t *)(nfs_super.map_inode), 
-                        NFS_BLKS_SZ(nfs_super_d.map_inode_blks)) != NFS_ERROR_NONE) {
-        return -NFS_ERROR_IO;
+    nfs_super.group_cnt         = nfs_super_d.group_cnt;
+    nfs_super.inodes_per_group  = nfs_super_d.inodes_per_group;
+    nfs_super.data_per_group    = nfs_super_d.data_per_group;
+    nfs_super.max_ino           = nfs_super.group_cnt * nfs_super.inodes_per_group;
+    nfs_super.max_dno           = nfs_super.group_cnt * nfs_super.data_per_group;
+    nfs_extent_init(&nfs_super.data_extents, nfs_super.data_per_group);
+
+    // 位图和inode都要在重放之后读
+    nfs_super.jnl_interval = options.commit_interval > 0 ? options.commit_interval : 0;
+    ret = nfs_journal_init(is_init);
+    if (ret != NFS_ERROR_NONE) {
+        return ret;
     }
 
-    // 从磁盘中读取数据位图
-    if (nfs_driver_read(nfs_super_d.map_data_offset, (uint8_t *)(nfs_super.map_data), 
-                        NFS_BLKS_SZ(nfs_super_d.map_data_blks)) != NFS_ERROR_NONE) {
-        return -NFS_ERROR_IO;
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        group                   = &nfs_super.groups[g];
+        group->max_ino          = nfs_super_d.groups[g].max_ino;
+        group->max_dno          = nfs_super_d.groups[g].max_dno;
+        group->map_inode_offset = NFS_BLKS_SZ(nfs_super_d.groups[g].map_inode_offset);
+        group->map_data_offset  = NFS_BLKS_SZ(nfs_super_d.groups[g].map_data_offset);
+        group->inode_offset     = NFS_BLKS_SZ(nfs_super_d.groups[g].inode_offset);
+        group->data_offset      = NFS_BLKS_SZ(nfs_super_d.groups[g].data_offset);
+
+        // 建立索引位图和数据位图
+        group->map_inode = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(nfs_super.map_inode_blks));
+        group->map_data  = (uint8_t *)NFS_MALLOC(NFS_BLKS_SZ(nfs_super.map_data_blks));
+        if (group->map_inode == NULL || group->map_data == NULL) {
+            return -NFS_ERROR_NOSPACE;
+        }
+
+        // 从磁盘中读取索引位图和数据位图。新格式化的组清零后直接写回，
+        // 大磁盘的位图有上千块，不经过日志，以免撑爆第一个事务
+        if (is_init) {
+            memset(group->map_inode, 0, NFS_BLKS_SZ(nfs_super.map_inode_blks));
+            memset(group->map_data, 0, NFS_BLKS_SZ(nfs_super.map_data_blks));
+            if (nfs_driver_write(group->map_inode_offset, group->map_inode, 
+                                 NFS_BLKS_SZ(nfs_super.map_inode_blks)) != NFS_ERROR_NONE
+                || nfs_driver_write(group->map_data_offset, group->map_data, 
+                                    NFS_BLKS_SZ(nfs_super.map_data_blks)) != NFS_ERROR_NONE) {
+                return -NFS_ERROR_IO;
+            }
+        }
+        else if (nfs_journal_read(group->map_inode_offset, group->map_inode, 
+                                  NFS_BLKS_SZ(nfs_super.map_inode_blks)) != NFS_ERROR_NONE
+                 || nfs_journal_read(group->map_data_offset, group->map_data, 
+                                     NFS_BLKS_SZ(nfs_super.map_data_blks)) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
+
+        // 在位图上建立分配器摘要，并把本组的空闲区间加入索引
+        if (nfs_bitmap_init(&group->ino_bmap, group->map_inode, group->max_ino) != NFS_ERROR_NONE
+            || nfs_bitmap_init(&group->data_bmap, group->map_data, group->max_dno) != NFS_ERROR_NONE
+            || nfs_extent_build(&nfs_super.data_extents, &group->data_bmap, 
+                                g * nfs_super.data_per_group) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_NOSPACE;
+        }
     }
 
-    // 分配根节点 
+    // 分配根节点，新分配的根inode已经在inode缓存中，不必再读盘。
+    // 新格式化的磁盘在位图清零之后才写超级块，之后的元数据都经过日志，崩溃后仍能按布局重放
     if (is_init) {                                    
+        if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, 
+                             sizeof(struct nfs_super_d)) != NFS_ERROR_NONE) {
+            return -NFS_ERROR_IO;
+        }
         root_inode = nfs_alloc_inode(root_dentry);
         nfs_sync_inode(root_inode);
+        nfs_journal_commit();
     }
     
-    root_inode            = nfs_read_inode(root_dentry, NFS_ROOT_INO);
-    root_dentry->inode    = root_inode;
+    root_inode            = nfs_get_inode(root_dentry);
+    if (root_inode == NULL) {
+        return -NFS_ERROR_IO;
+    }
     nfs_super.root_dentry = root_dentry;
     nfs_super.is_mounted  = TRUE;
 
@@ -642,50 +2174,96 @@ int nfs_mount(struct custom_options options){
  */
 int nfs_umount() {
     struct nfs_super_d  nfs_super_d; 
+    struct nfs_group*   group;
 
     // 没有挂载直接报错
     if (!nfs_super.is_mounted) {
         return NFS_ERROR_NONE;
     }
 
+    // 提交并清空日志，之后的写回直接落到原位置
+    nfs_journal_destroy();
+
     // 从根节点向下刷写节点 
     nfs_sync_inode(nfs_super.root_dentry->inode);     
 
-    // 将内存中的超级块刷回磁盘                              
+    // 将内存中的超级块刷回磁盘，组描述符跟在后面
+    memset(&nfs_super_d, 0, sizeof(struct nfs_super_d));
     nfs_super_d.magic               = NFS_MAGIC_NUM;
     nfs_super_d.sz_usage            = nfs_super.sz_usage;
 
     nfs_super_d.map_inode_blks      = nfs_super.map_inode_blks;
-    nfs_super_d.map_inode_offset    = nfs_super.map_inode_offset;
-    nfs_super_d.inode_offset        = nfs_super.inode_offset;
+    nfs_super_d.map_inode_offset    = (int)nfs_super.groups[0].map_inode_offset;
+    nfs_super_d.inode_offset        = (int)nfs_super.groups[0].inode_offset;
 
     nfs_super_d.map_data_blks       = nfs_super.map_data_blks;
-    nfs_super_d.map_data_offset     = nfs_super.map_data_offset;
-    nfs_super_d.data_offset         = nfs_super.data_offset;
+    nfs_super_d.map_data_offset     = (int)nfs_super.groups[0].map_data_offset;
+    nfs_super_d.data_offset         = (int)nfs_super.groups[0].data_offset;
+
+    nfs_super_d.group_cnt           = nfs_super.group_cnt;
+    nfs_super_d.inodes_per_group    = nfs_super.inodes_per_group;
+    nfs_super_d.data_per_group      = nfs_super.data_per_group;
+    nfs_super_d.sz_ino              = nfs_super.sz_ino;
+    nfs_super_d.jnl_offset          = (int)(nfs_super.jnl_offset / NFS_BLK_SZ());
+    nfs_super_d.jnl_blks            = nfs_super.jnl_blks;
+    nfs_super_d.blks_per_group      = nfs_super.blks_per_group;
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        group = &nfs_super.groups[g];
+        nfs_super_d.groups[g].max_ino          = group->max_ino;
+        nfs_super_d.groups[g].max_dno          = group->max_dno;
+        nfs_super_d.groups[g].map_inode_offset = (int)(group->map_inode_offset / NFS_BLK_SZ());
+        nfs_super_d.groups[g].map_data_offset  = (int)(group->map_data_offset / NFS_BLK_SZ());
+        nfs_super_d.groups[g].inode_offset     = (int)(group->inode_offset / NFS_BLK_SZ());
+        nfs_super_d.groups[g].data_offset      = (int)(group->data_offset / NFS_BLK_SZ());
+        nfs_super_d.groups[g].free_inodes      = group->ino_bmap.free_cnt;
+        nfs_super_d.groups[g].free_blocks      = group->data_bmap.free_cnt;
+    }
     
     if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, 
                      sizeof(struct nfs_super_d)) != NFS_ERROR_NONE) {
         return -NFS_ERROR_IO;
     }
 
-    // 将索引位图刷回磁盘 
-    if (nfs_driver_write(nfs_super_d.map_inode_offset, (uint8_t *)(nfs_super.map_inode), 
-                         NFS_BLKS_SZ(nfs_super_d.map_inode_blks)) != NFS_ERROR_NONE) {
+    // 将各组改过的位图块刷回磁盘，日志已经关闭，直接写到原位置
+    if (nfs_journal_commit() != NFS_ERROR_NONE) {
         return -NFS_ERROR_IO;
     }
 
-    // 将数据位图刷回磁盘
-    if (nfs_driver_write(nfs_super_d.map_data_offset, (uint8_t *)(nfs_super.map_data), 
-                         NFS_BLKS_SZ(nfs_super_d.map_data_blks)) != NFS_ERROR_NONE) {
-        return -NFS_ERROR_IO;
-    }
+    nfs_pcache_clear();
+    nfs_ncache_clear();
+    nfs_icache_clear();
 
     // 释放内存中的位图
-    free(nfs_super.map_inode);
-    free(nfs_super.map_data);
+    for (int g = 0; g < nfs_super.group_cnt; g++) {
+        group = &nfs_super.groups[g];
+        nfs_bitmap_destroy(&group->ino_bmap);
+        nfs_bitmap_destroy(&group->data_bmap);
+        free(group->map_inode);
+        free(group->map_data);
+    }
+    nfs_extent_destroy(&nfs_super.data_extents);
+    nfs_itable_destroy();
+    nfs_epoch_destroy();
+    // 等待回收的对象已在上面归还，目录树中剩下的dentry、inode和名字随arena一起释放
+    nfs_name_destroy();
+    nfs_slab_destroy();
+
+#ifndef NDEBUG
+    nfs_dump_io_stat();
+#endif
 
     // 关闭驱动 
     ddriver_close(NFS_DRIVER());
 
+    for (int g = 0; g < NFS_MAX_GROUPS; g++) {
+        pthread_mutex_destroy(&nfs_super.groups[g].ino_lock);
+    }
+    nfs_lru_destroy();
+    pthread_mutex_destroy(&nfs_super.io_lock);
+    pthread_mutex_destroy(&nfs_super.dcache_lock);
+    pthread_mutex_destroy(&nfs_super.load_lock);
+    pthread_mutex_destroy(&nfs_super.alloc_lock);
+    pthread_rwlock_destroy(&nfs_super.ns_lock);
+
     return NFS_ERROR_NONE;
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#!/bin/bash
+
+TEST_CASE="case 11 - bytes per inode"
+
+# 每4096B配一个inode时4MB磁盘的布局, inode区是默认的两倍
+BPI_LAYOUT="| BSIZE = 1024 B |
+| Super(1) | Inode Map(1) | DATA Map(1) | INODE(128) | DATA(3709) | Journal(256) |"
+
+function mount_fuse_bpi () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver --bytes_per_inode="$1" "${MNTPOINT}"
+}
+
+function check_bm_bpi () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    ROOT_PARENT_PATH=$(cd $(dirname $ROOT_PATH); pwd)
+    LAYOUT_FILE=$(mktemp)
+    # checkbm.py按"|"切分布局行, 文件末尾不能有换行
+    printf "%s" "$BPI_LAYOUT" > "$LAYOUT_FILE"
+    python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$LAYOUT_FILE" -r "$ROOT_PARENT_PATH"/tests/checkbm/golden.json > /dev/null
+    RET=$?
+    rm -f "$LAYOUT_FILE"
+    if (( RET == 0 )); then
+        return 0
+    elif (( RET == 1 )); then
+        fail "$_TEST_CASE: Inode位图错误"
+    elif (( RET == 2 )); then
+        fail "$_TEST_CASE: 数据位图错误"
+    elif (( RET == 5 )); then
+        fail "$_TEST_CASE: 数据区不在预期的位置, inode区的大小与--bytes_per_inode=4096不符"
+    else
+        fail "$_TEST_CASE: checkbm.py返回$RET, 请结合报错信息自行检查"
+    fi
+    return 1
+}
+
+function check_rejected () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    sleep 1
+    if check_mount && ls "${MNTPOINT}" > /dev/null 2>&1; then
+        fail "$_TEST_CASE: --bytes_per_inode=$_PARAM小于块大小, 不应格式化并挂载"
+        return 1
+    fi
+    MAGIC=$(python3 -c 'import struct, sys; print("%x" % struct.unpack("<I", open(sys.argv[1], "rb").read(4)))' "$HOME"/ddriver)
+    if [[ "$MAGIC" == "52415453" ]]; then
+        fail "$_TEST_CASE: --bytes_per_inode=$_PARAM被拒绝时不应写入超级块"
+        return 1
+    fi
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+mount_fuse_bpi 4096
+if ! check_mount; then
+    fail "$TEST_CASE: 使用--bytes_per_inode=4096没有挂载成功"
+    exit 1
+fi
+touch_and_check "${MNTPOINT}/hello"
+clean_mount
+
+sleep 1
+
+TEST_CASE="case 11.1 - check bitmap of a disk formatted with --bytes_per_inode=4096"
+core_tester ls "${MNTPOINT}" check_bm_bpi "$TEST_CASE" 3
+
+clean_ddriver
+
+TEST_CASE="case 11.2 - reject --bytes_per_inode below the block size"
+core_tester mount_fuse_bpi 512 check_rejected "$TEST_CASE" 1
+
+fusermount -u "${MNTPOINT}" > /dev/null 2>&1
+clean_mount
+clean_ddriver
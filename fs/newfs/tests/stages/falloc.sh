@@ -0,0 +1,121 @@
+#!/bin/bash
+
+TEST_CASE="case 15 - fallocate and truncate"
+
+# $2个字符$3之后补0到$4字节
+function pattern () {
+    head -c "$2" /dev/zero | tr '\0' "$1"
+    head -c $(($3 - $2)) /dev/zero
+}
+
+# 检查文件$1的大小为$4字节, 内容是$3个字符$2, 其余为0
+function expect_pattern () {
+    SIZE=$(stat -c %s "$1" 2>/dev/null)
+    if [[ "$SIZE" != "$4" ]]; then
+        fail "$_TEST_CASE: $1的大小为${SIZE}, 应为$4"
+        return 1
+    fi
+    if ! cmp -s <(pattern "$2" "$3" "$4") "$1"; then
+        fail "$_TEST_CASE: $1的内容不对, 应为${3}个'$2', 之后到${4}B全为0"
+        return 1
+    fi
+    return 0
+}
+
+function falloc_grow () {
+    fallocate -l 3000 "${MNTPOINT}"/grow
+}
+
+function check_falloc_grow () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_pattern "${MNTPOINT}"/grow x 0 3000
+}
+
+function falloc_keep () {
+    pattern k 18 18 > "${MNTPOINT}"/keep
+    fallocate -n -l 5000 "${MNTPOINT}"/keep
+}
+
+function check_falloc_keep () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_pattern "${MNTPOINT}"/keep k 18 18
+}
+
+# 缩小后再扩大, 缩掉的部分必须读出0, 不能是原来的内容
+function truncate_shrink () {
+    pattern s 3000 3000 > "${MNTPOINT}"/shrink
+    truncate -s 1500 "${MNTPOINT}"/shrink
+    truncate -s 3000 "${MNTPOINT}"/shrink
+}
+
+function check_truncate_shrink () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_pattern "${MNTPOINT}"/shrink s 1500 3000
+}
+
+function truncate_grow () {
+    pattern h 100 100 > "${MNTPOINT}"/hole
+    truncate -s 6000 "${MNTPOINT}"/hole
+}
+
+function check_truncate_grow () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_pattern "${MNTPOINT}"/hole h 100 6000
+}
+
+function check_after_remount () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    # 根目录1块, grow 3块, keep预分配的5块, shrink剩2块, hole只有第0块;
+    # 数据区第一块可能分给了全0的grow, 所以golden-falloc.json不检查数据区是否写过
+    clean_mount
+    sleep 1
+    ROOT_PARENT_PATH=$(cd $(dirname $ROOT_PATH); pwd)
+    python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$ROOT_PARENT_PATH"/include/fs.layout -r "$ROOT_PARENT_PATH"/tests/checkbm/golden-falloc.json > /dev/null
+    RET=$?
+    try_mount_or_fail
+    if (( RET == 2 )); then
+        fail "$_TEST_CASE: 数据位图错误, 预分配的块没有保留或缩小时没有释放"
+        return 1
+    elif (( RET != 0 )); then
+        fail "$_TEST_CASE: checkbm.py返回$RET, 请结合报错信息自行检查"
+        return 1
+    fi
+    expect_pattern "${MNTPOINT}"/grow x 0 3000 || return 1
+    expect_pattern "${MNTPOINT}"/keep k 18 18 || return 1
+    expect_pattern "${MNTPOINT}"/shrink s 1500 3000 || return 1
+    expect_pattern "${MNTPOINT}"/hole h 100 6000 || return 1
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+try_mount_or_fail
+
+TEST_CASE="case 15.1 - fallocate extends the file with zeros"
+core_tester falloc_grow "$TEST_CASE" check_falloc_grow "$TEST_CASE"
+
+TEST_CASE="case 15.2 - fallocate with KEEP_SIZE keeps the file size"
+core_tester falloc_keep "$TEST_CASE" check_falloc_keep "$TEST_CASE"
+
+TEST_CASE="case 15.3 - shrinking truncate zeroes the cut tail"
+core_tester truncate_shrink "$TEST_CASE" check_truncate_shrink "$TEST_CASE"
+
+TEST_CASE="case 15.4 - growing truncate reads the hole as zeros"
+core_tester truncate_grow "$TEST_CASE" check_truncate_grow "$TEST_CASE"
+
+TEST_CASE="case 15.5 - check fallocate and truncate after remount"
+core_tester ls "${MNTPOINT}" check_after_remount "$TEST_CASE" 2
+
+clean_mount
+clean_ddriver
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+TEST_CASE="case 14 - inline data"
+
+# NFS_INLINE_SZ(): 128B的inode槽位减去56B的nfs_inode_d
+INLINE_SZ=72
+
+function golden_content () {
+    yes "inline data" | head -c "$1"
+}
+
+function write_inline () {
+    golden_content $INLINE_SZ > "${MNTPOINT}"/small
+}
+
+# 从内联文件的末尾追加一个字节，越过内联容量
+function append_past_inline () {
+    golden_content $((INLINE_SZ + 1)) | tail -c 1 >> "${MNTPOINT}"/small
+}
+
+# 卸载后按$1检查位图，再挂载回来检查small的前$2字节
+function check_bm_and_content () {
+    clean_mount
+    sleep 1
+    ROOT_PARENT_PATH=$(cd $(dirname $ROOT_PATH); pwd)
+    python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$ROOT_PARENT_PATH"/include/fs.layout -r "$ROOT_PARENT_PATH"/tests/checkbm/"$1" > /dev/null
+    RET=$?
+    try_mount_or_fail
+    if (( RET == 2 )); then
+        fail "$_TEST_CASE: 数据位图错误, ${2}B的${MNTPOINT}/small$3"
+        return 1
+    elif (( RET != 0 )); then
+        fail "$_TEST_CASE: checkbm.py返回$RET, 请结合报错信息自行检查"
+        return 1
+    fi
+    if ! cmp -s <(golden_content "$2") "${MNTPOINT}"/small; then
+        fail "$_TEST_CASE: 重新挂载后${MNTPOINT}/small的内容不对, 应为${2}B"
+        return 1
+    fi
+    return 0
+}
+
+function check_inline () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    # 根目录一个数据块, small的内容存放在inode槽位中
+    check_bm_and_content golden.json $INLINE_SZ "应当内联存放, 不占数据块"
+}
+
+function check_promoted () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    check_bm_and_content golden-promote.json $((INLINE_SZ + 1)) "应当转为普通数据块"
+}
+
+clean_mount
+clean_ddriver
+
+try_mount_or_fail
+
+TEST_CASE="case 14.1 - store a file of NFS_INLINE_SZ() bytes inline"
+core_tester write_inline "$TEST_CASE" check_inline "$TEST_CASE" 2
+
+TEST_CASE="case 14.2 - promote an inline file past NFS_INLINE_SZ()"
+core_tester append_past_inline "$TEST_CASE" check_promoted "$TEST_CASE" 2
+
+clean_mount
+clean_ddriver
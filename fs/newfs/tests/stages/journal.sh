@@ -0,0 +1,233 @@
+#!/bin/bash
+
+TEST_CASE="case 9 - journal"
+
+GOLDEN="journal replay content"
+
+function fsync_path () {
+    # 对目录做fsync即fsyncdir
+    python3 -c 'import os, sys; fd = os.open(sys.argv[1], os.O_RDONLY); os.fsync(fd); os.close(fd)' "$1"
+}
+
+function crash_fuse () {
+    # 模拟掉电: 不经umount直接杀掉守护进程，重新挂载时只有已提交的事务能恢复
+    fs_pid=$(pgrep -u $USER $PROJECT_NAME)
+    for PID in $fs_pid; do
+        kill -9 $PID
+    done
+    sleep 1
+    fusermount -u "${MNTPOINT}" > /dev/null 2>&1
+}
+
+# 把日志中最后一个完整事务的提交块校验和改坏，模拟提交块只写了一半
+function tear_last_commit () {
+    python3 - "$HOME"/ddriver <<'EOF'
+import struct, sys
+
+BLK = 1024
+DESC_MAGIC, COMMIT_MAGIC = 0x4A444553, 0x4A434D54
+
+with open(sys.argv[1], "r+b") as f:
+    f.seek(568)                                 # nfs_super_d.jnl_offset, jnl_blks
+    jnl_offset, jnl_blks = struct.unpack("<ii", f.read(8))
+    log_blks = jnl_blks - 1
+
+    def blk_ofs(pos):
+        return (jnl_offset + 1 + pos % log_blks) * BLK
+
+    def read_blk(pos):
+        f.seek(blk_ofs(pos))
+        return f.read(BLK)
+
+    f.seek(jnl_offset * BLK)
+    _, seq, pos = struct.unpack("<IIi", f.read(12))
+    last = None
+    while True:
+        magic, dseq, n = struct.unpack("<IIi", read_blk(pos)[:12])
+        if magic != DESC_MAGIC or dseq != seq:
+            break
+        magic, cseq = struct.unpack("<II", read_blk(pos + n + 1)[:8])
+        if magic != COMMIT_MAGIC or cseq != seq:
+            break
+        last = pos + n + 1
+        pos = (pos + n + 2) % log_blks
+        seq += 1
+    if last is None:
+        sys.exit(1)
+    f.seek(blk_ofs(last) + 8)                   # nfs_jcommit_d.csum
+    csum, = struct.unpack("<I", f.read(4))
+    f.seek(blk_ofs(last) + 8)
+    f.write(struct.pack("<I", csum ^ 1))
+EOF
+}
+
+function create_and_commit () {
+    mkdir_and_check "${MNTPOINT}"/dir0
+    touch_and_check "${MNTPOINT}"/dir0/file0
+    echo "$GOLDEN" > "${MNTPOINT}"/dir0/file0
+    fsync_path "${MNTPOINT}"/dir0/file0
+    # 第二个事务只有file1
+    touch_and_check "${MNTPOINT}"/dir0/file1
+    fsync_path "${MNTPOINT}"/dir0/file1
+}
+
+function check_replay () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if [[ "$(cat "${MNTPOINT}"/dir0/file0 2>/dev/null)" != "${GOLDEN}" ]]; then
+        fail "$_TEST_CASE: 已提交的${MNTPOINT}/dir0/file0在重新挂载后丢失或内容不对"
+        return 1
+    fi
+    if [[ ! -f "${MNTPOINT}"/dir0/file1 ]]; then
+        fail "$_TEST_CASE: 已提交的${MNTPOINT}/dir0/file1在重新挂载后丢失"
+        return 1
+    fi
+    return 0
+}
+
+function check_torn () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if [[ "$(cat "${MNTPOINT}"/dir0/file0 2>/dev/null)" != "${GOLDEN}" ]]; then
+        fail "$_TEST_CASE: 提交块完整的事务没有恢复, ${MNTPOINT}/dir0/file0丢失或内容不对"
+        return 1
+    fi
+    if [[ -e "${MNTPOINT}"/dir0/file1 ]]; then
+        fail "$_TEST_CASE: 提交块校验失败的事务不应被重放, 但${MNTPOINT}/dir0/file1存在"
+        return 1
+    fi
+    return 0
+}
+
+# 目录块被释放后作为普通文件的数据块直接写盘，重放时不能用日志中的旧目录块覆盖它
+function create_and_reuse () {
+    mkdir_and_check "${MNTPOINT}"/dir1
+    for i in $(seq 0 59); do
+        touch_and_check "${MNTPOINT}"/dir1/entry_with_a_long_name_$i
+    done
+    fsync_path "${MNTPOINT}"/dir1
+    rm -rf "${MNTPOINT}"/dir1
+    for i in $(seq 0 2); do
+        head -c 7168 /dev/urandom > "${MNTPOINT}"/reuse$i
+        cp "${MNTPOINT}"/reuse$i "$REUSE_DIR"/reuse$i
+        fsync_path "${MNTPOINT}"/reuse$i
+    done
+}
+
+function check_reuse () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if [[ -e "${MNTPOINT}"/dir1 ]]; then
+        fail "$_TEST_CASE: 已提交的删除在重新挂载后被撤销, ${MNTPOINT}/dir1仍然存在"
+        return 1
+    fi
+    for i in $(seq 0 2); do
+        if ! cmp -s "${MNTPOINT}"/reuse$i "$REUSE_DIR"/reuse$i; then
+            fail "$_TEST_CASE: ${MNTPOINT}/reuse$i的内容被重放的旧目录块覆盖"
+            return 1
+        fi
+    done
+    return 0
+}
+
+# 追加写2000B并fsync后不关闭文件，预留窗口里多拿的块还没有主人，此时杀掉守护进程
+function crash_with_open_file () {
+    READY=$(mktemp -u)
+    python3 -c 'import os, sys, time
+fd = os.open(sys.argv[1], os.O_WRONLY | os.O_CREAT, 0o644)
+os.write(fd, b"x" * 2000)
+os.fsync(fd)
+open(sys.argv[2], "w").close()
+time.sleep(60)' "${MNTPOINT}"/open0 "$READY" &
+    HOLDER=$!
+    for i in $(seq 0 9); do
+        [[ -e "$READY" ]] && break
+        sleep 1
+    done
+    # 先杀守护进程，文件的release不会再到达文件系统
+    fs_pid=$(pgrep -u $USER $PROJECT_NAME)
+    for PID in $fs_pid; do
+        kill -9 $PID
+    done
+    kill -9 $HOLDER
+    wait $HOLDER 2>/dev/null
+    rm -f "$READY"
+    crash_fuse
+}
+
+function check_bm_journal () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    ROOT_PARENT_PATH=$(cd $(dirname $ROOT_PATH); pwd)
+    python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$ROOT_PARENT_PATH"/include/fs.layout -r "$ROOT_PARENT_PATH"/tests/checkbm/"$JNL_RULES" > /dev/null
+    RET=$?
+    if (( RET == 0 )); then
+        return 0
+    elif (( RET == 1 )); then
+        fail "$_TEST_CASE: 重放日志后Inode位图错误"
+    elif (( RET == 2 )); then
+        fail "$_TEST_CASE: 重放日志后数据位图错误"
+    else
+        fail "$_TEST_CASE: checkbm.py返回$RET, 请结合报错信息自行检查"
+    fi
+    return 1
+}
+
+clean_mount
+clean_ddriver
+
+try_mount_or_fail
+create_and_commit
+crash_fuse
+try_mount_or_fail
+
+TEST_CASE="case 9.1 - replay committed transactions after a crash"
+core_tester ls "${MNTPOINT}"/dir0 check_replay "$TEST_CASE" 3
+
+clean_mount
+
+TEST_CASE="case 9.2 - check bitmap after replay"
+JNL_RULES=golden-journal.json
+core_tester ls "${MNTPOINT}" check_bm_journal "$TEST_CASE" 3
+
+clean_ddriver
+
+try_mount_or_fail
+create_and_commit
+crash_fuse
+tear_last_commit
+try_mount_or_fail
+
+TEST_CASE="case 9.3 - ignore a transaction with a torn commit block"
+core_tester ls "${MNTPOINT}"/dir0 check_torn "$TEST_CASE" 3
+
+clean_mount
+clean_ddriver
+
+REUSE_DIR=$(mktemp -d)
+try_mount_or_fail
+create_and_reuse
+crash_fuse
+try_mount_or_fail
+
+TEST_CASE="case 9.4 - keep reused blocks of a revoked directory"
+core_tester ls "${MNTPOINT}" check_reuse "$TEST_CASE" 3
+
+rm -rf "$REUSE_DIR"
+clean_mount
+clean_ddriver
+
+# 根目录和open0各一个inode; 根目录一个数据块，open0的2000B两个数据块
+try_mount_or_fail
+crash_with_open_file
+try_mount_or_fail
+clean_mount
+
+TEST_CASE="case 9.5 - leave no reserved blocks behind a crash with an open file"
+JNL_RULES=golden-journal-open.json
+core_tester ls "${MNTPOINT}" check_bm_journal "$TEST_CASE" 3
+
+clean_ddriver
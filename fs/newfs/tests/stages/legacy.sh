@@ -0,0 +1,68 @@
+#!/bin/bash
+
+TEST_CASE="case 8 - legacy disk"
+
+# 按最初版本的格式写一张磁盘: 超级块在0，inode位图在1024，数据位图在2048，
+# 每个inode独占一块从3072开始(64块)，根目录块里是136B的定长目录项 dir0、file0
+function make_legacy_disk () {
+    python3 - "$HOME"/ddriver <<'EOF'
+import struct, sys
+
+BLK = 1024
+INODE_OFS = 3 * BLK
+DATA_OFS = INODE_OFS + 64 * BLK
+REG, DIR = 0, 1
+
+def inode_d(ino, size, blocks, dir_cnt, ftype):
+    ptrs = blocks + [0] * (7 - len(blocks))
+    return struct.pack("<Iii7iiii", ino, size, 1, *ptrs, dir_cnt, ftype, len(blocks))
+
+def dentry_d(name, ino, ftype):
+    return struct.pack("<128sii", name.encode(), ino, ftype)
+
+with open(sys.argv[1], "r+b") as f:
+    f.seek(0)
+    f.write(struct.pack("<Iiiiiiiiii", 0x52415453, 0, 0, 1, BLK, 0, 1, 2 * BLK, INODE_OFS, DATA_OFS))
+    f.seek(BLK)
+    f.write(bytes([0x07]))
+    f.seek(2 * BLK)
+    f.write(bytes([0x01]))
+    f.seek(INODE_OFS)
+    f.write(inode_d(0, 2 * 136, [0], 2, DIR))
+    f.seek(INODE_OFS + BLK)
+    f.write(inode_d(1, 0, [], 0, DIR))
+    f.seek(INODE_OFS + 2 * BLK)
+    f.write(inode_d(2, 0, [], 0, REG))
+    f.seek(DATA_OFS)
+    f.write(dentry_d("dir0", 1, DIR) + dentry_d("file0", 2, REG))
+EOF
+}
+
+function check_refused () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    sleep 1
+    if check_mount && ls "${MNTPOINT}" > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 旧格式的磁盘不应被挂载, 目录块的格式已经改变, 需要重新格式化"
+        return 1
+    fi
+    if [[ "$(md5sum < "$HOME"/ddriver)" != "$_PARAM" ]]; then
+        fail "$_TEST_CASE: 拒绝挂载时不应改写旧格式的磁盘"
+        return 1
+    fi
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+make_legacy_disk
+DISK_SUM=$(md5sum < "$HOME"/ddriver)
+
+TEST_CASE="case 8.1 - refuse a disk formatted by the first version"
+core_tester mount_fuse "$DISK_SUM" check_refused "$TEST_CASE" 2
+
+fusermount -u "${MNTPOINT}" > /dev/null 2>&1
+clean_mount
+clean_ddriver
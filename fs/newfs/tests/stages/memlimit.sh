@@ -0,0 +1,77 @@
+#!/bin/bash
+
+TEST_CASE="case 13 - memory limit"
+
+# 8个目录共128个2KB的文件，数据块就有256KB，远超过64KB的常驻上限，遍历过程中不断有inode被换出再装载
+MEM_LIMIT=64
+DIR_CNT=8
+FILE_CNT=16
+
+function mount_fuse_limited () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver --mem_limit="$MEM_LIMIT" "${MNTPOINT}"
+    sleep 1
+    if ! check_mount; then
+        fail "$TEST_CASE: 使用--mem_limit=$MEM_LIMIT没有挂载成功"
+        exit 1
+    fi
+}
+
+function file_content () {
+    yes "dir$1/file$2" | head -c 2048
+}
+
+function create_tree () {
+    for d in $(seq 0 $((DIR_CNT - 1))); do
+        mkdir_and_check "${MNTPOINT}"/dir$d
+        mkdir_and_check "${MNTPOINT}"/dir$d/sub
+        for f in $(seq 0 $((FILE_CNT - 1))); do
+            file_content $d $f > "${MNTPOINT}"/dir$d/sub/file$f
+        done
+    done
+}
+
+function walk_tree () {
+    ls -R "${MNTPOINT}"
+}
+
+function check_tree () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    # 换出的父目录装载失败时，不能把路径当作不存在，更不能在根目录下创建
+    if [[ $(ls "${MNTPOINT}" | wc -l) -ne $DIR_CNT ]]; then
+        fail "$_TEST_CASE: 根目录下应只有${DIR_CNT}个目录, 实际为: $(ls "${MNTPOINT}" | tr '\n' ' ')"
+        return 1
+    fi
+    for d in $(seq 0 $((DIR_CNT - 1))); do
+        if [[ $(ls "${MNTPOINT}"/dir$d/sub | wc -l) -ne $FILE_CNT ]]; then
+            fail "$_TEST_CASE: ${MNTPOINT}/dir$d/sub中应有${FILE_CNT}个文件"
+            return 1
+        fi
+        for f in $(seq 0 $((FILE_CNT - 1))); do
+            if ! cmp -s <(file_content $d $f) "${MNTPOINT}"/dir$d/sub/file$f; then
+                fail "$_TEST_CASE: ${MNTPOINT}/dir$d/sub/file$f不存在或内容不对"
+                return 1
+            fi
+        done
+    done
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+mount_fuse_limited
+create_tree
+
+TEST_CASE="case 13.1 - walk a tree larger than --mem_limit"
+core_tester walk_tree "$TEST_CASE" check_tree "$TEST_CASE" 2
+
+clean_mount
+mount_fuse_limited
+
+TEST_CASE="case 13.2 - check the tree after remount with --mem_limit"
+core_tester walk_tree "$TEST_CASE" check_tree "$TEST_CASE" 2
+
+clean_mount
+clean_ddriver
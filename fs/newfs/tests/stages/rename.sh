@@ -0,0 +1,145 @@
+#!/bin/bash
+
+TEST_CASE="case 12 - rename and remove"
+
+GOLDEN_A="rename content a"
+GOLDEN_B="rename content b"
+
+function prepare_tree () {
+    mkdir_and_check "${MNTPOINT}"/dir0
+    mkdir_and_check "${MNTPOINT}"/dir1
+    mkdir_and_check "${MNTPOINT}"/dir0/sub
+    touch_and_check "${MNTPOINT}"/dir0/sub/inner
+    echo "$GOLDEN_A" > "${MNTPOINT}"/dir0/file0
+    echo "$GOLDEN_B" > "${MNTPOINT}"/dir0/file1
+    echo "old" > "${MNTPOINT}"/dir1/old
+}
+
+# 检查文件内容，$2为空时检查文件不存在
+function expect_file () {
+    if [[ -z "$2" ]]; then
+        if [[ -e "$1" ]]; then
+            fail "$_TEST_CASE: $1应当已不存在"
+            return 1
+        fi
+        return 0
+    fi
+    if [[ "$(cat "$1" 2>/dev/null)" != "$2" ]]; then
+        fail "$_TEST_CASE: $1不存在或内容不对, 应为: $2"
+        return 1
+    fi
+    return 0
+}
+
+function rename_in_dir () {
+    mv "${MNTPOINT}"/dir0/file0 "${MNTPOINT}"/dir0/file0_renamed
+}
+
+function check_rename_in_dir () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_file "${MNTPOINT}"/dir0/file0 "" || return 1
+    expect_file "${MNTPOINT}"/dir0/file0_renamed "$GOLDEN_A" || return 1
+    return 0
+}
+
+function rename_across () {
+    mv "${MNTPOINT}"/dir0/file1 "${MNTPOINT}"/dir1/file1 && mv "${MNTPOINT}"/dir0/sub "${MNTPOINT}"/dir1/sub
+}
+
+function check_rename_across () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_file "${MNTPOINT}"/dir0/file1 "" || return 1
+    expect_file "${MNTPOINT}"/dir1/file1 "$GOLDEN_B" || return 1
+    if [[ -e "${MNTPOINT}"/dir0/sub || ! -f "${MNTPOINT}"/dir1/sub/inner ]]; then
+        fail "$_TEST_CASE: 目录${MNTPOINT}/dir0/sub没有连同其中的文件移动到${MNTPOINT}/dir1/sub"
+        return 1
+    fi
+    return 0
+}
+
+function rename_over () {
+    mv -f "${MNTPOINT}"/dir1/file1 "${MNTPOINT}"/dir1/old
+}
+
+function check_rename_over () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_file "${MNTPOINT}"/dir1/file1 "" || return 1
+    expect_file "${MNTPOINT}"/dir1/old "$GOLDEN_B" || return 1
+    if [[ $(ls "${MNTPOINT}"/dir1 | wc -l) -ne 2 ]]; then
+        fail "$_TEST_CASE: 覆盖已存在的文件后${MNTPOINT}/dir1中应只剩old和sub, 实际为: $(ls "${MNTPOINT}"/dir1 | tr '\n' ' ')"
+        return 1
+    fi
+    return 0
+}
+
+function remove_entries () {
+    rm "${MNTPOINT}"/dir1/old
+    # 非空目录不能删除
+    rmdir "${MNTPOINT}"/dir1/sub 2>/dev/null
+    return 0
+}
+
+function check_remove () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_file "${MNTPOINT}"/dir1/old "" || return 1
+    if [[ ! -f "${MNTPOINT}"/dir1/sub/inner ]]; then
+        fail "$_TEST_CASE: rmdir不应删除非空目录${MNTPOINT}/dir1/sub"
+        return 1
+    fi
+    rm "${MNTPOINT}"/dir1/sub/inner
+    if ! rmdir "${MNTPOINT}"/dir1/sub || [[ -e "${MNTPOINT}"/dir1/sub ]]; then
+        fail "$_TEST_CASE: 清空后的目录${MNTPOINT}/dir1/sub应能删除"
+        return 1
+    fi
+    return 0
+}
+
+function check_after_remount () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    expect_file "${MNTPOINT}"/dir0/file0_renamed "$GOLDEN_A" || return 1
+    expect_file "${MNTPOINT}"/dir0/file0 "" || return 1
+    expect_file "${MNTPOINT}"/dir1/old "" || return 1
+    expect_file "${MNTPOINT}"/dir1/sub "" || return 1
+    if [[ $(ls "${MNTPOINT}"/dir0 | wc -l) -ne 1 || $(ls "${MNTPOINT}"/dir1 | wc -l) -ne 0 ]]; then
+        fail "$_TEST_CASE: 重新挂载后目录内容不对, dir0: $(ls "${MNTPOINT}"/dir0 | tr '\n' ' ') dir1: $(ls "${MNTPOINT}"/dir1 | tr '\n' ' ')"
+        return 1
+    fi
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+try_mount_or_fail
+prepare_tree
+
+TEST_CASE="case 12.1 - rename a file within a directory"
+core_tester rename_in_dir "$TEST_CASE" check_rename_in_dir "$TEST_CASE"
+
+TEST_CASE="case 12.2 - move a file and a directory across directories"
+core_tester rename_across "$TEST_CASE" check_rename_across "$TEST_CASE"
+
+TEST_CASE="case 12.3 - rename over an existing file"
+core_tester rename_over "$TEST_CASE" check_rename_over "$TEST_CASE"
+
+TEST_CASE="case 12.4 - rm, and rmdir of a non-empty directory"
+core_tester remove_entries "$TEST_CASE" check_remove "$TEST_CASE"
+
+clean_mount
+try_mount_or_fail
+
+TEST_CASE="case 12.5 - check renames and removals after remount"
+core_tester ls "${MNTPOINT}" check_after_remount "$TEST_CASE"
+
+clean_mount
+clean_ddriver
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+TEST_CASE="case 10 - debug statistics"
+
+# 未定义NDEBUG的构建在调试输出中报告:
+#   newfs_getattr: 已在内存中的路径解析时发生了堆分配 "heap allocations while resolving"
+#   nfs_dump_io_stat: 卸载时磁头累计移动的块数 "head travel N blks"
+# 后台定时提交会按墙上时间多出往返日志区的移动(每次约7700块), 这里用--commit_interval=0关掉,
+# 事务只在攒够修改和卸载时提交, 结果与运行快慢无关。
+# 下面100个文件的负载在4MB磁盘上实测约54000块; 新文件的数据块若随机散布在数据区, 实测约130000块
+HEAD_TRAVEL_LIMIT=80000
+
+function mount_fuse_logged () {
+    # 前台运行才能拿到调试输出; 关掉内核的属性和目录项缓存, 每次stat都会进入newfs_getattr
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver --commit_interval=0 -f \
+        -o attr_timeout=0,entry_timeout=0 "${MNTPOINT}" > "$STATS_LOG" &
+    FS_PID=$!
+    sleep 1
+    if ! check_mount; then
+        fail "$TEST_CASE: mount的返回值为0, 但是没有挂载成功, 请仔细检查"
+        exit 1
+    fi
+}
+
+function create_and_stat () {
+    for d in $(seq 0 3); do
+        mkdir_and_check "${MNTPOINT}"/dir$d
+        for f in $(seq 0 24); do
+            head -c 2048 /dev/zero | tr '\0' 'x' > "${MNTPOINT}"/dir$d/file$f
+        done
+    done
+    for i in $(seq 0 49); do
+        stat "${MNTPOINT}"/dir3/file24 > /dev/null
+    done
+    umount "${MNTPOINT}"
+    wait $FS_PID
+}
+
+function check_stats_present () {
+    if ! grep -q "head travel" "$STATS_LOG"; then
+        fail "$_TEST_CASE: 没有找到调试统计输出, 请使用未定义NDEBUG的构建"
+        return 1
+    fi
+    return 0
+}
+
+function check_resolve_alloc () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    check_stats_present || return 1
+    if grep -q "heap allocations while resolving" "$STATS_LOG"; then
+        fail "$_TEST_CASE: 解析已在内存中的路径时发生了堆分配: $(grep -m 1 "heap allocations" "$STATS_LOG")"
+        return 1
+    fi
+    return 0
+}
+
+function check_head_travel () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    check_stats_present || return 1
+    TRAVEL=$(grep -o "head travel [0-9]*" "$STATS_LOG" | tail -n 1 | awk '{print $3}')
+    if (( TRAVEL > HEAD_TRAVEL_LIMIT )); then
+        fail "$_TEST_CASE: 磁头累计移动${TRAVEL}块, 超过了${HEAD_TRAVEL_LIMIT}块"
+        return 1
+    fi
+    return 0
+}
+
+clean_mount
+clean_ddriver
+
+STATS_LOG=$(mktemp)
+mount_fuse_logged
+create_and_stat
+
+TEST_CASE="case 10.1 - resolve cached paths without heap allocations"
+core_tester ls "${MNTPOINT}" check_resolve_alloc "$TEST_CASE" 2
+
+TEST_CASE="case 10.2 - keep head travel low when placing new files"
+core_tester ls "${MNTPOINT}" check_head_travel "$TEST_CASE" 2
+
+rm -f "$STATS_LOG"
+clean_mount
+clean_ddriver